@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+# Load test the Rails example and record throughput and latency percentiles.
+#
+# Starts the example in release mode and runs wrk (https://github.com/wg/wrk) against:
+#
+#   /rust        served by Rust, the baseline
+#   /robots.txt  a static file in public/, served by Rust
+#   /up          the Rails health check, the shortest trip through Rails
+#   /manifest    a Rails view render
+#
+# Each run appends one line per page to the results file, so runs before and after
+# a change can be compared:
+#
+#   date,commit,page,connections,requests_per_sec,p50,p99
+#
+# Usage: ./load_test.sh [duration] [connections]
+#
+# Environment: THREADS (wrk threads, default 4), OUTPUT (results file, default load_test.csv),
+# RAILS_ENV (default production).
+#
+set -e
+
+DURATION=${1:-30s}
+CONNECTIONS=${2:-64}
+THREADS=${THREADS:-4}
+OUTPUT=${OUTPUT:-load_test.csv}
+URL=http://127.0.0.1:8000
+PAGES=("/rust" "/robots.txt" "/up" "/manifest")
+
+export RAILS_ENV=${RAILS_ENV:-production}
+# Rails 7.1+ doesn't need real credentials with this set.
+export SECRET_KEY_BASE_DUMMY=1
+
+if ! command -v wrk > /dev/null; then
+    echo "wrk is not installed, see https://github.com/wg/wrk"
+    exit 1
+fi
+
+cd "$(dirname "$0")"
+
+(cd todo && bundle install --quiet)
+cargo build --release
+
+cargo run --release > /dev/null 2>&1 &
+SERVER=$!
+trap "kill ${SERVER} 2> /dev/null" EXIT
+
+# Rails takes a few seconds to boot.
+for _ in $(seq 1 60); do
+    if curl -s -o /dev/null "${URL}/rust"; then
+        break
+    fi
+    sleep 1
+done
+
+if [[ ! -f "${OUTPUT}" ]]; then
+    echo "date,commit,page,connections,requests_per_sec,p50,p99" > "${OUTPUT}"
+fi
+
+DATE=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+COMMIT=$(git rev-parse --short HEAD 2> /dev/null || echo unknown)
+
+printf "%-14s %14s %10s %10s\n" "page" "requests/sec" "p50" "p99"
+
+for page in "${PAGES[@]}"; do
+    # Warm up the JIT and the caches before measuring.
+    wrk -t"${THREADS}" -c"${CONNECTIONS}" -d5s "${URL}${page}" > /dev/null
+
+    result=$(wrk -t"${THREADS}" -c"${CONNECTIONS}" -d"${DURATION}" --latency "${URL}${page}")
+
+    rps=$(echo "${result}" | awk '/Requests\/sec/ { print $2 }')
+    p50=$(echo "${result}" | awk '$1 == "50%" { print $2 }')
+    p99=$(echo "${result}" | awk '$1 == "99%" { print $2 }')
+
+    if echo "${result}" | grep -q "Non-2xx"; then
+        echo "warning: ${page} returned errors"
+    fi
+
+    printf "%-14s %14s %10s %10s\n" "${page}" "${rps}" "${p50}" "${p99}"
+    echo "${DATE},${COMMIT},${page},${CONNECTIONS},${rps},${p50},${p99}" >> "${OUTPUT}"
+done
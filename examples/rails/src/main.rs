@@ -6,7 +6,7 @@ use rwf::prelude::*;
 async fn main() -> Result<(), http::Error> {
     Logger::init();
 
-    let controller = RackController::new("todo");
+    let controller = RackController::new("todo").yjit().boot();
 
     Server::new(vec![route!("/rust" => Index), controller.wildcard("/")])
         .launch()
@@ -0,0 +1,310 @@
+//! Benchmarks for the Ruby bindings.
+//!
+//! Requests go through `rwf_app_call` to trivial Rack apps, so what's measured is the cost
+//! of the bindings: building the env, calling into Ruby, and reading the response back.
+//! Each case varies one thing: env entries, request body, response body, response headers,
+//! or chunks of a streamed body.
+//!
+//! Before each group, allocations made by one request are printed: Ruby objects,
+//! bytes malloc'ed by Ruby (with the GC off, so nothing is freed meanwhile),
+//! calls to libc `malloc` from C, i.e. Ruby and the C bindings, and allocations
+//! on the Rust side. `malloc` is only counted with glibc.
+//!
+//! ```bash
+//! cargo bench -p rwf-ruby
+//! ```
+use std::alloc::{GlobalAlloc, Layout, System};
+#[cfg(all(target_os = "linux", target_env = "gnu"))]
+use std::ffi::c_void;
+use std::hint::black_box;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use rwf_ruby::{Env, RackApp, RackRequest, RackResponseOwned, Ruby};
+
+/// Counts allocations made by Rust code, including the bindings' Rust side.
+struct Counting;
+
+static ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+
+unsafe impl GlobalAlloc for Counting {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static GLOBAL: Counting = Counting;
+
+/// Calls to libc's `malloc`, `calloc` and `realloc` by anyone in the process, the
+/// Rust allocator included. They're defined here, so they take the place of libc's
+/// for the bindings and `libruby` too, and forward to glibc's own.
+static MALLOCS: AtomicU64 = AtomicU64::new(0);
+
+#[cfg(all(target_os = "linux", target_env = "gnu"))]
+extern "C" {
+    fn __libc_malloc(size: usize) -> *mut c_void;
+    fn __libc_calloc(count: usize, size: usize) -> *mut c_void;
+    fn __libc_realloc(ptr: *mut c_void, size: usize) -> *mut c_void;
+}
+
+#[cfg(all(target_os = "linux", target_env = "gnu"))]
+#[no_mangle]
+pub unsafe extern "C" fn malloc(size: usize) -> *mut c_void {
+    MALLOCS.fetch_add(1, Ordering::Relaxed);
+    __libc_malloc(size)
+}
+
+#[cfg(all(target_os = "linux", target_env = "gnu"))]
+#[no_mangle]
+pub unsafe extern "C" fn calloc(count: usize, size: usize) -> *mut c_void {
+    MALLOCS.fetch_add(1, Ordering::Relaxed);
+    __libc_calloc(count, size)
+}
+
+#[cfg(all(target_os = "linux", target_env = "gnu"))]
+#[no_mangle]
+pub unsafe extern "C" fn realloc(ptr: *mut c_void, size: usize) -> *mut c_void {
+    MALLOCS.fetch_add(1, Ordering::Relaxed);
+    __libc_realloc(ptr, size)
+}
+
+const APPS: &str = r#"
+$rwf_bench_ok = lambda { |env| [200, {}, ["ok"]] }
+
+# Bodies are built once, so the app doesn't allocate them on every request.
+$rwf_bench_bodies = Hash.new { |bodies, size| bodies[size] = ("x" * size).freeze }
+$rwf_bench_body = lambda { |env| [200, {}, [$rwf_bench_bodies[env["QUERY_STRING"].to_i]]] }
+
+$rwf_bench_upload = lambda { |env| [200, {}, [env["rack.input"].read.bytesize.to_s]] }
+
+$rwf_bench_header_sets = Hash.new do |sets, count|
+  sets[count] = count.times.to_h { |i| ["x-header-#{i}", "value #{i}"] }
+end
+$rwf_bench_headers = lambda { |env| [200, $rwf_bench_header_sets[env["QUERY_STRING"].to_i], ["ok"]] }
+
+class RwfBenchChunks
+  CHUNK = ("x" * 1024).freeze
+
+  def initialize(count)
+    @count = count
+  end
+
+  def each
+    @count.times { yield CHUNK }
+  end
+end
+$rwf_bench_chunks = lambda { |env| [200, {}, RwfBenchChunks.new(env["QUERY_STRING"].to_i)] }
+"#;
+
+/// Boot the VM the way `Ruby::load_app` does it, with an empty app, and define the apps.
+fn boot() {
+    let path = std::env::temp_dir().join("rwf_bench_app.rb");
+    std::fs::write(&path, "").unwrap();
+    Ruby::load_app(&path).unwrap();
+    Ruby::eval(APPS).unwrap();
+}
+
+/// Base env, like the one `RackController` builds, with `extra` more headers.
+fn env(query: &str, extra: usize) -> Env {
+    let mut env = Env::new();
+    env.insert("REQUEST_METHOD", "GET");
+    env.insert("PATH_INFO", "/");
+    env.insert("REQUEST_PATH", "/");
+    env.insert("REQUEST_URI", format!("/?{}", query));
+    env.insert("QUERY_STRING", query);
+    env.header("host", "localhost");
+    env.header("user-agent", "rwf-bench");
+    env.header("accept", "*/*");
+
+    for i in 0..extra {
+        env.header(&format!("x-extra-{}", i), "value");
+    }
+
+    env
+}
+
+/// Run one request to completion, reading the streamed body if there is one.
+fn request(app: &RackApp, env: Env, body: &[u8]) -> RackResponseOwned {
+    let response = RackRequest::send(app, env, body).unwrap();
+    let owned = RackResponseOwned::from(&response);
+
+    if owned.is_stream() {
+        response
+            .each(|chunk| {
+                black_box(chunk);
+                true
+            })
+            .unwrap();
+    }
+
+    owned
+}
+
+fn ruby_malloc_bytes() -> i64 {
+    Ruby::eval("GC.stat(:malloc_increase_bytes).to_s")
+        .unwrap()
+        .to_string()
+        .parse()
+        .unwrap()
+}
+
+/// Print the allocations made by one request.
+fn report(name: &str, app: &RackApp, env: Env, body: &[u8]) {
+    // Warm up method caches and the lazily built bodies.
+    request(app, env.clone(), body);
+
+    Ruby::gc_disable();
+
+    // Reading the counter mallocs too; that much is taken off the request.
+    let first = ruby_malloc_bytes();
+    let second = ruby_malloc_bytes();
+    let overhead = second - first;
+
+    let ruby = ruby_malloc_bytes();
+    let mallocs = MALLOCS.load(Ordering::Relaxed);
+    let rust = ALLOCATIONS.load(Ordering::Relaxed);
+
+    let response = request(app, env, body);
+
+    let rust = ALLOCATIONS.load(Ordering::Relaxed) - rust;
+    let mallocs = MALLOCS.load(Ordering::Relaxed) - mallocs;
+    let ruby = ruby_malloc_bytes() - ruby - overhead;
+    Ruby::gc_enable();
+
+    // The Rust allocator mallocs too.
+    let c = mallocs.saturating_sub(rust);
+
+    println!(
+        "{:<24} {:>8} Ruby objects {:>10} bytes malloc'ed by Ruby {:>6} mallocs from C {:>6} Rust allocations",
+        name,
+        response.timings().allocated_objects,
+        ruby.max(0),
+        c,
+        rust,
+    );
+}
+
+fn env_size(c: &mut Criterion) {
+    let app = RackApp::bind("$rwf_bench_ok").unwrap();
+    let mut group = c.benchmark_group("env_size");
+    group.throughput(Throughput::Elements(1));
+
+    for extra in [0, 16, 64, 256] {
+        let env = env("", extra);
+        report(&format!("env_size/{}", env.len()), &app, env.clone(), b"");
+
+        group.bench_with_input(BenchmarkId::from_parameter(env.len()), &env, |b, env| {
+            b.iter(|| request(&app, env.clone(), b""))
+        });
+    }
+
+    group.finish();
+}
+
+fn request_body(c: &mut Criterion) {
+    let app = RackApp::bind("$rwf_bench_upload").unwrap();
+    let mut group = c.benchmark_group("request_body");
+
+    for size in [1024, 64 * 1024, 1024 * 1024, 10 * 1024 * 1024] {
+        let body = vec![b'x'; size];
+        report(&format!("request_body/{}", size), &app, env("", 0), &body);
+
+        group.throughput(Throughput::Bytes(size as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &body, |b, body| {
+            b.iter(|| request(&app, env("", 0), body))
+        });
+    }
+
+    group.finish();
+}
+
+fn response_body(c: &mut Criterion) {
+    let app = RackApp::bind("$rwf_bench_body").unwrap();
+    let mut group = c.benchmark_group("response_body");
+
+    for size in [1024, 64 * 1024, 1024 * 1024, 10 * 1024 * 1024] {
+        let env = env(&size.to_string(), 0);
+        report(&format!("response_body/{}", size), &app, env.clone(), b"");
+
+        group.throughput(Throughput::Bytes(size as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &env, |b, env| {
+            b.iter(|| request(&app, env.clone(), b"").take_body())
+        });
+    }
+
+    group.finish();
+}
+
+fn response_headers(c: &mut Criterion) {
+    let app = RackApp::bind("$rwf_bench_headers").unwrap();
+    let mut group = c.benchmark_group("response_headers");
+    group.throughput(Throughput::Elements(1));
+
+    for count in [1, 16, 64] {
+        let env = env(&count.to_string(), 0);
+        report(
+            &format!("response_headers/{}", count),
+            &app,
+            env.clone(),
+            b"",
+        );
+
+        group.bench_with_input(BenchmarkId::from_parameter(count), &env, |b, env| {
+            b.iter(|| request(&app, env.clone(), b""))
+        });
+    }
+
+    group.finish();
+}
+
+fn streamed_chunks(c: &mut Criterion) {
+    let app = RackApp::bind("$rwf_bench_chunks").unwrap();
+    let mut group = c.benchmark_group("streamed_chunks");
+
+    for count in [1, 16, 256] {
+        let env = env(&count.to_string(), 0);
+        report(
+            &format!("streamed_chunks/{}", count),
+            &app,
+            env.clone(),
+            b"",
+        );
+
+        group.throughput(Throughput::Bytes(count as u64 * 1024));
+        group.bench_with_input(BenchmarkId::from_parameter(count), &env, |b, env| {
+            b.iter(|| request(&app, env.clone(), b""))
+        });
+    }
+
+    group.finish();
+}
+
+fn bench(c: &mut Criterion) {
+    // Criterion runs everything on this thread, which is where the VM lives.
+    boot();
+
+    env_size(c);
+    request_body(c);
+    response_body(c);
+    response_headers(c);
+    streamed_chunks(c);
+}
+
+criterion_group! {
+    name = benches;
+    // 10 MB bodies take a while.
+    config = Criterion::default().sample_size(20);
+    targets = bench
+}
+criterion_main!(benches);
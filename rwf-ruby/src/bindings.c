@@ -4,63 +4,181 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <ruby.h>
+#include <ruby/thread.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "bindings.h"
 
-static int rwf_print_error(void);
+static int rwf_log_error(const char *context);
+static void rwf_deadline_start(void);
+static void rwf_deadline_clear(void);
 
-static VALUE rwf_get_class(const char *name) {
-    int state;
-    VALUE clss = rb_eval_string_protect(name, &state);
+/*
+ * Method IDs used on every request. Interned once when the VM starts
+ * instead of calling rb_intern on the hot path.
+*/
+static ID rwf_id_call;
+static ID rwf_id_to_ary;
+static ID rwf_id_path;
+static ID rwf_id_to_path;
+static ID rwf_id_each;
+static ID rwf_id_close;
+static ID rwf_id_runtime_stats;
+static ID rwf_id_message;
+static ID rwf_id_backtrace;
 
-    if (state == 0) {
-        return clss;
-    } else {
-        rwf_print_error();
-        return Qnil;
-    }
-}
+/* GC.stat keys read around every request, and GC.total_time. */
+static VALUE rwf_sym_total_allocated_objects;
+static VALUE rwf_sym_minor_gc_count;
+static VALUE rwf_sym_major_gc_count;
+static VALUE rwf_sym_time;
+static VALUE rwf_sym_compiled_iseq_count;
+static ID rwf_id_total_time;
+
+/* GC.stat and GC.start keys used by out-of-band collections. */
+static VALUE rwf_sym_heap_live_slots;
+static VALUE rwf_sym_malloc_increase_bytes;
+static VALUE rwf_sym_need_major_by;
+static VALUE rwf_sym_full_mark;
+static VALUE rwf_sym_immediate_sweep;
+static ID rwf_id_start;
+
+/* RubyVM::YJIT, looked up on the first request, once the app had a chance to enable it. */
+static VALUE rwf_yjit = Qundef;
+
+/*
+ * RubyVM::YJIT.runtime_stats builds a hash, so it's read at most this often
+ * and requests in between see the last count. Protected by the GVL.
+*/
+#define RWF_YJIT_SAMPLE_NS 1000000000
+static size_t rwf_yjit_iseqs = 0;
+static uint64_t rwf_yjit_sampled_ns = 0;
+
+/* Where exceptions that can't be returned go. */
+static rwf_error_fn rwf_error_handler = NULL;
+
+/* Smallest object slot; bigger objects use multiples of it. */
+#define RWF_SLOT_SIZE 40
+
+/* Env keys set by the bindings on every request. */
+static VALUE rwf_key_rack_input = Qnil;
+
+/* Rwf::Input, the class used for rack.input. */
+static VALUE rwf_input_class = Qnil;
+
+/* Rwf::EarlyHints, the class used for rack.early_hints. */
+static VALUE rwf_early_hints_class = Qnil;
+static VALUE rwf_key_rack_early_hints = Qnil;
+
+/* Rwf::RequestTimeout, raised in requests that run past their deadline. */
+static VALUE rwf_timeout_class = Qnil;
+
+/* How often the reaper looks for requests past their deadline. */
+#define RWF_REAPER_INTERVAL_US 50000
+
+/* Response bodies still being written by Rust, mapped to the number of pins. */
+static VALUE rwf_pinned_bodies = Qnil;
+
+static void rwf_define_input(void);
+static void rwf_define_early_hints(void);
 
 void rwf_init_ruby() {
     ruby_setup();
     ruby_init_loadpath();
     ruby_script("rwf_loader");
+
+    rwf_id_call = rb_intern("call");
+    rwf_id_to_ary = rb_intern("to_ary");
+    rwf_id_path = rb_intern("path");
+    rwf_id_to_path = rb_intern("to_path");
+    rwf_id_each = rb_intern("each");
+    rwf_id_close = rb_intern("close");
+    rwf_id_runtime_stats = rb_intern("runtime_stats");
+    rwf_id_message = rb_intern("message");
+    rwf_id_backtrace = rb_intern("backtrace");
+
+    rwf_sym_total_allocated_objects = ID2SYM(rb_intern("total_allocated_objects"));
+    rwf_sym_minor_gc_count = ID2SYM(rb_intern("minor_gc_count"));
+    rwf_sym_major_gc_count = ID2SYM(rb_intern("major_gc_count"));
+    rwf_sym_time = ID2SYM(rb_intern("time"));
+    rwf_sym_compiled_iseq_count = ID2SYM(rb_intern("compiled_iseq_count"));
+    rwf_id_total_time = rb_intern("total_time");
+    rwf_sym_heap_live_slots = ID2SYM(rb_intern("heap_live_slots"));
+    rwf_sym_malloc_increase_bytes = ID2SYM(rb_intern("malloc_increase_bytes"));
+    rwf_sym_need_major_by = ID2SYM(rb_intern("need_major_by"));
+    rwf_sym_full_mark = ID2SYM(rb_intern("full_mark"));
+    rwf_sym_immediate_sweep = ID2SYM(rb_intern("immediate_sweep"));
+    rwf_id_start = rb_intern("start");
+
+    rwf_key_rack_input = rb_interned_str_cstr("rack.input");
+    rwf_key_rack_early_hints = rb_interned_str_cstr("rack.early_hints");
+
+    rb_gc_register_address(&rwf_key_rack_input);
+    rb_gc_register_address(&rwf_key_rack_early_hints);
+    rb_gc_register_address(&rwf_input_class);
+    rb_gc_register_address(&rwf_early_hints_class);
+    rb_gc_register_address(&rwf_timeout_class);
+    rb_gc_register_address(&rwf_pinned_bodies);
+    rb_gc_register_address(&rwf_yjit);
+
+    rwf_pinned_bodies = rb_hash_new();
+    rb_funcall(rwf_pinned_bodies, rb_intern("compare_by_identity"), 0);
+
+    rwf_define_input();
+    rwf_define_early_hints();
+
+    /* Not a StandardError, so a bare rescue in the app doesn't swallow it. */
+    rwf_timeout_class = rb_define_class_under(rb_define_module("Rwf"), "RequestTimeout", rb_eException);
 }
 
 /*
  * Load the Ruby app into memory.
  * This is the only known way to execute Ruby apps from C in a way that works.
+ *
+ * options are passed to the VM like flags to the ruby command, e.g. --yjit.
+ * With a NULL path, the VM boots without loading anything, e.g. to load a rackup file
+ * with rwf_app_rackup afterwards.
+ * The VM can only be booted this way once per process.
 */
-int rwf_load_app(const char* path) {
+int rwf_load_app(const char* path, int num_options, const char **options) {
     int state;
     void *node;
 
     /* Ruby code to load the app. */
-    char *require = malloc(strlen(path) + strlen("-erequire '") + strlen("'") + 1);
-    sprintf(require, "-erequire '%s'", path);
+    char *require;
+    if (path != NULL) {
+        require = malloc(strlen(path) + strlen("-erequire '") + strlen("'") + 1);
+        sprintf(require, "-erequire '%s'", path);
+    } else {
+        require = strdup("-e;");
+    }
+
+    /* Program name, VM flags, then the require. */
+    int argc = num_options + 2;
+    char **argv = malloc(sizeof(char *) * argc);
 
-    char* options[] = {
-        "-v",
-        require,
-    };
+    argv[0] = "rwf";
+    for (int i = 0; i < num_options; i++) {
+        argv[i + 1] = (char *)options[i];
+    }
+    argv[argc - 1] = require;
 
-    node = ruby_options(2, options);
+    node = ruby_options(argc, argv);
+    int result = 0;
 
     if (ruby_executable_node(node, &state)) {
         state = ruby_exec_node(node);
+    }
 
-        if (state) {
-            rwf_print_error();
-            return -1;
-        }
-    } else {
-        rwf_print_error();
-        return -1;
+    if (state) {
+        rwf_log_error("loading the app");
+        result = -1;
     }
 
+    free(argv);
     free(require);
-    return 0;
+    return result;
 }
 
 /*
@@ -76,61 +194,222 @@ void rwf_debug_value(VALUE v) {
     rb_funcall(kernel, rb_intern("puts"), 1, methods);
 }
 
-static int rwf_is_true(VALUE v) {
-    /* I feel dumb, but Qtrue doesn't work. */
-    VALUE object_id = rb_funcall(v, rb_intern("object_id"), 0);
-    int is_true = NUM2INT(object_id);
+/*
+ * Bodies that are an Array: a single String is sent as-is,
+ * anything else is streamed with rwf_body_each.
+*/
+static VALUE rwf_array_body(VALUE ary, int *is_stream) {
+    long len = RARRAY_LEN(ary);
 
-    if (is_true == 20) {
-        return 0;
-    } else {
-        return 1;
+    if (len == 0)
+        return Qnil;
+
+    VALUE first = RARRAY_AREF(ary, 0);
+
+    if (len == 1 && RB_TYPE_P(first, T_STRING))
+        return first;
+
+    *is_stream = 1;
+    return ary;
+}
+
+/*
+ * Try to figure out what Rack returned as the body.
+ *
+ * Usually it's an Array, or a Rack::BodyProxy which duck-types to Array. Files
+ * (Rack::Files, ActionDispatch::FileBody) respond to `to_path`, which Rust can then read.
+ * Anything else that responds to `each` (ActionController::Live, an Enumerator)
+ * is streamed with rwf_body_each.
+*/
+VALUE rwf_get_body(VALUE value, int *is_file, int *is_stream) {
+    *is_file = 0;
+    *is_stream = 0;
+
+    if (RB_TYPE_P(value, T_ARRAY))
+        return rwf_array_body(value, is_stream);
+
+    if (NIL_P(value))
+        return Qnil;
+
+    if (rb_respond_to(value, rwf_id_to_ary)) {
+        VALUE ary = rb_funcall(value, rwf_id_to_ary, 0);
+
+        if (RB_TYPE_P(ary, T_ARRAY))
+            return rwf_array_body(ary, is_stream);
+    }
+
+    if (rb_respond_to(value, rwf_id_to_path)) {
+        *is_file = 1;
+        return rb_funcall(value, rwf_id_to_path, 0);
+    }
+
+    /* Older bodies, like File::Iterator, only have `path`. */
+    if (rb_respond_to(value, rwf_id_path)) {
+        *is_file = 1;
+        return rb_funcall(value, rwf_id_path, 0);
+    }
+
+    if (rb_respond_to(value, rwf_id_each)) {
+        *is_stream = 1;
+        return value;
     }
+
+    return Qnil;
 }
 
-static int rwf_is_nil(VALUE v) {
-    return rwf_is_true(rb_funcall(v, rb_intern("nil?"), 0));
+static VALUE rwf_body_close(VALUE body) {
+    if (!RB_SPECIAL_CONST_P(body) && rb_respond_to(body, rwf_id_close)) {
+        rb_funcall(body, rwf_id_close, 0);
+    }
+
+    return Qnil;
 }
 
 /*
- * Check if this value can accept a method.
- * Use this unless you're sure of the data type you're dealing with.
- * If you're wrong, the VM will segfault though.
+ * Headers collected in a single pass over the Rack headers hash.
+ * Entries point directly into the Ruby strings, so they are only valid
+ * while the response triple (and keep, for converted keys and values) is alive.
 */
-int rwf_responds_to(VALUE value, const char* name) {
-    if (value == Qnil) {
-        return 0;
+typedef struct RwfHeaders {
+    KeyValue *entries;
+    int len;
+    int cap;
+    /* Strings created while converting non-String keys and values. */
+    VALUE keep;
+} RwfHeaders;
+
+/*
+ * Header arrays are reused instead of malloc'ed for every response.
+ *
+ * Building a response takes an array from a small list of spares, dropping the response
+ * gives it back. Every thread serving requests takes them from the same list, so it works the
+ * same when each request runs on a new thread. Arrays grow to fit the largest response they
+ * held, and past RWF_SPARE_HEADERS of them the rest are freed. Responses are built and dropped
+ * with the GVL held, which is what protects the list.
+*/
+#define RWF_SPARE_HEADERS 64
+
+typedef struct RwfArena {
+    KeyValue *headers[RWF_SPARE_HEADERS];
+    int caps[RWF_SPARE_HEADERS];
+    int len;
+} RwfArena;
+
+static RwfArena rwf_arena;
+
+/* Start collecting headers, with room for at least cap of them. */
+static void rwf_headers_init(RwfHeaders *headers, int cap) {
+    if (rwf_arena.len > 0) {
+        rwf_arena.len--;
+        headers->entries = rwf_arena.headers[rwf_arena.len];
+        headers->cap = rwf_arena.caps[rwf_arena.len];
+
+        if (headers->cap < cap) {
+            headers->entries = realloc(headers->entries, cap * sizeof(KeyValue));
+            headers->cap = cap;
+        }
+    } else {
+        headers->entries = malloc(cap * sizeof(KeyValue));
+        headers->cap = cap;
+    }
+
+    headers->len = 0;
+    headers->keep = Qnil;
+}
+
+/* Done with the headers: put the array back with the spares, or free it if there are enough. */
+static void rwf_headers_release(KeyValue *entries, int cap) {
+    if (entries == NULL) {
+        return;
+    }
+
+    if (rwf_arena.len < RWF_SPARE_HEADERS) {
+        rwf_arena.headers[rwf_arena.len] = entries;
+        rwf_arena.caps[rwf_arena.len] = cap;
+        rwf_arena.len++;
+    } else {
+        free(entries);
     }
+}
+
+static VALUE rwf_header_str(RwfHeaders *headers, VALUE value) {
+    if (RB_TYPE_P(value, T_STRING))
+        return value;
+
+    if (RB_TYPE_P(value, T_SYMBOL))
+        value = rb_sym2str(value);
+    else
+        value = rb_obj_as_string(value);
+
+    if (NIL_P(headers->keep))
+        headers->keep = rb_ary_new();
+    rb_ary_push(headers->keep, value);
 
-    VALUE name_s = rb_str_new_cstr(name);
-    VALUE responds_to = rb_funcall(value, rb_intern("respond_to?"), 1, name_s);
+    return value;
+}
+
+static void rwf_header_push(RwfHeaders *headers, VALUE key, const char *value, size_t value_len) {
+    if (headers->len == headers->cap) {
+        headers->cap *= 2;
+        headers->entries = realloc(headers->entries, headers->cap * sizeof(KeyValue));
+    }
 
-    return rwf_is_true(responds_to);
+    KeyValue *entry = &headers->entries[headers->len++];
+    entry->key = RSTRING_PTR(key);
+    entry->key_len = RSTRING_LEN(key);
+    entry->value = value;
+    entry->value_len = value_len;
 }
 
 /*
- * Try to figure out what Rack returned as the body.
- *
- * So far I've discovered it can either be a BodyProxy which duck-types to array,
- * or a File::Iterator which I'm not sure what it does, but I can get the path to the file,
- * which Rust can then read.
-*/
-VALUE rwf_get_body(VALUE value, int *is_file) {
-    if (rwf_responds_to(value, "to_ary") == 0) {
-        VALUE proxy_body_ar = rb_funcall(value, rb_intern("to_ary"), 0);
-        *is_file = 0;
-        return rb_ary_entry(proxy_body_ar, 0);
-    } else if (rwf_responds_to(value, "path") == 0) {
-        VALUE path = rb_funcall(value, rb_intern("path"), 0);
-        *is_file = 1;
-        return path;
+ * Rack 2 joins repeated headers (e.g. Set-Cookie) with a newline.
+ * Emit one entry per line, pointing into the same string.
+*/
+static void rwf_header_push_lines(RwfHeaders *headers, VALUE key, VALUE value) {
+    const char *ptr = RSTRING_PTR(value);
+    const char *end = ptr + RSTRING_LEN(value);
+    const char *nl;
+
+    while ((nl = memchr(ptr, '\n', end - ptr)) != NULL) {
+        rwf_header_push(headers, key, ptr, nl - ptr);
+        ptr = nl + 1;
+    }
+
+    rwf_header_push(headers, key, ptr, end - ptr);
+}
+
+static int rwf_header_i(VALUE key, VALUE value, VALUE arg) {
+    RwfHeaders *headers = (RwfHeaders*)arg;
+
+    key = rwf_header_str(headers, key);
+
+    /* Rack 3 allows an array of values for headers that repeat. */
+    if (RB_TYPE_P(value, T_ARRAY)) {
+        for (long i = 0; i < RARRAY_LEN(value); i++) {
+            rwf_header_push_lines(headers, key, rwf_header_str(headers, RARRAY_AREF(value, i)));
+        }
     } else {
-        *is_file = 0;
-        return Qnil;
+        rwf_header_push_lines(headers, key, rwf_header_str(headers, value));
     }
+
+    return ST_CONTINUE;
+}
+
+typedef struct RwfHeadersEach {
+    VALUE headers;
+    RwfHeaders *marshal;
+} RwfHeadersEach;
+
+static VALUE rwf_headers_each(VALUE arg) {
+    RwfHeadersEach *each = (RwfHeadersEach *)arg;
+    rb_hash_foreach(each->headers, rwf_header_i, (VALUE)each->marshal);
+    return Qnil;
 }
 
-/* Parse the response from Rack. */
+/*
+ * Parse the response from Rack.
+ * Raises TypeError if it isn't a Rack response.
+*/
 RackResponse rwf_rack_response_new(VALUE value) {
     /*
         Rack returns an array of 3 elements:
@@ -138,152 +417,1251 @@ RackResponse rwf_rack_response_new(VALUE value) {
           - headers hash
           - response body, which can be a few things
     */
-    assert(TYPE(value) == T_ARRAY);
-    assert(RARRAY_LEN(value) == 3);
+    if (!RB_TYPE_P(value, T_ARRAY) || RARRAY_LEN(value) != 3) {
+        rb_raise(rb_eTypeError, "Rack app must return [status, headers, body], got %"PRIsVALUE,
+            rb_inspect(value));
+    }
 
     VALUE headers = rb_ary_entry(value, 1);
-    assert(TYPE(headers) == T_HASH);
+    Check_Type(headers, T_HASH);
 
-    RackResponse response;
+    RackResponse response = {0};
 
     response.code = NUM2INT(rb_ary_entry(value, 0));
-    response.num_headers = RHASH_SIZE(headers);
-
-    VALUE header_keys = rb_funcall(headers, rb_intern("keys"), 0);
-    response.headers = malloc(response.num_headers * sizeof(KeyValue));
+    RwfHeaders marshal;
+    rwf_headers_init(&marshal, RHASH_SIZE(headers) + 4);
 
-    for(int i = 0; i < response.num_headers; i++) {
-        VALUE header_key = rb_ary_entry(header_keys, i);
-        VALUE header_value = rb_hash_fetch(headers, header_key);
+    /* Header values can raise, e.g. a to_s that fails. */
+    RwfHeadersEach each = { headers, &marshal };
+    int headers_state;
+    rb_protect(rwf_headers_each, (VALUE)&each, &headers_state);
 
-        /* There is a MRI function for this, but I can't find it anymore */
-        VALUE header_key_symbol_str = rb_funcall(header_key, rb_intern("to_s"), 0);
-
-        char *header_key_str = StringValueCStr(header_key_symbol_str);
-        char *header_value_str = StringValueCStr(header_value);
-
-        KeyValue env_key;
-        env_key.key = header_key_str;
-        env_key.value = header_value_str;
-
-        response.headers[i] = env_key;
+    if (headers_state) {
+        rwf_headers_release(marshal.entries, marshal.cap);
+        rb_jump_tag(headers_state);
     }
 
+    response.num_headers = marshal.len;
+    response.headers = marshal.entries;
+    response.headers_cap = marshal.cap;
+    response.keep = marshal.keep;
+
     VALUE body_entry = rb_ary_entry(value, 2);
 
     // It can be an array or it can be a Proxy object which duck-types
     // to array.
-    VALUE body = rwf_get_body(body_entry, &response.is_file);
+    VALUE body = rwf_get_body(body_entry, &response.is_file, &response.is_stream);
 
-    if (rwf_is_nil(body) == 0) {
-        VALUE empty = rb_str_new_cstr("");
-        response.body = StringValueCStr(empty);
+    response.body = "";
+    response.body_len = 0;
+
+    if (response.is_stream) {
+        /* Iterated, and closed, by rwf_body_each. */
     } else {
-        response.body = StringValueCStr(body);
+        if (!NIL_P(body)) {
+            StringValue(body);
+            response.body = RSTRING_PTR(body);
+            response.body_len = RSTRING_LEN(body);
+        }
+
+        /* Rack requires the body to be closed once we're done with it. */
+        int state;
+        rb_protect(rwf_body_close, body_entry, &state);
+
+        if (state) {
+            rwf_log_error("body.close");
+        }
     }
 
+    response.body_value = body;
     response.value = value;
 
     return response;
 }
 
+typedef struct RwfBodyEach {
+    VALUE body;
+    rwf_chunk_fn f;
+    void *data;
+} RwfBodyEach;
+
+static VALUE rwf_body_chunk(RB_BLOCK_CALL_FUNC_ARGLIST(chunk, arg)) {
+    (void)argc;
+    (void)argv;
+    (void)blockarg;
+    RwfBodyEach *each = (RwfBodyEach *)arg;
+
+    StringValue(chunk);
+
+    if (each->f(each->data, RSTRING_PTR(chunk), RSTRING_LEN(chunk)) != 0) {
+        rb_iter_break();
+    }
+
+    return Qnil;
+}
+
+static VALUE rwf_body_iterate(VALUE arg) {
+    RwfBodyEach *each = (RwfBodyEach *)arg;
+    return rb_block_call(each->body, rwf_id_each, 0, NULL, rwf_body_chunk, arg);
+}
+
 /*
- * Convert bytes to a StringIO wrapped into a Rack InputWrapper expected by Rails.
+ * Iterate over a streaming body, passing each chunk to the callback as soon as
+ * Ruby produces it. The chunk is only valid for the duration of the callback.
+ * The body is closed afterwards, as required by Rack.
 */
-static VALUE rwf_request_body(const char *body) {
-    VALUE rb_str = rb_str_new_cstr(body);
-    VALUE str_io = rwf_get_class("StringIO");
-    VALUE wrapper = rwf_get_class("Rack::Lint::Wrapper::InputWrapper");
+int rwf_body_each(const RackResponse *response, rwf_chunk_fn f, void *data) {
+    if (!response->is_stream) {
+        return -1;
+    }
+
+    int state, close_state;
+    RwfBodyEach each;
+
+    each.body = response->body_value;
+    each.f = f;
+    each.data = data;
+
+    rb_protect(rwf_body_iterate, (VALUE)&each, &state);
+
+    if (state) {
+        rwf_log_error("body.each");
+    }
+
+    rb_protect(rwf_body_close, rb_ary_entry(response->value, 2), &close_state);
 
-    VALUE str_io_instance = rb_funcall(str_io, rb_intern("new"), 1, rb_str);
-    VALUE wrapper_instance = rb_funcall(wrapper, rb_intern("new"), 1, str_io_instance);
+    if (close_state) {
+        rwf_log_error("body.close");
+    }
 
-    return wrapper_instance;
+    return (state || close_state) ? -1 : 0;
 }
 
 /*
- * Execute a Rack app and return an HTTP response.
- *
- * The app_name is a Ruby string which evaluates to the Rack app, for example: `Rails.application`.
+ * rack.input implemented directly over the request body owned by Rust.
  *
- * This function isn't super safe yet. For example, if the app_name is not a Rack app, we'll segfault.
+ * Bytes are copied into a Ruby String only when the app reads them.
+ * The body is only valid while the request is running; once it's done,
+ * the input is detached and any further reads raise IOError.
 */
-int rwf_app_call(RackRequest request, const char *app_name, RackResponse *res) {
-    int state;
-    VALUE body = rwf_request_body(request.body);
+typedef struct RwfInput {
+    const char *body;
+    size_t len;
+    size_t pos;
+    int detached;
+} RwfInput;
 
-    VALUE env = rb_hash_new();
-    for (int i = 0; i < request.length; i++) {
-        VALUE key = rb_str_new_cstr(request.env[i].key);
-        VALUE value = rb_str_new_cstr(request.env[i].value);
+static size_t rwf_input_size(const void *ptr) {
+    (void)ptr;
+    return sizeof(RwfInput);
+}
 
-        rb_hash_aset(env, key, value);
+static const rb_data_type_t rwf_input_type = {
+    .wrap_struct_name = "rwf_input",
+    .function = {
+        .dmark = NULL,
+        .dfree = RUBY_TYPED_DEFAULT_FREE,
+        .dsize = rwf_input_size,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static RwfInput *rwf_input_get(VALUE self) {
+    RwfInput *input;
+    TypedData_Get_Struct(self, RwfInput, &rwf_input_type, input);
+
+    if (input->detached) {
+        rb_raise(rb_eIOError, "rack.input is not available after the request finished");
     }
 
-    VALUE body_key = rb_str_new_cstr("rack.input");
-    rb_hash_aset(env, body_key, body);
+    return input;
+}
 
-    VALUE app = rb_eval_string_protect(app_name, &state);
+static VALUE rwf_input_alloc(VALUE klass) {
+    RwfInput *input;
+    VALUE self = TypedData_Make_Struct(klass, RwfInput, &rwf_input_type, input);
+    input->detached = 1;
+    return self;
+}
 
-    if (state) {
-        rwf_print_error();
-        return -1;
+/*
+ * Take bytes from the current position and put them into the buffer, if one was given.
+*/
+static VALUE rwf_input_take(RwfInput *input, size_t len, VALUE buffer) {
+    const char *start = input->body + input->pos;
+    input->pos += len;
+
+    if (NIL_P(buffer)) {
+        return rb_str_new(start, len);
     }
 
-    VALUE response = rb_funcall(app, rb_intern("call"), 1, env);
+    StringValue(buffer);
+    rb_str_resize(buffer, 0);
+    rb_str_cat(buffer, start, len);
+    return buffer;
+}
 
-    if (rwf_print_error() != 0) {
-        return -1;
+/* Rack: gets must be called without arguments and return a String, or nil on EOF. */
+static VALUE rwf_input_gets(VALUE self) {
+    RwfInput *input = rwf_input_get(self);
+    size_t remaining = input->len - input->pos;
+
+    if (remaining == 0) {
+        return Qnil;
     }
 
-    *res = rwf_rack_response_new(response);
+    const char *newline = memchr(input->body + input->pos, '\n', remaining);
+    size_t len = newline ? (size_t)(newline - (input->body + input->pos)) + 1 : remaining;
 
-    return 0;
+    return rwf_input_take(input, len, Qnil);
 }
 
-void rwf_rack_response_drop(RackResponse *response) {
-    free(response->headers);
+/* Rack: read behaves like IO#read, read([length, [buffer]]). */
+static VALUE rwf_input_read(int argc, VALUE *argv, VALUE self) {
+    VALUE length, buffer;
+    rb_scan_args(argc, argv, "02", &length, &buffer);
+
+    RwfInput *input = rwf_input_get(self);
+    size_t remaining = input->len - input->pos;
+
+    if (NIL_P(length)) {
+        return rwf_input_take(input, remaining, buffer);
+    }
+
+    long wanted = NUM2LONG(length);
+
+    if (wanted < 0) {
+        rb_raise(rb_eArgError, "negative length %ld given", wanted);
+    }
+
+    /* At EOF, read(positive length) returns nil. */
+    if (remaining == 0 && wanted > 0) {
+        if (!NIL_P(buffer)) {
+            StringValue(buffer);
+            rb_str_resize(buffer, 0);
+        }
+        return Qnil;
+    }
+
+    size_t len = (size_t)wanted < remaining ? (size_t)wanted : remaining;
+    return rwf_input_take(input, len, buffer);
+}
+
+static VALUE rwf_input_each(VALUE self) {
+    RETURN_ENUMERATOR(self, 0, 0);
+
+    VALUE line;
+    while (!NIL_P(line = rwf_input_gets(self))) {
+        rb_yield(line);
+    }
+
+    return self;
+}
+
+static VALUE rwf_input_rewind(VALUE self) {
+    rwf_input_get(self)->pos = 0;
+    return INT2FIX(0);
+}
+
+static VALUE rwf_input_size_m(VALUE self) {
+    return SIZET2NUM(rwf_input_get(self)->len);
+}
+
+/* The body belongs to Rust, so there is nothing to close. */
+static VALUE rwf_input_close(VALUE self) {
+    (void)self;
+    return Qnil;
+}
+
+static void rwf_define_input(void) {
+    VALUE rwf_module = rb_define_module("Rwf");
+
+    rwf_input_class = rb_define_class_under(rwf_module, "Input", rb_cObject);
+    rb_define_alloc_func(rwf_input_class, rwf_input_alloc);
+    rb_undef_method(CLASS_OF(rwf_input_class), "new");
+
+    rb_define_method(rwf_input_class, "gets", rwf_input_gets, 0);
+    rb_define_method(rwf_input_class, "read", rwf_input_read, -1);
+    rb_define_method(rwf_input_class, "each", rwf_input_each, 0);
+    rb_define_method(rwf_input_class, "rewind", rwf_input_rewind, 0);
+    rb_define_method(rwf_input_class, "size", rwf_input_size_m, 0);
+    rb_define_method(rwf_input_class, "close", rwf_input_close, 0);
 }
 
 /*
- * Get the Ruby value data type.
+ * Wrap the request body into rack.input.
+ * The body is binary and isn't expected to be NUL-terminated.
 */
-int rwf_rb_type(VALUE value) {
-    return (int)(rb_type(value));
+static VALUE rwf_request_body(const char *body, size_t len) {
+    VALUE self = rwf_input_alloc(rwf_input_class);
+    RwfInput *input = RTYPEDDATA_DATA(self);
+
+    input->body = body;
+    input->len = len;
+    input->pos = 0;
+    input->detached = 0;
+
+    return self;
 }
 
 /*
- * Convert the value into a C-string.
+ * The request is done, the body is about to be freed by Rust.
 */
-char* rwf_value_cstr(VALUE value) {
-    return StringValueCStr(value);
+static void rwf_request_body_detach(VALUE self) {
+    RwfInput *input = RTYPEDDATA_DATA(self);
+
+    input->body = NULL;
+    input->len = 0;
+    input->pos = 0;
+    input->detached = 1;
 }
 
 /*
- * Clear error state when an exception is thrown.
+ * rack.early_hints, callable by the app with a hash of headers, e.g. Link preloads,
+ * while it's still working on the response. Like rack.input, it's detached once the
+ * request is done; calling it after that does nothing.
 */
-void rwf_clear_error_state() {
-    rb_set_errinfo(Qnil);
+typedef struct RwfEarlyHints {
+    rwf_early_hints_fn send;
+    void *data;
+} RwfEarlyHints;
+
+static size_t rwf_early_hints_size(const void *ptr) {
+    (void)ptr;
+    return sizeof(RwfEarlyHints);
+}
+
+static const rb_data_type_t rwf_early_hints_type = {
+    .wrap_struct_name = "rwf_early_hints",
+    .function = {
+        .dmark = NULL,
+        .dfree = RUBY_TYPED_DEFAULT_FREE,
+        .dsize = rwf_early_hints_size,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE rwf_early_hints_alloc(VALUE klass) {
+    RwfEarlyHints *hints;
+    return TypedData_Make_Struct(klass, RwfEarlyHints, &rwf_early_hints_type, hints);
+}
+
+static VALUE rwf_early_hints_new(rwf_early_hints_fn send, void *data) {
+    VALUE self = rwf_early_hints_alloc(rwf_early_hints_class);
+    RwfEarlyHints *hints = RTYPEDDATA_DATA(self);
+
+    hints->send = send;
+    hints->data = data;
+
+    return self;
+}
+
+static void rwf_early_hints_detach(VALUE self) {
+    RwfEarlyHints *hints = RTYPEDDATA_DATA(self);
+
+    hints->send = NULL;
+    hints->data = NULL;
+}
+
+/* EarlyHints#call(headers) */
+static VALUE rwf_early_hints_call(VALUE self, VALUE headers) {
+    RwfEarlyHints *hints;
+    TypedData_Get_Struct(self, RwfEarlyHints, &rwf_early_hints_type, hints);
+
+    Check_Type(headers, T_HASH);
+
+    if (hints->send == NULL || RHASH_SIZE(headers) == 0) {
+        return Qnil;
+    }
+
+    RwfHeaders marshal;
+    rwf_headers_init(&marshal, RHASH_SIZE(headers) + 4);
+
+    RwfHeadersEach each = { headers, &marshal };
+    int state;
+    rb_protect(rwf_headers_each, (VALUE)&each, &state);
+
+    if (state) {
+        rwf_headers_release(marshal.entries, marshal.cap);
+        rb_jump_tag(state);
+    }
+
+    hints->send(hints->data, marshal.entries, marshal.len);
+
+    rwf_headers_release(marshal.entries, marshal.cap);
+    RB_GC_GUARD(marshal.keep);
+    RB_GC_GUARD(headers);
+
+    return Qnil;
+}
+
+static void rwf_define_early_hints(void) {
+    rwf_early_hints_class = rb_define_class_under(rb_define_module("Rwf"), "EarlyHints", rb_cObject);
+    rb_define_alloc_func(rwf_early_hints_class, rwf_early_hints_alloc);
+    rb_define_method(rwf_early_hints_class, "call", rwf_early_hints_call, 1);
+}
+
+static void rwf_env_set(VALUE env, const char *key, VALUE value) {
+    rb_hash_aset(env, rb_interned_str_cstr(key), value);
 }
 
 /*
- * Print and clear an exception.
- * Used for debugging. We don't really expect Rack to throw an exception; that would
- * mean there is a bug in Rails exception handling.
+ * Build the env entries which are the same for every request.
+ * The hash is frozen and dup'ed for each request, so these are allocated only once.
 */
-int rwf_print_error() {
-    VALUE error = rb_errinfo();
+static VALUE rwf_base_env(void) {
+    VALUE env = rb_hash_new();
 
-    if (error != Qnil) {
-        VALUE error_str = rb_obj_as_string(error);
-        char *error_msg = StringValueCStr(error_str);
-        VALUE backtrace = rb_funcall(error, rb_intern("backtrace"), 0);
-        VALUE backtrace_obj = rb_obj_as_string(backtrace);
-        char *backtrace_str = StringValueCStr(backtrace_obj);
-        printf("error: %s\nbacktrace: %s", error_msg, backtrace_str);
-        rb_set_errinfo(Qnil);
-        return 1;
+    VALUE version = rb_ary_new_from_args(2, INT2FIX(1), INT2FIX(3));
+    rb_obj_freeze(version);
+
+    rwf_env_set(env, "rack.version", version);
+    rwf_env_set(env, "rack.url_scheme", rb_interned_str_cstr("http"));
+    rwf_env_set(env, "rack.errors", rb_stderr);
+    rwf_env_set(env, "rack.multithread", Qfalse);
+    rwf_env_set(env, "rack.multiprocess", Qfalse);
+    rwf_env_set(env, "rack.run_once", Qfalse);
+    rwf_env_set(env, "rack.hijack?", Qfalse);
+    rwf_env_set(env, "SCRIPT_NAME", rb_interned_str_cstr(""));
+    rwf_env_set(env, "SERVER_PROTOCOL", rb_interned_str_cstr("HTTP/1.1"));
+    rwf_env_set(env, "SERVER_SOFTWARE", rb_interned_str_cstr("rwf"));
+
+    return rb_obj_freeze(env);
+}
+
+static RackApp *rwf_app_new(VALUE app) {
+    RackApp *handle = malloc(sizeof(RackApp));
+    handle->app = app;
+    handle->env = rwf_base_env();
+    rb_gc_register_address(&handle->app);
+    rb_gc_register_address(&handle->env);
+
+    return handle;
+}
+
+/*
+ * Resolve a Rack app and everything needed to call it.
+ *
+ * The app_name is a Ruby string which evaluates to the Rack app, for example: `Rails.application`.
+ * It's evaluated once here, so requests don't have to run the Ruby parser.
+ * Returns NULL if the app can't be found.
+*/
+RackApp *rwf_app_bind(const char *app_name) {
+    int state;
+
+    VALUE app = rb_eval_string_protect(app_name, &state);
+
+    if (state) {
+        rwf_log_error("binding the app");
+        return NULL;
     }
 
-    return 0;
+    return rwf_app_new(app);
 }
+
+static VALUE rwf_rackup_protected(VALUE path) {
+    VALUE rack = rb_const_defined(rb_cObject, rb_intern("Rack"))
+        ? rb_const_get(rb_cObject, rb_intern("Rack"))
+        : Qnil;
+
+    if (NIL_P(rack) || !rb_const_defined(rack, rb_intern("Builder"))) {
+        rb_require("rack");
+    }
+
+    VALUE builder = rb_path2class("Rack::Builder");
+    VALUE app = rb_funcall(builder, rb_intern("parse_file"), 1, path);
+
+    /* Rack 2 returns the app and the options from the file's #\ line. */
+    if (RB_TYPE_P(app, T_ARRAY)) {
+        app = rb_ary_entry(app, 0);
+    }
+
+    return app;
+}
+
+/*
+ * Load a Rack app from a rackup file, e.g. config.ru, like rackup and Puma do,
+ * with Rack::Builder.parse_file. Rack is required first if it isn't loaded yet.
+ * Returns NULL if the file can't be loaded.
+*/
+RackApp *rwf_app_rackup(const char *path) {
+    int state;
+
+    VALUE app = rb_protect(rwf_rackup_protected, rb_str_new_cstr(path), &state);
+
+    if (state) {
+        rwf_log_error("loading the rackup file");
+        return NULL;
+    }
+
+    return rwf_app_new(app);
+}
+
+/*
+ * Set rack.multithread in the env passed to the app.
+*/
+void rwf_app_set_multithread(RackApp *app, int multithread) {
+    VALUE env = rb_hash_dup(app->env);
+    rwf_env_set(env, "rack.multithread", multithread ? Qtrue : Qfalse);
+    app->env = rb_obj_freeze(env);
+}
+
+/*
+ * Set rack.multiprocess in the env passed to the app.
+*/
+void rwf_app_set_multiprocess(RackApp *app, int multiprocess) {
+    VALUE env = rb_hash_dup(app->env);
+    rwf_env_set(env, "rack.multiprocess", multiprocess ? Qtrue : Qfalse);
+    app->env = rb_obj_freeze(env);
+}
+
+/*
+ * Release the app handle. The app itself stays in the VM.
+*/
+void rwf_app_drop(RackApp *app) {
+    if (app != NULL) {
+        rb_gc_unregister_address(&app->app);
+        rb_gc_unregister_address(&app->env);
+        free(app);
+    }
+}
+
+/* Copy a Ruby string into C memory. */
+static char *rwf_str_dup(VALUE str) {
+    long len = RSTRING_LEN(str);
+    char *copy = malloc(len + 1);
+
+    memcpy(copy, RSTRING_PTR(str), len);
+    copy[len] = '\0';
+
+    return copy;
+}
+
+typedef struct RwfCapture {
+    VALUE error;
+    RackException *err;
+} RwfCapture;
+
+static VALUE rwf_exception_fill(VALUE arg) {
+    RwfCapture *capture = (RwfCapture *)arg;
+    RackException *err = capture->err;
+
+    err->class_name = rwf_str_dup(rb_class_name(rb_obj_class(capture->error)));
+    err->message = rwf_str_dup(rb_obj_as_string(rb_funcall(capture->error, rwf_id_message, 0)));
+
+    VALUE backtrace = rb_funcall(capture->error, rwf_id_backtrace, 0);
+
+    if (RB_TYPE_P(backtrace, T_ARRAY)) {
+        long len = RARRAY_LEN(backtrace);
+        err->backtrace = malloc(sizeof(char *) * (len > 0 ? len : 1));
+
+        for (long i = 0; i < len; i++) {
+            err->backtrace[i] = rwf_str_dup(rb_obj_as_string(rb_ary_entry(backtrace, i)));
+            err->num_backtrace = i + 1;
+        }
+    }
+
+    return Qnil;
+}
+
+/*
+ * Move the pending exception out of the VM and clear it.
+ * Returns 0 if there isn't one.
+*/
+static int rwf_exception_take(RackException *err) {
+    VALUE error = rb_errinfo();
+    memset(err, 0, sizeof(RackException));
+
+    if (NIL_P(error)) {
+        return 0;
+    }
+
+    rb_set_errinfo(Qnil);
+
+    /* #message can raise too; keep whatever was copied before it did. */
+    RwfCapture capture = { error, err };
+    int state;
+    rb_protect(rwf_exception_fill, (VALUE)&capture, &state);
+
+    if (state) {
+        rb_set_errinfo(Qnil);
+    }
+
+    if (err->class_name == NULL) {
+        err->class_name = strdup("Exception");
+    }
+
+    if (err->message == NULL) {
+        err->message = strdup("");
+    }
+
+    RB_GC_GUARD(error);
+    return 1;
+}
+
+void rwf_exception_drop(RackException *err) {
+    free(err->class_name);
+    free(err->message);
+
+    for (int i = 0; i < err->num_backtrace; i++) {
+        free(err->backtrace[i]);
+    }
+    free(err->backtrace);
+
+    memset(err, 0, sizeof(RackException));
+}
+
+void rwf_set_error_handler(rwf_error_fn handler) {
+    rwf_error_handler = handler;
+}
+
+/*
+ * Report and clear the pending exception, if there is one.
+ * Returns 1 if there was one.
+*/
+static int rwf_log_error(const char *context) {
+    RackException err;
+
+    if (!rwf_exception_take(&err)) {
+        return 0;
+    }
+
+    if (rwf_error_handler != NULL) {
+        rwf_error_handler(context, &err);
+    } else {
+        fprintf(stderr, "%s: %s: %s\n", context, err.class_name, err.message);
+
+        for (int i = 0; i < err.num_backtrace; i++) {
+            fprintf(stderr, "\t%s\n", err.backtrace[i]);
+        }
+    }
+
+    rwf_exception_drop(&err);
+    return 1;
+}
+
+static uint64_t rwf_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static size_t rwf_yjit_compiled_iseqs(void) {
+    uint64_t now = rwf_now_ns();
+
+    if (rwf_yjit_sampled_ns != 0 && now - rwf_yjit_sampled_ns < RWF_YJIT_SAMPLE_NS) {
+        return rwf_yjit_iseqs;
+    }
+
+    rwf_yjit_sampled_ns = now;
+
+    if (rwf_yjit == Qundef) {
+        int state;
+        rwf_yjit = rb_eval_string_protect("defined?(RubyVM::YJIT) ? RubyVM::YJIT : nil", &state);
+
+        if (state) {
+            rb_set_errinfo(Qnil);
+            rwf_yjit = Qnil;
+        }
+    }
+
+    if (NIL_P(rwf_yjit)) {
+        return 0;
+    }
+
+    /* nil unless YJIT is enabled. */
+    VALUE stats = rb_funcall(rwf_yjit, rwf_id_runtime_stats, 0);
+
+    if (RB_TYPE_P(stats, T_HASH)) {
+        VALUE count = rb_hash_aref(stats, rwf_sym_compiled_iseq_count);
+        rwf_yjit_iseqs = NIL_P(count) ? 0 : NUM2SIZET(count);
+    }
+
+    return rwf_yjit_iseqs;
+}
+
+/*
+ * Time spent in GC so far, in microseconds. GC.stat(:time) is in milliseconds,
+ * which rounds most requests down to nothing; GC.total_time is in nanoseconds,
+ * but it's defined in gc.rb, which a VM that wasn't booted hasn't loaded.
+*/
+static size_t rwf_gc_time_us(void) {
+    if (rb_respond_to(rb_mGC, rwf_id_total_time)) {
+        return NUM2SIZET(rb_funcall(rb_mGC, rwf_id_total_time, 0)) / 1000;
+    }
+
+    return rb_gc_stat(rwf_sym_time) * 1000;
+}
+
+/* Counters the timings are computed from. */
+typedef struct RwfVmStats {
+    size_t allocated_objects;
+    size_t minor_gc_count;
+    size_t major_gc_count;
+    size_t gc_time_us;
+    size_t yjit_compiled_iseqs;
+} RwfVmStats;
+
+/*
+ * Counters before the request. The allocation counter is read last and first after it,
+ * so objects allocated by reading the others aren't counted against the request.
+*/
+static RwfVmStats rwf_vm_stats_before(void) {
+    RwfVmStats stats;
+
+    stats.yjit_compiled_iseqs = rwf_yjit_compiled_iseqs();
+    stats.minor_gc_count = rb_gc_stat(rwf_sym_minor_gc_count);
+    stats.major_gc_count = rb_gc_stat(rwf_sym_major_gc_count);
+    stats.gc_time_us = rwf_gc_time_us();
+    stats.allocated_objects = rb_gc_stat(rwf_sym_total_allocated_objects);
+
+    return stats;
+}
+
+static RwfVmStats rwf_vm_stats_after(void) {
+    RwfVmStats stats;
+
+    stats.allocated_objects = rb_gc_stat(rwf_sym_total_allocated_objects);
+    stats.minor_gc_count = rb_gc_stat(rwf_sym_minor_gc_count);
+    stats.major_gc_count = rb_gc_stat(rwf_sym_major_gc_count);
+    stats.gc_time_us = rwf_gc_time_us();
+    stats.yjit_compiled_iseqs = rwf_yjit_compiled_iseqs();
+
+    return stats;
+}
+
+typedef struct RwfCall {
+    const RackApp *app;
+    VALUE env;
+    RackResponse *res;
+    uint64_t call_done;
+} RwfCall;
+
+static VALUE rwf_app_call_funcall(VALUE arg) {
+    RwfCall *call = (RwfCall *)arg;
+    return rb_funcall(call->app->app, rwf_id_call, 1, call->env);
+}
+
+static VALUE rwf_app_call_finished(VALUE arg) {
+    (void)arg;
+    rwf_deadline_clear();
+    return Qnil;
+}
+
+static VALUE rwf_app_call_protected(VALUE arg) {
+    RwfCall *call = (RwfCall *)arg;
+
+    /*
+     * Only app.call can time out; the reaper leaves the response alone. The deadline is
+     * cleared even if app.call raises, so the reaper never raises outside of rb_protect.
+    */
+    rwf_deadline_start();
+    VALUE response = rb_ensure(rwf_app_call_funcall, arg, rwf_app_call_finished, Qnil);
+    call->call_done = rwf_now_ns();
+    *call->res = rwf_rack_response_new(response);
+
+    return Qnil;
+}
+
+/* Why app.call stopped if it wasn't an exception, for rwf_worker_run. */
+static __thread int rwf_pending_tag = 0;
+
+/*
+ * Call the app. If it raises, the exception is copied into err, the VM keeps running
+ * and -1 is returned. If the thread is killed or the VM exits, -2 is returned and the
+ * caller should stop calling into Ruby. Exceptions aren't supposed to get here, Rails handles its own,
+ * but a bug in a middleware shouldn't take the process down.
+*/
+int rwf_app_call(RackRequest request, const RackApp *app, RackResponse *res, RackException *err) {
+    if (app == NULL) {
+        return -1;
+    }
+
+    RwfVmStats before = rwf_vm_stats_before();
+    uint64_t start = rwf_now_ns();
+
+    VALUE body = rwf_request_body(request.body, request.body_len);
+
+    VALUE env = rb_hash_dup(app->env);
+    for (int i = 0; i < request.length; i++) {
+        /* Interned keys are frozen already, so the hash doesn't copy them. */
+        VALUE key = rb_interned_str(request.env[i].key, request.env[i].key_len);
+        VALUE value = rb_str_new(request.env[i].value, request.env[i].value_len);
+
+        rb_hash_aset(env, key, value);
+    }
+
+    rb_hash_aset(env, rwf_key_rack_input, body);
+
+    VALUE early_hints = Qnil;
+    if (request.early_hints != NULL) {
+        early_hints = rwf_early_hints_new(request.early_hints, request.early_hints_data);
+        rb_hash_aset(env, rwf_key_rack_early_hints, early_hints);
+    }
+
+    uint64_t env_done = rwf_now_ns();
+    RwfCall call = { app, env, res, 0 };
+    int state;
+
+    rb_protect(rwf_app_call_protected, (VALUE)&call, &state);
+    rwf_request_body_detach(body);
+
+    if (!NIL_P(early_hints)) {
+        rwf_early_hints_detach(early_hints);
+    }
+
+    if (state) {
+        /*
+         * Not an exception, e.g. the thread is being killed. Jumping from here would skip
+         * the Rust frames of the caller, so it's kept for rwf_worker_run to resume.
+        */
+        if (!rb_obj_is_kind_of(rb_errinfo(), rb_eException)) {
+            rwf_pending_tag = state;
+            return -2;
+        }
+
+        if (err != NULL) {
+            rwf_exception_take(err);
+        } else {
+            rwf_log_error("app.call");
+        }
+
+        return -1;
+    }
+
+    uint64_t call_done = call.call_done;
+    uint64_t response_done = rwf_now_ns();
+    RwfVmStats after = rwf_vm_stats_after();
+    RackTimings *timings = &res->timings;
+
+    timings->env_ns = env_done - start;
+    timings->call_ns = call_done - env_done;
+    timings->response_ns = response_done - call_done;
+    timings->allocated_objects = after.allocated_objects - before.allocated_objects;
+    timings->minor_gc_count = after.minor_gc_count - before.minor_gc_count;
+    timings->major_gc_count = after.major_gc_count - before.major_gc_count;
+    timings->gc_time_us = after.gc_time_us - before.gc_time_us;
+    timings->yjit_compiled_iseqs = after.yjit_compiled_iseqs - before.yjit_compiled_iseqs;
+
+    return 0;
+}
+
+typedef struct RwfNext {
+    const RwfServer *server;
+    void *job;
+    int result;
+} RwfNext;
+
+/* Wait for the next job. Runs without the GVL, so Ruby threads keep going meanwhile. */
+static void *rwf_server_next(void *arg) {
+    RwfNext *next = (RwfNext *)arg;
+    next->result = next->server->next(next->server->data, &next->job);
+    return NULL;
+}
+
+typedef struct RwfWorker RwfWorker;
+
+/* Jobs started by rwf_serve that haven't finished yet. */
+typedef struct RwfRunning {
+    int count;
+    VALUE thread;
+    /* Running jobs, for the reaper. */
+    RwfWorker *workers;
+    int stopped;
+} RwfRunning;
+
+struct RwfWorker {
+    const RwfServer *server;
+    void *job;
+    RwfRunning *running;
+    VALUE thread;
+    /* When the job has to be done by, 0 if it doesn't have a deadline. */
+    uint64_t deadline_ns;
+    RwfWorker *prev;
+    RwfWorker *next;
+};
+
+/* Job running on this thread. NULL outside of rwf_serve, e.g. in prefork workers. */
+static __thread RwfWorker *rwf_current_worker = NULL;
+
+static void rwf_deadline_start(void) {
+    RwfWorker *worker = rwf_current_worker;
+
+    if (worker != NULL && worker->server->timeout_ms > 0) {
+        worker->deadline_ns = rwf_now_ns() + worker->server->timeout_ms * 1000000;
+    }
+}
+
+/*
+ * The reaper only runs while this thread gives up the GVL, which it does when checking
+ * for interrupts. A timeout raised before this is delivered inside app.call.
+*/
+static void rwf_deadline_clear(void) {
+    if (rwf_current_worker != NULL) {
+        rwf_current_worker->deadline_ns = 0;
+    }
+}
+
+static VALUE rwf_worker_run(VALUE arg) {
+    RwfWorker *worker = (RwfWorker *)arg;
+
+    rwf_current_worker = worker;
+    worker->server->run(worker->server->data, worker->job);
+
+    /* The job is done with Ruby, so whatever stopped app.call can carry on now. */
+    if (rwf_pending_tag) {
+        int state = rwf_pending_tag;
+        rwf_pending_tag = 0;
+        rb_jump_tag(state);
+    }
+
+    return Qnil;
+}
+
+static VALUE rwf_worker_done(VALUE arg) {
+    RwfWorker *worker = (RwfWorker *)arg;
+    RwfRunning *running = worker->running;
+
+    rwf_current_worker = NULL;
+
+    if (worker->prev != NULL) {
+        worker->prev->next = worker->next;
+    } else {
+        running->workers = worker->next;
+    }
+    if (worker->next != NULL) {
+        worker->next->prev = worker->prev;
+    }
+
+    running->count--;
+    rb_thread_wakeup(running->thread);
+    free(worker);
+    return Qnil;
+}
+
+static VALUE rwf_worker(void *arg) {
+    return rb_ensure(rwf_worker_run, (VALUE)arg, rwf_worker_done, (VALUE)arg);
+}
+
+/*
+ * Raise Rwf::RequestTimeout in jobs past their deadline, like Thread#raise.
+ * The exception is delivered the next time the job's thread checks for interrupts,
+ * which Ruby code does all the time. A C extension blocked without releasing the GVL
+ * won't see it until it returns.
+*/
+static VALUE rwf_reaper(void *arg) {
+    RwfRunning *running = (RwfRunning *)arg;
+    VALUE message = rb_str_new_cstr("request took too long");
+    VALUE expired = rb_ary_new();
+    ID raise = rb_intern("raise");
+
+    while (!running->stopped) {
+        struct timeval interval = { 0, RWF_REAPER_INTERVAL_US };
+        rb_thread_wait_for(interval);
+
+        uint64_t now = rwf_now_ns();
+
+        for (RwfWorker *worker = running->workers; worker != NULL; worker = worker->next) {
+            if (worker->deadline_ns > 0 && now >= worker->deadline_ns) {
+                /* Once per job. */
+                worker->deadline_ns = 0;
+                rb_ary_push(expired, worker->thread);
+            }
+        }
+
+        /* Raising can switch threads, and finished jobs leave the list; it's not used after this. */
+        for (long i = 0; i < RARRAY_LEN(expired); i++) {
+            rb_funcall(rb_ary_entry(expired, i), raise, 2, rwf_timeout_class, message);
+        }
+        rb_ary_clear(expired);
+    }
+
+    RB_GC_GUARD(message);
+    RB_GC_GUARD(expired);
+    return Qnil;
+}
+
+/* Sleep until fewer than max jobs are running. Workers wake us up when they're done. */
+static void rwf_serve_wait(RwfRunning *running, int max) {
+    while (running->count > max) {
+        rb_thread_sleep_forever();
+    }
+}
+
+/*
+ * Run jobs, each in its own Ruby thread, until server->next says there won't be any more.
+ *
+ * At most max_threads jobs run at the same time. While a job waits on I/O
+ * (e.g. the database), Ruby releases the GVL and the other jobs make progress.
+ * With timeout_ms set, Rwf::RequestTimeout is raised in jobs spending longer than that in app.call.
+ * Returns once all the jobs that were started have finished.
+*/
+int rwf_serve(const RwfServer *server) {
+    RackApp *app = server->app;
+    int max_threads = server->max_threads > 0 ? server->max_threads : 1;
+
+    if (app == NULL) {
+        return -1;
+    }
+
+    if (max_threads > 1) {
+        rwf_app_set_multithread(app, 1);
+    }
+
+    RwfRunning running;
+    running.count = 0;
+    running.thread = rb_thread_current();
+    running.workers = NULL;
+    running.stopped = 0;
+
+    VALUE reaper = Qnil;
+    if (server->timeout_ms > 0) {
+        reaper = rb_thread_create(rwf_reaper, &running);
+    }
+
+    for (;;) {
+        rwf_serve_wait(&running, max_threads - 1);
+
+        RwfNext next;
+        next.server = server;
+        next.job = NULL;
+        next.result = 0;
+
+        while (next.result == 0) {
+            /* Nothing is running: a good time to collect garbage. */
+            if (running.count == 0 && server->idle != NULL) {
+                server->idle(server->data);
+            }
+
+            rb_thread_call_without_gvl(rwf_server_next, &next, NULL, NULL);
+            rb_thread_check_ints();
+        }
+
+        if (next.result < 0) {
+            break;
+        }
+
+        RwfWorker *worker = malloc(sizeof(RwfWorker));
+        worker->server = server;
+        worker->job = next.job;
+        worker->running = &running;
+        worker->deadline_ns = 0;
+        worker->prev = NULL;
+        worker->next = running.workers;
+
+        if (running.workers != NULL) {
+            running.workers->prev = worker;
+        }
+        running.workers = worker;
+
+        running.count++;
+        /* The thread doesn't start before we give up the GVL, so the handle is set in time. */
+        worker->thread = rb_thread_create(rwf_worker, worker);
+    }
+
+    /* Wait for the jobs still running. */
+    rwf_serve_wait(&running, 0);
+
+    if (!NIL_P(reaper)) {
+        running.stopped = 1;
+        rb_funcall(reaper, rb_intern("join"), 0);
+    }
+
+    return 0;
+}
+
+static VALUE rwf_fork_protected(VALUE arg) {
+    (void)arg;
+    return rb_funcall(rb_mProcess, rb_intern("fork"), 0);
+}
+
+/*
+ * Fork with Process.fork, so the VM and the app (e.g. Rails' connection pools)
+ * get to run their fork hooks. Returns the child's pid in the parent,
+ * 0 in the child, and -1 if fork failed.
+*/
+int rwf_fork(void) {
+    int state;
+    VALUE pid = rb_protect(rwf_fork_protected, Qnil, &state);
+
+    if (state) {
+        rwf_log_error("Process.fork");
+        return -1;
+    }
+
+    return NIL_P(pid) ? 0 : NUM2INT(pid);
+}
+
+/*
+ * Approximate size of the Ruby heap in bytes: live object slots
+ * plus memory malloc'ed by objects since the last GC.
+*/
+size_t rwf_gc_heap_bytes(void) {
+    size_t live_slots = rb_gc_stat(rwf_sym_heap_live_slots);
+    size_t malloc_bytes = rb_gc_stat(rwf_sym_malloc_increase_bytes);
+
+    return live_slots * RWF_SLOT_SIZE + malloc_bytes;
+}
+
+/*
+ * Run a minor GC, or a major one if asked for or if Ruby thinks one is due.
+*/
+void rwf_gc_start(int full) {
+    if (!full) {
+        full = RTEST(rb_gc_latest_gc_info(rwf_sym_need_major_by));
+    }
+
+    VALUE opts = rb_hash_new();
+    rb_hash_aset(opts, rwf_sym_full_mark, full ? Qtrue : Qfalse);
+    rb_hash_aset(opts, rwf_sym_immediate_sweep, Qtrue);
+
+    rb_funcallv_kw(rb_mGC, rwf_id_start, 1, &opts, RB_PASS_KEYWORDS);
+}
+
+/*
+ * Call f without holding the GVL, so other Ruby threads can run while we wait.
+ * f must not touch the Ruby VM.
+*/
+void rwf_without_gvl(void *(*f)(void *), void *data) {
+    rb_thread_call_without_gvl(f, data, NULL, NULL);
+}
+
+uintptr_t rwf_body_pin(const RackResponse *response, const char **ptr, size_t *len) {
+    VALUE body = response->body_value;
+
+    if (response->is_stream || response->is_file || !RB_TYPE_P(body, T_STRING))
+        return 0;
+
+    /* Frozen, so the app can't change the bytes while we're sending them. */
+    VALUE pinned = rb_str_new_frozen(body);
+
+    if (!RB_FL_TEST(pinned, RSTRING_NOEMBED))
+        return 0;
+
+    VALUE count = rb_hash_lookup2(rwf_pinned_bodies, pinned, INT2FIX(0));
+    rb_hash_aset(rwf_pinned_bodies, pinned, INT2FIX(FIX2INT(count) + 1));
+
+    *ptr = RSTRING_PTR(pinned);
+    *len = RSTRING_LEN(pinned);
+
+    return pinned;
+}
+
+void rwf_body_unpin(uintptr_t pinned) {
+    int count = FIX2INT(rb_hash_lookup2(rwf_pinned_bodies, pinned, INT2FIX(1)));
+
+    if (count > 1)
+        rb_hash_aset(rwf_pinned_bodies, pinned, INT2FIX(count - 1));
+    else
+        rb_hash_delete(rwf_pinned_bodies, pinned);
+}
+
+/* Where ActionCable events go, set by rwf_cable_install. */
+static rwf_cable_fn rwf_cable_handler = NULL;
+
+static void rwf_cable_emit(int kind, VALUE connection, VALUE identifier, VALUE stream, VALUE data) {
+    RwfCableEvent event;
+    memset(&event, 0, sizeof(RwfCableEvent));
+    event.kind = kind;
+
+    if (!NIL_P(connection)) {
+        event.connection = NUM2ULL(connection);
+    }
+
+    if (!NIL_P(identifier)) {
+        StringValue(identifier);
+        event.identifier = RSTRING_PTR(identifier);
+        event.identifier_len = RSTRING_LEN(identifier);
+    }
+
+    if (!NIL_P(stream)) {
+        StringValue(stream);
+        event.stream = RSTRING_PTR(stream);
+        event.stream_len = RSTRING_LEN(stream);
+    }
+
+    if (!NIL_P(data)) {
+        StringValue(data);
+        event.data = RSTRING_PTR(data);
+        event.data_len = RSTRING_LEN(data);
+    }
+
+    rwf_cable_handler(&event);
+
+    RB_GC_GUARD(identifier);
+    RB_GC_GUARD(stream);
+    RB_GC_GUARD(data);
+}
+
+static VALUE rwf_cable_transmit(VALUE self, VALUE connection, VALUE data) {
+    (void)self;
+    rwf_cable_emit(RWF_CABLE_TRANSMIT, connection, Qnil, Qnil, data);
+    return Qnil;
+}
+
+static VALUE rwf_cable_stream(VALUE self, VALUE connection, VALUE identifier, VALUE stream) {
+    (void)self;
+    rwf_cable_emit(RWF_CABLE_STREAM, connection, identifier, stream, Qnil);
+    return Qnil;
+}
+
+static VALUE rwf_cable_stop_stream(VALUE self, VALUE connection, VALUE identifier, VALUE stream) {
+    (void)self;
+    rwf_cable_emit(RWF_CABLE_STOP_STREAM, connection, identifier, stream, Qnil);
+    return Qnil;
+}
+
+static VALUE rwf_cable_broadcast(VALUE self, VALUE stream, VALUE data) {
+    (void)self;
+    rwf_cable_emit(RWF_CABLE_BROADCAST, Qnil, Qnil, stream, data);
+    return Qnil;
+}
+
+static VALUE rwf_cable_close(VALUE self, VALUE connection) {
+    (void)self;
+    rwf_cable_emit(RWF_CABLE_CLOSE, connection, Qnil, Qnil, Qnil);
+    return Qnil;
+}
+
+/*
+ * Define the methods Rwf::Cable uses to reach the server, all calling handler.
+ * The Ruby side of the bridge is loaded separately, after this.
+*/
+void rwf_cable_install(rwf_cable_fn handler) {
+    rwf_cable_handler = handler;
+
+    VALUE cable = rb_define_module_under(rb_define_module("Rwf"), "Cable");
+    rb_define_module_function(cable, "native_transmit", rwf_cable_transmit, 2);
+    rb_define_module_function(cable, "native_stream", rwf_cable_stream, 3);
+    rb_define_module_function(cable, "native_stop_stream", rwf_cable_stop_stream, 3);
+    rb_define_module_function(cable, "native_broadcast", rwf_cable_broadcast, 2);
+    rb_define_module_function(cable, "native_close", rwf_cable_close, 1);
+}
+
+void rwf_rack_response_drop(RackResponse *response) {
+    rwf_headers_release(response->headers, response->headers_cap);
+    response->headers = NULL;
+    response->headers_cap = 0;
+}
+
+/*
+ * Get the Ruby value data type.
+*/
+int rwf_rb_type(VALUE value) {
+    return (int)(rb_type(value));
+}
+
+/*
+ * Convert the value into a C-string.
+*/
+char* rwf_value_cstr(VALUE value) {
+    return StringValueCStr(value);
+}
+
+/*
+ * Clear error state when an exception is thrown.
+*/
+void rwf_clear_error_state() {
+    rb_set_errinfo(Qnil);
+}
+
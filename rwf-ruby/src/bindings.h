@@ -5,30 +5,185 @@
 #ifndef BINDINGS_H
 #define BINDINGS_H
 
+/*
+ * Strings are passed as pointer + length pairs.
+ * They are not NUL-terminated and can contain any bytes.
+*/
 typedef struct EnvKey {
     const char *key;
+    size_t key_len;
     const char *value;
+    size_t value_len;
 } KeyValue;
 
+/*
+ * Where a request spent its time, filled in by rwf_app_call.
+ *
+ * GC and YJIT counters are deltas over the request. When requests run concurrently,
+ * they include whatever the other Ruby threads did meanwhile.
+*/
+typedef struct RackTimings {
+    /* Building the env hash. */
+    uint64_t env_ns;
+    /* Inside app.call. */
+    uint64_t call_ns;
+    /* Reading the status, headers and body out of the response. */
+    uint64_t response_ns;
+    size_t allocated_objects;
+    size_t minor_gc_count;
+    size_t major_gc_count;
+    /* Time spent in GC, in microseconds. */
+    size_t gc_time_us;
+    /* Methods compiled by YJIT, 0 if it's off. Sampled at most once a second. */
+    size_t yjit_compiled_iseqs;
+} RackTimings;
+
 typedef struct RackResponse {
     uintptr_t value;
     int code;
     int num_headers;
     KeyValue *headers;
-    char* body;
+    /* Room in headers, which is given back to the thread's arena on drop. */
+    int headers_cap;
+    /* Body bytes, valid while the response (or a pin from rwf_body_pin) is alive. */
+    const char *body;
+    size_t body_len;
     int is_file;
+    /* The body has to be iterated with rwf_body_each. */
+    int is_stream;
+    /* Ruby object backing the body: the String, or the object to iterate when is_stream is set. */
+    uintptr_t body_value;
+    /* Strings created while marshalling headers, kept alive with the response. */
+    uintptr_t keep;
+    RackTimings timings;
 } RackResponse;
 
+/*
+ * Called for every chunk of a streaming body.
+ * Return non-zero to stop the iteration, e.g. when the client went away.
+*/
+typedef int (*rwf_chunk_fn)(void *data, const char *chunk, size_t len);
+
+/*
+ * Rack app resolved once by rwf_app_bind.
+ * The app object and the base env are registered with the GC for as long as the handle lives.
+*/
+typedef struct RackApp {
+    VALUE app;
+    VALUE env;
+} RackApp;
+
+/*
+ * Called from rack.early_hints with the headers of a 103 Early Hints response.
+ * The entries point into Ruby strings and are only valid during the call.
+*/
+typedef void (*rwf_early_hints_fn)(void *data, const KeyValue *headers, int length);
+
 typedef struct RackRequest {
     const KeyValue* env;
     const int length;
     const char *body;
+    size_t body_len;
+    /* Sets rack.early_hints if not NULL. */
+    rwf_early_hints_fn early_hints;
+    void *early_hints_data;
 } RackRequest;
 
+/*
+ * Exception raised in Ruby, copied out of the VM.
+ * The strings are malloc'ed; release them with rwf_exception_drop.
+*/
+typedef struct RackException {
+    char *class_name;
+    char *message;
+    int num_backtrace;
+    char **backtrace;
+} RackException;
+
+/*
+ * Called for exceptions the bindings can't return to the caller, e.g. raised by body.close.
+ * context says what was running. Exceptions are printed to stderr until a handler is set.
+*/
+typedef void (*rwf_error_fn)(const char *context, const RackException *err);
+
 
-int rwf_load_app(const char *path);
+int rwf_load_app(const char *path, int num_options, const char **options);
 void rwf_init_ruby(void);
 RackResponse rwf_rack_response_new(VALUE value);
-int rwf_app_call(RackRequest request, const char *app_name, RackResponse *res);
+RackApp *rwf_app_bind(const char *app_name);
+RackApp *rwf_app_rackup(const char *path);
+void rwf_app_set_multithread(RackApp *app, int multithread);
+void rwf_app_set_multiprocess(RackApp *app, int multiprocess);
+void rwf_app_drop(RackApp *app);
+int rwf_app_call(RackRequest request, const RackApp *app, RackResponse *res, RackException *err);
+void rwf_exception_drop(RackException *err);
+void rwf_set_error_handler(rwf_error_fn handler);
+int rwf_body_each(const RackResponse *response, rwf_chunk_fn f, void *data);
+
+/*
+ * Runs requests concurrently, each in its own Ruby thread.
+ *
+ * next is called without the GVL to wait for a job. It returns 1 and sets *job when there is one,
+ * 0 to check for Ruby interrupts and try again, and -1 to stop.
+ * run is called in a new Ruby thread, holding the GVL, for each job.
+ * idle, if set, is called holding the GVL when no jobs are running, before waiting for the next one.
+ * timeout_ms, if not 0, is how long app.call can run before Rwf::RequestTimeout is raised in it.
+*/
+typedef struct RwfServer {
+    RackApp *app;
+    int max_threads;
+    uint64_t timeout_ms;
+    int (*next)(void *data, void **job);
+    void (*run)(void *data, void *job);
+    void (*idle)(void *data);
+    void *data;
+} RwfServer;
+
+int rwf_serve(const RwfServer *server);
+int rwf_fork(void);
+size_t rwf_gc_heap_bytes(void);
+void rwf_gc_start(int full);
+void rwf_without_gvl(void *(*f)(void *), void *data);
+
+/*
+ * Keep the body String alive after the response is dropped, so its bytes can be
+ * written to the socket without copying. Returns 0 if the bytes can't be pinned,
+ * e.g. short strings embedded in the object which the GC is free to move.
+ * Release with rwf_body_unpin, from the Ruby thread.
+*/
+uintptr_t rwf_body_pin(const RackResponse *response, const char **ptr, size_t *len);
+void rwf_body_unpin(uintptr_t pinned);
+
+/*
+ * Sent by the ActionCable bridge (Rwf::Cable) to the server:
+ * - TRANSMIT: data for one connection, already encoded
+ * - STREAM, STOP_STREAM: the connection's subscription (identifier) starts or stops streaming from stream
+ * - BROADCAST: data broadcast to stream, for all connections streaming from it
+ * - CLOSE: close the connection, after sending what it was transmitted
+ * Strings are only valid during the call.
+*/
+enum {
+    RWF_CABLE_TRANSMIT,
+    RWF_CABLE_STREAM,
+    RWF_CABLE_STOP_STREAM,
+    RWF_CABLE_BROADCAST,
+    RWF_CABLE_CLOSE,
+};
+
+typedef struct RwfCableEvent {
+    int kind;
+    uint64_t connection;
+    const char *identifier;
+    size_t identifier_len;
+    const char *stream;
+    size_t stream_len;
+    const char *data;
+    size_t data_len;
+} RwfCableEvent;
+
+/* Called holding the GVL, from whichever Ruby thread sent the event. It must not block. */
+typedef void (*rwf_cable_fn)(const RwfCableEvent *event);
+
+void rwf_cable_install(rwf_cable_fn handler);
 
 #endif
@@ -0,0 +1,199 @@
+# ActionCable, with the WebSocket connections held by Rwf.
+#
+# Rwf accepts the connections, frames messages and sends the pings. Ruby only sees
+# connections opening and closing, and the commands clients send (subscribe, unsubscribe,
+# message), which come in as calls to Rwf::Cable.server, the same way as Rack requests.
+# Connections and channels are ActionCable's own, so `connect`, `identified_by`,
+# `subscribed`, `stream_from` and `perform` work as usual.
+#
+# Streams set up with stream_from, without a callback, are kept by Rwf: the broadcasting
+# is subscribed to once per process with the pubsub adapter, and every broadcast goes to
+# all the connections streaming from it without calling Ruby for each of them.
+#
+# The native_* methods are defined by the bindings before this is loaded.
+module Rwf
+  module Cable
+    PROTOCOL = "actioncable-v1-json"
+
+    # What ActionCable::Connection::Base writes to, instead of its WebSocket.
+    class Socket
+      attr_reader :protocol
+
+      def initialize(id)
+        @id = id
+        @protocol = PROTOCOL
+        @alive = true
+      end
+
+      def possible?
+        true
+      end
+
+      def alive?
+        @alive
+      end
+
+      def transmit(data)
+        Cable.native_transmit(@id, data) if @alive
+      end
+
+      def close(*)
+        return unless @alive
+
+        @alive = false
+        Cable.native_close(@id)
+      end
+    end
+
+    # Added to the connections opened by Rwf.
+    module Connection
+      attr_accessor :rwf_id
+    end
+
+    # Prepended to ActionCable::Channel::Base. Streams with a callback or a coder
+    # need Ruby for every broadcast and stay with ActionCable.
+    module Streams
+      def stream_from(broadcasting, callback = nil, coder: nil, &block)
+        return super if callback || block || coder || !connection.respond_to?(:rwf_id)
+
+        broadcasting = String(broadcasting)
+        return if rwf_streams.include?(broadcasting)
+
+        rwf_streams << broadcasting
+        Cable.native_stream(connection.rwf_id, identifier, broadcasting)
+        Cable.broadcastings.add(broadcasting)
+      end
+
+      def stop_stream_from(broadcasting)
+        broadcasting = String(broadcasting)
+        return super unless rwf_streams.delete(broadcasting)
+
+        rwf_stop_stream(broadcasting)
+      end
+
+      def stop_all_streams
+        rwf_streams.each { |broadcasting| rwf_stop_stream(broadcasting) }
+        rwf_streams.clear
+        super
+      end
+
+      private
+
+      def rwf_streams
+        @rwf_streams ||= []
+      end
+
+      def rwf_stop_stream(broadcasting)
+        Cable.native_stop_stream(connection.rwf_id, identifier, broadcasting)
+        Cable.broadcastings.remove(broadcasting)
+      end
+    end
+
+    # Broadcastings Rwf's connections stream from, each subscribed to once.
+    class Broadcastings
+      def initialize
+        @mutex = Mutex.new
+        @handlers = {}
+        @counts = Hash.new(0)
+      end
+
+      def add(broadcasting)
+        @mutex.synchronize do
+          @counts[broadcasting] += 1
+          next if @handlers.key?(broadcasting)
+
+          # Payloads are already encoded; Rwf puts them in the messages as they are.
+          handler = ->(payload) { Cable.native_broadcast(broadcasting, payload) }
+          @handlers[broadcasting] = handler
+          ActionCable.server.pubsub.subscribe(broadcasting, handler)
+        end
+      end
+
+      def remove(broadcasting)
+        @mutex.synchronize do
+          next unless @handlers.key?(broadcasting)
+
+          @counts[broadcasting] -= 1
+          next if @counts[broadcasting] > 0
+
+          @counts.delete(broadcasting)
+          ActionCable.server.pubsub.unsubscribe(broadcasting, @handlers.delete(broadcasting))
+        end
+      end
+    end
+
+    # Called by Rwf for connection events. rwf.cable is open, message or close, and
+    # rwf.cable.connection the connection id. Opens get the env of the upgrade request.
+    class Server
+      OK = [200, {}, []].freeze
+      NOT_FOUND = [404, {}, []].freeze
+
+      def initialize
+        @mutex = Mutex.new
+        @connections = {}
+      end
+
+      def call(env)
+        id = Integer(env["rwf.cable.connection"])
+
+        case env["rwf.cable"]
+        when "open" then open(id, env)
+        when "message" then message(id, env["rack.input"].read)
+        when "close" then close(id)
+        else NOT_FOUND
+        end
+      end
+
+      private
+
+      def open(id, env)
+        server = ActionCable.server
+
+        # What Rails adds to the env before routing, e.g. to read encrypted cookies.
+        env.merge!(Rails.application.env_config) if defined?(Rails) && Rails.application
+
+        connection = server.config.connection_class.call.new(server, env)
+        connection.instance_variable_set(:@websocket, Socket.new(id))
+        connection.extend(Connection)
+        connection.rwf_id = id
+
+        return NOT_FOUND unless connection.send(:allow_request_origin?)
+
+        @mutex.synchronize { @connections[id] = connection }
+        server.worker_pool.invoke(connection, :handle_open, connection: connection)
+
+        # Rwf sends the pings, so ActionCable's heartbeat can skip this connection.
+        server.remove_connection(connection)
+        OK
+      end
+
+      def message(id, data)
+        connection = @mutex.synchronize { @connections[id] }
+        return NOT_FOUND unless connection
+
+        connection.server.worker_pool.invoke(
+          connection, :dispatch_websocket_message, data, connection: connection
+        )
+        OK
+      end
+
+      def close(id)
+        connection = @mutex.synchronize { @connections.delete(id) }
+        return NOT_FOUND unless connection
+
+        connection.server.worker_pool.invoke(connection, :handle_close, connection: connection)
+        OK
+      end
+    end
+
+    class << self
+      attr_reader :server, :broadcastings
+
+      def install!
+        ActionCable::Channel::Base.prepend(Streams)
+        @broadcastings = Broadcastings.new
+        @server = Server.new
+      end
+    end
+  end
+end
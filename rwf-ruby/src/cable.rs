@@ -0,0 +1,364 @@
+//! ActionCable bridge: WebSocket connections live in the server, channels run in Ruby.
+//!
+//! [`install`] loads `Rwf::Cable` ([src/cable.rb](cable.rb)) into the VM and returns it as a
+//! [`RackApp`]. The server calls it for connection events: opens, client commands and closes.
+//! Everything ActionCable sends back, e.g. messages for one connection or broadcasts for
+//! everyone streaming from a broadcasting, comes out as an [`Event`].
+use std::ffi::c_char;
+use std::panic::{catch_unwind, AssertUnwindSafe};
+use std::slice;
+
+use once_cell::sync::OnceCell;
+use tracing::error;
+
+use super::{rwf_cable_install, Error, RackApp, Ruby};
+
+const TRANSMIT: i32 = 0;
+const STREAM: i32 = 1;
+const STOP_STREAM: i32 = 2;
+const BROADCAST: i32 = 3;
+const CLOSE: i32 = 4;
+
+/// Sent by ActionCable to the server. Borrowed from Ruby for the duration of the call.
+#[derive(Debug, PartialEq)]
+pub enum Event<'a> {
+    /// Message for one connection, e.g. a subscription confirmation, encoded as JSON.
+    Transmit { connection: u64, message: &'a [u8] },
+    /// The connection's subscription starts streaming from a broadcasting.
+    Stream {
+        connection: u64,
+        identifier: &'a [u8],
+        stream: &'a [u8],
+    },
+    /// The subscription stops streaming from the broadcasting.
+    StopStream {
+        connection: u64,
+        identifier: &'a [u8],
+        stream: &'a [u8],
+    },
+    /// Payload broadcast to a broadcasting, encoded as JSON.
+    Broadcast { stream: &'a [u8], payload: &'a [u8] },
+    /// Close the connection, e.g. it wasn't authorized, once what it was sent is delivered.
+    Close { connection: u64 },
+}
+
+type Handler = Box<dyn Fn(Event<'_>) + Send + Sync>;
+
+static HANDLER: OnceCell<Handler> = OnceCell::new();
+
+#[repr(C)]
+pub(crate) struct RwfCableEvent {
+    kind: i32,
+    connection: u64,
+    identifier: *const c_char,
+    identifier_len: usize,
+    stream: *const c_char,
+    stream_len: usize,
+    data: *const c_char,
+    data_len: usize,
+}
+
+/// Load the bridge into the VM, once the app using ActionCable is loaded, and get the app
+/// to send connection events to.
+///
+/// `handler` gets the events, holding the GVL, from whichever Ruby thread sent them;
+/// it mustn't block. It can only be installed once per process.
+///
+/// Connection events are Rack calls with these env keys:
+///
+/// - `rwf.cable`: `open`, `message` or `close`
+/// - `rwf.cable.connection`: connection id, chosen by the server
+///
+/// Opens should carry the env of the upgrade request, for cookies and the origin check;
+/// they're answered with `404` if the connection is refused. Messages have the command
+/// the client sent, e.g. `{"command":"subscribe",...}`, as their body.
+pub fn install(handler: impl Fn(Event<'_>) + Send + Sync + 'static) -> Result<RackApp, Error> {
+    Ruby::init()?;
+
+    if HANDLER.set(Box::new(handler)).is_err() {
+        return Err(Error::Eval {
+            err: "ActionCable bridge is already installed".into(),
+        });
+    }
+
+    unsafe { rwf_cable_install(dispatch) };
+
+    Ruby::eval(include_str!("cable.rb"))?;
+    Ruby::eval("Rwf::Cable.install!")?;
+
+    RackApp::bind("Rwf::Cable.server")
+}
+
+extern "C" fn dispatch(event: *const RwfCableEvent) {
+    let event = unsafe { &*event };
+    let bytes = |ptr: *const c_char, len: usize| {
+        if ptr.is_null() {
+            &[][..]
+        } else {
+            unsafe { slice::from_raw_parts(ptr as *const u8, len) }
+        }
+    };
+
+    let identifier = bytes(event.identifier, event.identifier_len);
+    let stream = bytes(event.stream, event.stream_len);
+    let data = bytes(event.data, event.data_len);
+    let connection = event.connection;
+
+    let event = match event.kind {
+        TRANSMIT => Event::Transmit {
+            connection,
+            message: data,
+        },
+        STREAM => Event::Stream {
+            connection,
+            identifier,
+            stream,
+        },
+        STOP_STREAM => Event::StopStream {
+            connection,
+            identifier,
+            stream,
+        },
+        BROADCAST => Event::Broadcast {
+            stream,
+            payload: data,
+        },
+        CLOSE => Event::Close { connection },
+        _ => return,
+    };
+
+    if let Some(handler) = HANDLER.get() {
+        // Unwinding through Ruby isn't allowed.
+        if catch_unwind(AssertUnwindSafe(|| handler(event))).is_err() {
+            error!("ActionCable event handler panicked");
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::test::{boot, on_ruby_thread};
+    use crate::{Env, RackRequest, RackResponseOwned};
+    use std::sync::{Arc, Mutex};
+
+    #[test]
+    fn test_action_cable() {
+        on_ruby_thread(test_action_cable_inner);
+    }
+
+    fn test_action_cable_inner() {
+        // Kernel#Integer and friends need the VM booted the way load_app does it.
+        boot();
+
+        // ActionCable isn't installed with Ruby; stand in for the parts the bridge uses.
+        Ruby::eval(
+            r#"
+            require "json"
+
+            module ActionCable
+              def self.server
+                @server ||= Server.new
+              end
+
+              class PubSub
+                def initialize
+                  @subscribers = Hash.new { |subscribers, broadcasting| subscribers[broadcasting] = [] }
+                end
+
+                def subscribe(broadcasting, handler, success = nil)
+                  @subscribers[broadcasting] << handler
+                end
+
+                def unsubscribe(broadcasting, handler)
+                  @subscribers[broadcasting].delete(handler)
+                end
+
+                def broadcast(broadcasting, payload)
+                  @subscribers[broadcasting].each { |handler| handler.call(payload) }
+                end
+
+                def count(broadcasting)
+                  @subscribers[broadcasting].size
+                end
+              end
+
+              class WorkerPool
+                def invoke(receiver, method, *args, connection:)
+                  receiver.send(method, *args)
+                end
+              end
+
+              class Server
+                Config = Struct.new(:connection_class)
+                attr_reader :pubsub, :worker_pool, :config
+
+                def initialize
+                  @pubsub = PubSub.new
+                  @worker_pool = WorkerPool.new
+                  @config = Config.new(-> { Connection::Base })
+                end
+
+                def remove_connection(connection); end
+              end
+
+              module Connection
+                class Base
+                  attr_reader :server, :env
+
+                  def initialize(server, env)
+                    @server = server
+                    @env = env
+                    @subscriptions = {}
+                  end
+
+                  def transmit(message)
+                    @websocket.transmit(JSON.generate(message))
+                  end
+
+                  def close(reason: nil, reconnect: true)
+                    transmit(type: "disconnect", reason: reason, reconnect: reconnect)
+                    @websocket.close
+                  end
+
+                  def dispatch_websocket_message(data)
+                    command = JSON.parse(data)
+                    identifier = command["identifier"]
+
+                    case command["command"]
+                    when "subscribe"
+                      @subscriptions[identifier] = Channel::Base.new(self, identifier)
+                      @subscriptions[identifier].subscribe_to_channel
+                    when "unsubscribe"
+                      @subscriptions.delete(identifier)&.unsubscribe_from_channel
+                    end
+                  end
+
+                  private
+
+                  def allow_request_origin?
+                    env["HTTP_ORIGIN"] != "https://evil.example"
+                  end
+
+                  def handle_open
+                    return close(reason: "unauthorized", reconnect: false) unless env["HTTP_COOKIE"]
+
+                    transmit(type: "welcome")
+                  end
+
+                  def handle_close
+                    @subscriptions.each_value(&:unsubscribe_from_channel)
+                  end
+                end
+              end
+
+              module Channel
+                class Base
+                  attr_reader :connection, :identifier
+
+                  def initialize(connection, identifier)
+                    @connection = connection
+                    @identifier = identifier
+                  end
+
+                  def subscribe_to_channel
+                    stream_from "room_#{JSON.parse(identifier)["room"]}"
+                    connection.transmit(identifier: identifier, type: "confirm_subscription")
+                  end
+
+                  def unsubscribe_from_channel
+                    stop_all_streams
+                  end
+
+                  def stream_from(*)
+                    raise "should be streamed by Rwf"
+                  end
+
+                  def stop_all_streams; end
+                end
+              end
+            end
+            "#,
+        )
+        .unwrap();
+
+        let events = Arc::new(Mutex::new(vec![]));
+        let recorded = events.clone();
+
+        let app = install(move |event| {
+            let text = |bytes: &[u8]| String::from_utf8_lossy(bytes).to_string();
+            let event = match event {
+                Event::Transmit {
+                    connection,
+                    message,
+                } => format!("transmit {} {}", connection, text(message)),
+                Event::Stream {
+                    connection, stream, ..
+                } => format!("stream {} {}", connection, text(stream)),
+                Event::StopStream {
+                    connection, stream, ..
+                } => format!("stop {} {}", connection, text(stream)),
+                Event::Broadcast { stream, payload } => {
+                    format!("broadcast {} {}", text(stream), text(payload))
+                }
+                Event::Close { connection } => format!("close {}", connection),
+            };
+            recorded.lock().unwrap().push(event);
+        })
+        .unwrap();
+
+        let send = |event: &str, connection: u64, headers: &[(&str, &str)], body: &str| {
+            let mut env = Env::new();
+            env.insert("rwf.cable", event);
+            env.insert("rwf.cable.connection", connection.to_string());
+            for (name, value) in headers {
+                env.header(name, value);
+            }
+
+            let response = RackRequest::send(&app, env, body.as_bytes()).unwrap();
+            RackResponseOwned::from(response).code()
+        };
+        let take = || std::mem::take(&mut *events.lock().unwrap());
+
+        assert_eq!(send("open", 1, &[("cookie", "user=1")], ""), 200);
+        assert_eq!(take(), [r#"transmit 1 {"type":"welcome"}"#]);
+
+        // Not authorized: told why, then closed.
+        assert_eq!(send("open", 2, &[], ""), 200);
+        assert_eq!(
+            take(),
+            [
+                r#"transmit 2 {"type":"disconnect","reason":"unauthorized","reconnect":false}"#,
+                "close 2",
+            ]
+        );
+
+        // Refused before the connection is opened.
+        assert_eq!(
+            send("open", 3, &[("origin", "https://evil.example")], ""),
+            404
+        );
+        assert!(take().is_empty());
+
+        let subscribe = r#"{"command":"subscribe","identifier":"{\"room\":1}"}"#;
+        assert_eq!(send("message", 1, &[], subscribe), 200);
+        assert_eq!(
+            take(),
+            [
+                "stream 1 room_1",
+                r#"transmit 1 {"identifier":"{\"room\":1}","type":"confirm_subscription"}"#,
+            ]
+        );
+
+        // The broadcasting is subscribed to once; Ruby hands each broadcast over as it is.
+        Ruby::eval(r#"ActionCable.server.pubsub.broadcast("room_1", '{"text":"hi"}')"#).unwrap();
+        assert_eq!(take(), [r#"broadcast room_1 {"text":"hi"}"#]);
+
+        assert_eq!(send("close", 1, &[], ""), 200);
+        assert_eq!(take(), ["stop 1 room_1"]);
+        let subscribers = Ruby::eval(r#"ActionCable.server.pubsub.count("room_1").to_s"#).unwrap();
+        assert_eq!(subscribers.to_string(), "0");
+
+        assert_eq!(send("message", 1, &[], subscribe), 404);
+    }
+}
@@ -0,0 +1,305 @@
+//! Rack env for one request, with all its keys and values in one buffer.
+//!
+//! Building the env used to cost a few allocations per header: the `HTTP_*` name,
+//! its value, and the hash map entry. [`Env`] writes all of them into one byte buffer
+//! instead, and [`RackRequest::send`](super::RackRequest::send) points the bindings
+//! straight into it. Once a request is done with its env, the buffer is kept for the next one.
+use std::collections::HashMap;
+use std::ops::Range;
+use std::sync::Mutex;
+
+use once_cell::sync::Lazy;
+
+use super::KeyValue;
+
+/// Buffers of dropped envs, picked up by [`Env::with_capacity`]. Envs are built on one
+/// thread and dropped on another, so they're shared by all of them.
+pub(crate) static SPARE_ENVS: Lazy<Mutex<Vec<SpareEnv>>> = Lazy::new(|| Mutex::new(vec![]));
+
+/// How many of them are kept.
+const SPARE_ENV_COUNT: usize = 64;
+
+/// Bigger buffers, e.g. from a request with huge cookies, are freed instead of kept.
+const SPARE_ENV_BYTES: usize = 64 * 1024;
+
+/// The cleared buffers of an env.
+pub(crate) struct SpareEnv {
+    buf: Vec<u8>,
+    entries: Vec<(Range<usize>, Range<usize>)>,
+}
+
+/// Rack env: CGI variables like `REQUEST_METHOD` and `HTTP_*` headers.
+///
+/// Keys set more than once are all passed to Ruby; the last value wins, like in a `Hash`.
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct Env {
+    buf: Vec<u8>,
+    entries: Vec<(Range<usize>, Range<usize>)>,
+}
+
+impl Env {
+    /// Create an empty env.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Create an env with room for `entries` keys and values taking `bytes` bytes.
+    /// The buffers of a dropped env are used if there is one.
+    pub fn with_capacity(entries: usize, bytes: usize) -> Self {
+        let spare = SPARE_ENVS.lock().unwrap().pop();
+
+        match spare {
+            Some(SpareEnv {
+                buf: mut spare_buf,
+                entries: mut spare_entries,
+            }) => {
+                spare_buf.reserve(bytes);
+                spare_entries.reserve(entries);
+
+                Self {
+                    buf: spare_buf,
+                    entries: spare_entries,
+                }
+            }
+
+            None => Self {
+                buf: Vec::with_capacity(bytes),
+                entries: Vec::with_capacity(entries),
+            },
+        }
+    }
+
+    /// Set a variable, e.g. `REQUEST_METHOD`.
+    pub fn insert(&mut self, key: impl AsRef<[u8]>, value: impl AsRef<[u8]>) {
+        let key = self.push(key.as_ref());
+        let value = self.push(value.as_ref());
+
+        self.entries.push((key, value));
+    }
+
+    /// Set an HTTP header, named the CGI way, e.g. `user-agent` as `HTTP_USER_AGENT`.
+    ///
+    /// `content-length` and `content-type` are skipped: Rack forbids `HTTP_CONTENT_LENGTH`
+    /// and `HTTP_CONTENT_TYPE`, they go in `CONTENT_LENGTH` and `CONTENT_TYPE` instead.
+    pub fn header(&mut self, name: &str, value: impl AsRef<[u8]>) {
+        if name.eq_ignore_ascii_case("content-length") || name.eq_ignore_ascii_case("content-type")
+        {
+            return;
+        }
+
+        let key = match cgi_name(name) {
+            Some(key) => self.push(key.as_bytes()),
+            None => {
+                let start = self.buf.len();
+                self.buf.extend_from_slice(b"HTTP_");
+                self.buf.extend(name.bytes().map(|c| match c {
+                    b'-' => b'_',
+                    c => c.to_ascii_uppercase(),
+                }));
+
+                start..self.buf.len()
+            }
+        };
+        let value = self.push(value.as_ref());
+
+        self.entries.push((key, value));
+    }
+
+    /// Last value set for the key.
+    pub fn get(&self, key: &str) -> Option<&[u8]> {
+        self.iter()
+            .filter(|(k, _)| *k == key.as_bytes())
+            .last()
+            .map(|(_, value)| value)
+    }
+
+    /// Keys and values, in the order they were set.
+    pub fn iter(&self) -> impl Iterator<Item = (&[u8], &[u8])> + '_ {
+        self.entries
+            .iter()
+            .map(|(key, value)| (&self.buf[key.clone()], &self.buf[value.clone()]))
+    }
+
+    /// Number of keys set.
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    /// No keys set.
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+
+    /// Pairs passed to the bindings, into a vector kept around between requests. They borrow
+    /// the buffer, which can't change while they're used.
+    pub(crate) fn fill_key_values(&self, pairs: &mut Vec<KeyValue>) {
+        pairs.clear();
+        pairs.extend(self.iter().map(|(key, value)| KeyValue::new(key, value)));
+    }
+
+    fn push(&mut self, bytes: &[u8]) -> Range<usize> {
+        let start = self.buf.len();
+        self.buf.extend_from_slice(bytes);
+        start..self.buf.len()
+    }
+}
+
+impl Drop for Env {
+    fn drop(&mut self) {
+        if self.buf.capacity() == 0 || self.buf.capacity() > SPARE_ENV_BYTES {
+            return;
+        }
+
+        let mut spare = SpareEnv {
+            buf: std::mem::take(&mut self.buf),
+            entries: std::mem::take(&mut self.entries),
+        };
+        spare.buf.clear();
+        spare.entries.clear();
+
+        // Dropped while a thread panics holding the lock; the buffers are just freed then.
+        if let Ok(mut spares) = SPARE_ENVS.lock() {
+            if spares.len() < SPARE_ENV_COUNT {
+                spares.push(spare);
+            }
+        }
+    }
+}
+
+impl From<HashMap<String, String>> for Env {
+    fn from(env: HashMap<String, String>) -> Self {
+        let bytes = env.iter().map(|(k, v)| k.len() + v.len()).sum();
+        let mut result = Env::with_capacity(env.len(), bytes);
+
+        for (key, value) in &env {
+            result.insert(key, value);
+        }
+
+        result
+    }
+}
+
+/// CGI names of common headers, so they don't have to be converted on every request.
+/// Header names are expected in lowercase, which is how HTTP/2 sends them and how Rwf stores them.
+fn cgi_name(name: &str) -> Option<&'static str> {
+    Some(match name {
+        "accept" => "HTTP_ACCEPT",
+        "accept-encoding" => "HTTP_ACCEPT_ENCODING",
+        "accept-language" => "HTTP_ACCEPT_LANGUAGE",
+        "authorization" => "HTTP_AUTHORIZATION",
+        "cache-control" => "HTTP_CACHE_CONTROL",
+        "connection" => "HTTP_CONNECTION",
+        "cookie" => "HTTP_COOKIE",
+        "dnt" => "HTTP_DNT",
+        "host" => "HTTP_HOST",
+        "if-modified-since" => "HTTP_IF_MODIFIED_SINCE",
+        "if-none-match" => "HTTP_IF_NONE_MATCH",
+        "if-range" => "HTTP_IF_RANGE",
+        "origin" => "HTTP_ORIGIN",
+        "pragma" => "HTTP_PRAGMA",
+        "range" => "HTTP_RANGE",
+        "referer" => "HTTP_REFERER",
+        "sec-ch-ua" => "HTTP_SEC_CH_UA",
+        "sec-ch-ua-mobile" => "HTTP_SEC_CH_UA_MOBILE",
+        "sec-ch-ua-platform" => "HTTP_SEC_CH_UA_PLATFORM",
+        "sec-fetch-dest" => "HTTP_SEC_FETCH_DEST",
+        "sec-fetch-mode" => "HTTP_SEC_FETCH_MODE",
+        "sec-fetch-site" => "HTTP_SEC_FETCH_SITE",
+        "sec-fetch-user" => "HTTP_SEC_FETCH_USER",
+        "te" => "HTTP_TE",
+        "upgrade" => "HTTP_UPGRADE",
+        "upgrade-insecure-requests" => "HTTP_UPGRADE_INSECURE_REQUESTS",
+        "user-agent" => "HTTP_USER_AGENT",
+        "x-csrf-token" => "HTTP_X_CSRF_TOKEN",
+        "x-forwarded-for" => "HTTP_X_FORWARDED_FOR",
+        "x-forwarded-host" => "HTTP_X_FORWARDED_HOST",
+        "x-forwarded-port" => "HTTP_X_FORWARDED_PORT",
+        "x-forwarded-proto" => "HTTP_X_FORWARDED_PROTO",
+        "x-real-ip" => "HTTP_X_REAL_IP",
+        "x-request-id" => "HTTP_X_REQUEST_ID",
+        "x-requested-with" => "HTTP_X_REQUESTED_WITH",
+        _ => return None,
+    })
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_env() {
+        let mut env = Env::with_capacity(4, 64);
+        env.insert("REQUEST_METHOD", "GET");
+        env.header("user-agent", "curl");
+        env.header("x-custom-header", "1");
+        env.header("X-Mixed-Case", "2");
+        env.header("content-type", "text/plain");
+        env.header("Content-Length", "4");
+        env.insert("REQUEST_METHOD", "POST");
+
+        assert_eq!(env.len(), 5);
+        assert_eq!(env.get("REQUEST_METHOD"), Some(&b"POST"[..]));
+        assert_eq!(env.get("HTTP_USER_AGENT"), Some(&b"curl"[..]));
+        assert_eq!(env.get("HTTP_X_CUSTOM_HEADER"), Some(&b"1"[..]));
+        assert_eq!(env.get("HTTP_X_MIXED_CASE"), Some(&b"2"[..]));
+        assert_eq!(env.get("HTTP_MISSING"), None);
+        assert_eq!(env.get("HTTP_CONTENT_TYPE"), None);
+        assert_eq!(env.get("HTTP_CONTENT_LENGTH"), None);
+
+        let mut pairs = vec![];
+        env.fill_key_values(&mut pairs);
+        assert_eq!(pairs.len(), 5);
+        assert_eq!(unsafe { pairs[1].key() }, b"HTTP_USER_AGENT");
+        assert_eq!(unsafe { pairs[1].value() }, b"curl");
+    }
+
+    #[test]
+    fn test_spare_envs() {
+        let envs = (0..SPARE_ENV_COUNT * 2)
+            .map(|i| {
+                let mut env = Env::with_capacity(1, 16);
+                env.insert("PATH_INFO", format!("/{}", i));
+                env
+            })
+            .collect::<Vec<_>>();
+        drop(envs);
+        assert!(SPARE_ENVS.lock().unwrap().len() <= SPARE_ENV_COUNT);
+
+        // Buffers come back cleared.
+        let env = Env::with_capacity(1, 16);
+        assert!(env.is_empty());
+        assert_eq!(env.get("PATH_INFO"), None);
+
+        // Big ones aren't kept.
+        let mut env = Env::with_capacity(1, SPARE_ENV_BYTES * 2);
+        env.insert("HTTP_COOKIE", "x".repeat(SPARE_ENV_BYTES * 2));
+        let big = env.buf.as_ptr();
+        drop(env);
+        assert!(SPARE_ENVS
+            .lock()
+            .unwrap()
+            .iter()
+            .all(|spare| spare.buf.as_ptr() != big));
+    }
+
+    #[test]
+    fn test_cgi_names() {
+        // The table agrees with the conversion it replaces.
+        for name in [
+            "accept",
+            "x-forwarded-for",
+            "upgrade-insecure-requests",
+            "sec-ch-ua",
+        ] {
+            let mut expected = Env::new();
+            expected.insert(
+                format!("HTTP_{}", name.to_ascii_uppercase().replace('-', "_")),
+                "",
+            );
+
+            let mut env = Env::new();
+            env.header(name, "");
+            assert_eq!(env, expected);
+        }
+    }
+}
@@ -0,0 +1,195 @@
+//! Out-of-band garbage collection: collect between requests instead of during them.
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use tracing::debug;
+
+use super::{rb_gc_disable, rb_gc_enable, rwf_gc_heap_bytes, rwf_gc_start};
+
+/// Heap growth limit used when the GC is deferred without any limits.
+pub const DEFAULT_HEAP_GROWTH: usize = 64 * 1024 * 1024;
+
+/// When to collect garbage between requests.
+///
+/// A collection runs once any of the limits is reached and no requests are running.
+#[derive(Debug, Clone, Default)]
+pub struct GcPolicy {
+    /// Collect after this many requests.
+    pub requests: Option<usize>,
+    /// Collect once the heap grew by this many bytes, as measured by `GC.stat`.
+    pub heap_growth: Option<usize>,
+    /// Keep the GC disabled while requests are running, like Unicorn's OOBGC.
+    ///
+    /// If requests keep running back to back with no gap, the GC is enabled again
+    /// once twice the limits are reached, so memory doesn't grow without bound.
+    /// If no limits are set, [`DEFAULT_HEAP_GROWTH`] is used.
+    pub defer: bool,
+}
+
+impl GcPolicy {
+    /// The policy with a heap growth limit if it defers the GC without any limits,
+    /// so the GC can't stay off forever.
+    fn limited(mut self) -> Self {
+        if self.defer && self.requests.is_none() && self.heap_growth.is_none() {
+            self.heap_growth = Some(DEFAULT_HEAP_GROWTH);
+        }
+
+        self
+    }
+}
+
+/// Requests and heap growth since the last out-of-band collection.
+#[derive(Debug)]
+pub(crate) struct OutOfBand {
+    policy: GcPolicy,
+    requests: AtomicUsize,
+    heap: AtomicUsize,
+}
+
+impl OutOfBand {
+    /// Call from the Ruby thread.
+    pub(crate) fn new(policy: GcPolicy) -> Self {
+        Self {
+            policy: policy.limited(),
+            requests: AtomicUsize::new(0),
+            heap: AtomicUsize::new(unsafe { rwf_gc_heap_bytes() }),
+        }
+    }
+
+    /// Any of the limits, multiplied by `factor`, was reached.
+    fn due(&self, factor: usize) -> bool {
+        let requests = self.requests.load(Ordering::Relaxed);
+        let by_requests = self
+            .policy
+            .requests
+            .map(|limit| requests >= limit * factor)
+            .unwrap_or(false);
+
+        by_requests
+            || self
+                .policy
+                .heap_growth
+                .map(|limit| self.growth() >= limit * factor)
+                .unwrap_or(false)
+    }
+
+    fn growth(&self) -> usize {
+        unsafe { rwf_gc_heap_bytes() }.saturating_sub(self.heap.load(Ordering::Relaxed))
+    }
+
+    /// A request is starting. Call holding the GVL.
+    pub(crate) fn request(&self) {
+        self.requests.fetch_add(1, Ordering::Relaxed);
+
+        if self.policy.defer {
+            unsafe {
+                if self.due(2) {
+                    rb_gc_enable();
+                } else {
+                    rb_gc_disable();
+                }
+            }
+        }
+    }
+
+    /// No requests are running. Collect if a limit was reached; if `busy`, i.e. requests
+    /// are already waiting, only once twice a limit was reached. Call holding the GVL.
+    pub(crate) fn idle(&self, busy: bool) {
+        if self.policy.defer {
+            unsafe {
+                rb_gc_enable();
+            }
+        }
+
+        if self.due(if busy { 2 } else { 1 }) {
+            let requests = self.requests.swap(0, Ordering::Relaxed);
+            let growth = self.growth();
+
+            unsafe { rwf_gc_start(0) };
+            self.heap
+                .store(unsafe { rwf_gc_heap_bytes() }, Ordering::Relaxed);
+
+            debug!(
+                "Out-of-band GC after {} requests and {} bytes of heap growth",
+                requests, growth
+            );
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::test::{boot, on_ruby_thread};
+    use crate::{Job, RackApp, RackRequest, RackResponseOwned, Ruby};
+    use std::collections::HashMap;
+    use std::sync::mpsc::channel;
+
+    #[test]
+    fn test_deferred_without_limits() {
+        let policy = GcPolicy {
+            defer: true,
+            ..Default::default()
+        }
+        .limited();
+        assert_eq!(policy.heap_growth, Some(DEFAULT_HEAP_GROWTH));
+
+        let policy = GcPolicy {
+            requests: Some(10),
+            heap_growth: None,
+            defer: true,
+        }
+        .limited();
+        assert_eq!(policy.heap_growth, None);
+
+        assert_eq!(GcPolicy::default().limited().heap_growth, None);
+    }
+
+    #[test]
+    fn test_out_of_band_gc() {
+        on_ruby_thread(test_out_of_band_gc_inner);
+    }
+
+    fn test_out_of_band_gc_inner() {
+        // GC.start needs the VM booted the way load_app does it.
+        boot();
+        Ruby::eval(r#"$rwf_gc_app = lambda { |env| [200, {}, [GC.latest_gc_info(:gc_by).to_s]] }"#)
+            .unwrap();
+        let app = RackApp::bind("$rwf_gc_app").unwrap();
+
+        let (jobs, rx) = channel::<Job>();
+        let (results, responses) = channel();
+
+        for _ in 0..4 {
+            let results = results.clone();
+            jobs.send(Box::new(move |app| {
+                let response = RackRequest::send(app, HashMap::new(), b"").unwrap();
+                let owned = RackResponseOwned::from(response);
+                results.send(owned.body().to_vec()).unwrap();
+            }))
+            .unwrap();
+        }
+        drop(jobs);
+        drop(results);
+
+        let count = Ruby::eval("GC.count.to_s").unwrap().to_string();
+        let policy = GcPolicy {
+            requests: Some(1),
+            heap_growth: None,
+            defer: true,
+        };
+        app.serve(1, None, Some(policy), rx).unwrap();
+
+        // Requests were already waiting, so collections ran every other request
+        // (twice the limit), and once more after the last one.
+        let collected = Ruby::eval(&format!("(GC.count - {}).to_s", count))
+            .unwrap()
+            .to_string();
+        assert!(collected.parse::<usize>().unwrap() >= 2);
+
+        // The third request ran right after GC.start; GC stayed off during requests.
+        let responses = responses.iter().collect::<Vec<_>>();
+        assert_eq!(responses[2..], [b"method".to_vec(), b"method".to_vec()]);
+        assert_eq!(Ruby::eval("GC.disable.to_s").unwrap().to_string(), "false");
+        Ruby::gc_enable();
+    }
+}
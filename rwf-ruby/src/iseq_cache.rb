@@ -0,0 +1,122 @@
+# Compiled Ruby files, kept on disk between boots.
+#
+# Ruby asks RubyVM::InstructionSequence.load_iseq for every file it requires or loads before
+# parsing it itself. This answers with the instruction sequence compiled by an earlier boot,
+# if the file hasn't changed since, and compiles and stores it otherwise. The cache is keyed
+# by the file's path, modification time and size, and by the Ruby version and its compile
+# options; anything else falls back to Ruby compiling the file, e.g. syntax errors, which it
+# then reports as usual. Entries for files that were deleted or changed since are removed
+# when booting, at most once a day.
+require "digest/sha1"
+require "fileutils"
+
+module Rwf
+  module ISeqCache
+    # How often stale entries are looked for.
+    PRUNE_INTERVAL = 24 * 60 * 60
+
+    class << self
+      attr_reader :dir, :hits, :misses
+
+      def install(dir)
+        @dir = File.expand_path(dir)
+        @hits = 0
+        @misses = 0
+        @version = [
+          RUBY_VERSION,
+          RUBY_REVISION,
+          RUBY_PLATFORM,
+          RubyVM::InstructionSequence.compile_option.sort.inspect,
+        ].join(":")
+
+        FileUtils.mkdir_p(@dir)
+        prune
+        RubyVM::InstructionSequence.singleton_class.prepend(Hook)
+      end
+
+      # Remove entries compiled by another Ruby or for files that were deleted or changed;
+      # a changed file's entry is only replaced if the file is loaded again. The last run
+      # is marked in the cache, so booting doesn't read every entry each time.
+      def prune(force: false)
+        marker = File.join(@dir, ".pruned")
+        return if !force && File.exist?(marker) && Time.now - File.mtime(marker) < PRUNE_INTERVAL
+
+        FileUtils.touch(marker)
+
+        Dir.each_child(@dir) do |name|
+          cache = File.join(@dir, name)
+          File.unlink(cache) if cache != marker && stale?(cache)
+        rescue SystemCallError
+          nil
+        end
+      end
+
+      def uninstall
+        @dir = nil
+      end
+
+      def fetch(path)
+        return nil if @dir.nil? || (defined?(Coverage) && Coverage.running?)
+
+        stat = File.stat(path)
+        key = "#{@version}:#{path}:#{stat.mtime.to_i}.#{stat.mtime.nsec}:#{stat.size}\n"
+        cache = File.join(@dir, Digest::SHA1.hexdigest(path))
+
+        if (iseq = read(cache, key))
+          @hits += 1
+          return iseq
+        end
+
+        @misses += 1
+        iseq = RubyVM::InstructionSequence.compile_file(path)
+        write(cache, key + iseq.to_binary)
+        iseq
+      rescue SyntaxError, SystemCallError, RuntimeError
+        nil
+      end
+
+      private
+
+      def stale?(cache)
+        # Left behind by a process that died while writing it.
+        return Time.now - File.mtime(cache) > PRUNE_INTERVAL if cache.end_with?(".tmp")
+
+        key = File.open(cache, "rb") { |io| io.gets }
+        return true unless key&.start_with?("#{@version}:")
+
+        rest, _, size = key.chomp.delete_prefix("#{@version}:").rpartition(":")
+        path, _, mtime = rest.rpartition(":")
+        stat = File.stat(path)
+
+        "#{stat.mtime.to_i}.#{stat.mtime.nsec}" != mtime || stat.size.to_s != size
+      rescue Errno::ENOENT
+        true
+      end
+
+      def read(cache, key)
+        data = File.binread(cache)
+        return nil unless data.start_with?(key)
+
+        RubyVM::InstructionSequence.load_from_binary(data.byteslice(key.bytesize..))
+      rescue SystemCallError, RuntimeError, TypeError, ArgumentError
+        nil
+      end
+
+      # Written next to the entry and renamed over it, so other processes booting at the
+      # same time never read half of it.
+      def write(cache, data)
+        tmp = "#{cache}.#{Process.pid}.tmp"
+        File.binwrite(tmp, data)
+        File.rename(tmp, cache)
+      rescue SystemCallError
+        File.unlink(tmp) rescue nil
+      end
+    end
+
+    module Hook
+      def load_iseq(path)
+        ISeqCache.fetch(path) || (defined?(super) ? super : nil)
+      end
+    end
+  end
+end
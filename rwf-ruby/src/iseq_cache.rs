@@ -0,0 +1,85 @@
+//! Keep compiled Ruby files on disk, so the app boots without parsing them again.
+//!
+//! [`option`] is a VM flag, passed with the others when booting, e.g. to
+//! [`Ruby::load_app_with_options`](crate::Ruby::load_app_with_options). It installs
+//! `Rwf::ISeqCache` ([src/iseq_cache.rb](iseq_cache.rb)) before the app is required, and
+//! Ruby then gets every file it requires or loads from the cache, compiled by an earlier boot,
+//! as long as the file and the Ruby version haven't changed since. Files that changed are
+//! compiled again and stored, and entries for files that were deleted or changed are removed
+//! when booting, at most once a day, so the cache never needs to be cleared by hand.
+//!
+//! Like Bootsnap's compile cache, which it replaces; apps using both should disable Bootsnap's.
+use std::path::Path;
+
+use crate::util::quote;
+
+/// VM flag installing the cache, stored in `dir`. It's created if it doesn't exist.
+pub fn option(dir: impl AsRef<Path>) -> String {
+    format!(
+        "-e{}\nRwf::ISeqCache.install({})",
+        include_str!("iseq_cache.rb"),
+        quote(&dir.as_ref().display().to_string())
+    )
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::test::{boot, on_ruby_thread};
+    use crate::Ruby;
+
+    #[test]
+    fn test_iseq_cache() {
+        on_ruby_thread(test_iseq_cache_inner);
+    }
+
+    fn test_iseq_cache_inner() {
+        boot();
+
+        let dir = std::env::temp_dir().join(format!("rwf-iseq-{}", std::process::id()));
+        let file = std::env::temp_dir().join("rwf_iseq_cache_test.rb");
+        std::fs::write(&file, "$rwf_iseq = 1").unwrap();
+
+        let option = option(&dir);
+        assert!(option.starts_with("-e"));
+        // Same code as the flag runs, without booting the VM again.
+        Ruby::eval(option.trim_start_matches("-e")).unwrap();
+
+        let load = || {
+            Ruby::eval(&format!(
+                r#"load "{}"; [$rwf_iseq, Rwf::ISeqCache.hits, Rwf::ISeqCache.misses].join(",")"#,
+                file.display()
+            ))
+            .unwrap()
+            .to_string()
+        };
+
+        assert_eq!(load(), "1,0,1");
+        assert_eq!(load(), "1,1,1");
+
+        // Changed files are compiled again.
+        std::fs::write(&file, "$rwf_iseq = 22").unwrap();
+        assert_eq!(load(), "22,1,2");
+
+        // Entries for files that are gone are removed, the others kept.
+        let gone = std::env::temp_dir().join("rwf_iseq_cache_gone.rb");
+        std::fs::write(&gone, "$rwf_iseq = 3").unwrap();
+        Ruby::eval(&format!(r#"load "{}""#, gone.display())).unwrap();
+        std::fs::remove_file(&gone).unwrap();
+
+        let entries = || {
+            Ruby::eval(
+                r#"Rwf::ISeqCache.prune(force: true); Dir.children(Rwf::ISeqCache.dir).grep_v(".pruned").size.to_s"#,
+            )
+            .unwrap()
+            .to_string()
+        };
+        assert_eq!(entries(), "1");
+
+        std::fs::write(&file, "$rwf_iseq = 333").unwrap();
+        assert_eq!(entries(), "0");
+
+        Ruby::eval("Rwf::ISeqCache.uninstall").unwrap();
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -2,18 +2,48 @@
 use libc::uintptr_t;
 use once_cell::sync::OnceCell;
 
-use std::collections::HashMap;
-use std::ffi::{c_char, c_int, CStr, CString};
+use std::ffi::{c_char, c_int, c_void, CStr, CString};
 use std::fs::canonicalize;
 use std::mem::MaybeUninit;
+use std::panic::{catch_unwind, resume_unwind, AssertUnwindSafe};
 use std::path::Path;
-use std::time::Instant;
+use std::slice;
+use std::sync::mpsc::{Receiver, RecvTimeoutError};
+use std::sync::Mutex;
+use std::time::Duration;
 
-use tracing::{debug, info};
+use bytes::Bytes;
+use once_cell::sync::Lazy;
+
+use tracing::{debug, error, info};
+
+pub mod cable;
+pub mod env;
+pub mod gc;
+pub mod iseq_cache;
+pub mod prefork;
+pub mod ractor;
+mod util;
+
+pub use env::Env;
+pub use gc::GcPolicy;
+use gc::OutOfBand;
 
 // Make sure the Ruby VM is initialized only once.
 static RUBY_INIT: OnceCell<Ruby> = OnceCell::new();
 
+// Pinned bodies dropped by Rust, unpinned by the Ruby thread on the next request.
+static UNPINNED: Lazy<Mutex<Vec<uintptr_t>>> = Lazy::new(|| Mutex::new(vec![]));
+
+/// Bodies shorter than this are copied; pinning them costs more than the copy.
+const PIN_MIN_LEN: usize = 16 * 1024;
+
+/// How often [`RackApp::serve`] stops waiting for jobs to let Ruby handle interrupts.
+const JOB_POLL: Duration = Duration::from_millis(100);
+
+/// Work executed in its own Ruby thread by [`RackApp::serve`].
+pub type Job = Box<dyn FnOnce(&RackApp) + Send>;
+
 /// Response generated by a Rack application.
 ///
 /// The `VALUE` returned by Ruby is kept to ensure
@@ -33,21 +63,400 @@ pub struct RackResponse {
     /// Header key/value pairs.
     pub headers: *mut KeyValue,
 
+    /// Room in `headers`, reused by the bindings for the next response.
+    pub headers_cap: c_int,
+
     /// Response body as bytes.
-    pub body: *mut c_char,
+    pub body: *const c_char,
+
+    /// Length of the response body.
+    pub body_len: usize,
 
     /// 1 if this is a file, 0 if its bytes.
     pub is_file: c_int,
+
+    /// 1 if the body has to be streamed with [`RackResponse::each`].
+    pub is_stream: c_int,
+
+    /// Ruby object backing the body.
+    pub body_value: uintptr_t,
+
+    /// Strings created while reading the headers, kept alive with the response.
+    pub keep: uintptr_t,
+
+    /// Where the request spent its time.
+    pub timings: RackTimings,
+}
+
+/// Exception copied out of Ruby by the bindings, see [`Exception`].
+#[repr(C)]
+#[derive(Debug)]
+struct RackException {
+    class_name: *mut c_char,
+    message: *mut c_char,
+    num_backtrace: c_int,
+    backtrace: *mut *mut c_char,
+}
+
+/// Exception raised by Ruby code, e.g. the Rack app.
+#[derive(Debug, Clone, PartialEq)]
+pub struct Exception {
+    /// Exception class, e.g. `NoMethodError`.
+    pub class: String,
+    /// `Exception#message`.
+    pub message: String,
+    /// `Exception#backtrace`, most recent call first.
+    pub backtrace: Vec<String>,
+}
+
+impl std::fmt::Display for Exception {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{}: {}", self.class, self.message)
+    }
+}
+
+impl From<&RackException> for Exception {
+    fn from(err: &RackException) -> Self {
+        let string = |ptr: *const c_char| {
+            if ptr.is_null() {
+                String::new()
+            } else {
+                unsafe { CStr::from_ptr(ptr) }.to_string_lossy().to_string()
+            }
+        };
+
+        let backtrace = if err.backtrace.is_null() {
+            vec![]
+        } else {
+            unsafe { slice::from_raw_parts(err.backtrace, err.num_backtrace as usize) }
+                .iter()
+                .map(|line| string(*line))
+                .collect()
+        };
+
+        Self {
+            class: string(err.class_name),
+            message: string(err.message),
+            backtrace,
+        }
+    }
+}
+
+/// Log exceptions the bindings can't return, e.g. raised by `body.close`.
+extern "C" fn log_exception(context: *const c_char, err: *const RackException) {
+    let context = unsafe { CStr::from_ptr(context) }.to_string_lossy();
+    let err = Exception::from(unsafe { &*err });
+
+    error!(
+        "Ruby raised {} while {}\n{}",
+        err,
+        context,
+        err.backtrace.join("\n")
+    );
+}
+
+/// Where a request spent its time in Ruby, measured by the bindings.
+///
+/// GC and YJIT counters are deltas over the request. When requests run concurrently,
+/// they include whatever the other Ruby threads did meanwhile.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct RackTimings {
+    /// Building the env hash, in nanoseconds.
+    pub env_ns: u64,
+    /// Inside `app.call`, in nanoseconds.
+    pub call_ns: u64,
+    /// Reading the status, headers and body out of the response, in nanoseconds.
+    pub response_ns: u64,
+    /// Objects allocated.
+    pub allocated_objects: usize,
+    /// Minor GCs that ran.
+    pub minor_gc_count: usize,
+    /// Major GCs that ran.
+    pub major_gc_count: usize,
+    /// Time spent in GC, in microseconds.
+    pub gc_time_us: usize,
+    /// Methods compiled by YJIT, 0 if it's off. YJIT is sampled at most once a second,
+    /// so what was compiled in between is counted against the request that sampled it.
+    pub yjit_compiled_iseqs: usize,
+}
+
+impl RackTimings {
+    /// Time spent in the bindings, outside of the app.
+    pub fn ffi(&self) -> Duration {
+        Duration::from_nanos(self.env_ns + self.response_ns)
+    }
+
+    /// Time spent inside the app.
+    pub fn call(&self) -> Duration {
+        Duration::from_nanos(self.call_ns)
+    }
+
+    /// Total time spent in Ruby.
+    pub fn total(&self) -> Duration {
+        self.ffi() + self.call()
+    }
 }
 
 /// Header key/value pair.
 ///
-/// Memory is allocated and de-allocated in C. Rust is just borrowing it.
+/// Strings are passed as pointer and length, so they can contain any bytes,
+/// including `\0`. Whoever builds the pair owns the memory; the other side is just borrowing it.
 #[repr(C)]
 #[derive(Debug)]
 pub struct KeyValue {
     key: *const c_char,
+    key_len: usize,
     value: *const c_char,
+    value_len: usize,
+}
+
+impl KeyValue {
+    fn new(key: &[u8], value: &[u8]) -> Self {
+        Self {
+            key: key.as_ptr() as *const c_char,
+            key_len: key.len(),
+            value: value.as_ptr() as *const c_char,
+            value_len: value.len(),
+        }
+    }
+
+    /// Borrow the key bytes.
+    ///
+    /// # Safety
+    ///
+    /// The memory the pair points to must still be alive.
+    unsafe fn key(&self) -> &[u8] {
+        slice::from_raw_parts(self.key as *const u8, self.key_len)
+    }
+
+    /// Borrow the value bytes.
+    ///
+    /// # Safety
+    ///
+    /// The memory the pair points to must still be alive.
+    unsafe fn value(&self) -> &[u8] {
+        slice::from_raw_parts(self.value as *const u8, self.value_len)
+    }
+}
+
+/// Opaque app handle allocated by the C bindings.
+#[repr(C)]
+struct RackAppHandle {
+    _private: [u8; 0],
+}
+
+/// Rack application bound to the Ruby VM.
+///
+/// The app object, the classes used to build the request and all method IDs
+/// are resolved once by [`RackApp::bind`], so requests don't evaluate any Ruby code.
+/// The app is registered with the garbage collector until the handle is dropped.
+#[derive(Debug)]
+pub struct RackApp {
+    handle: *mut RackAppHandle,
+}
+
+// The handle is only ever dereferenced by the C bindings, on the thread
+// that runs the Ruby VM.
+unsafe impl Send for RackApp {}
+unsafe impl Sync for RackApp {}
+
+impl RackApp {
+    /// Resolve the Rack app, e.g. `Rails.application`.
+    ///
+    /// The app has to be loaded with [`Ruby::load_app`] first.
+    pub fn bind(app_name: &str) -> Result<Self, Error> {
+        Ruby::init()?;
+
+        let app_name = CString::new(app_name).map_err(|_| Error::App)?;
+        let handle = unsafe { rwf_app_bind(app_name.as_ptr()) };
+
+        Self::from_handle(handle)
+    }
+
+    /// Load the Rack app from a rackup file, e.g. `config.ru`, with `Rack::Builder.parse_file`,
+    /// like `rackup` and Puma do. `rack` is required if it isn't loaded yet.
+    ///
+    /// The VM has to be booted with [`Ruby::load_app`] or [`Ruby::boot`] first.
+    /// Load any number of apps this way; each gets a handle of its own.
+    pub fn rackup(path: impl AsRef<Path>) -> Result<Self, Error> {
+        Ruby::init()?;
+
+        let path = canonicalize(path).map_err(|_| Error::App)?;
+        let path = CString::new(path.display().to_string()).map_err(|_| Error::App)?;
+        let handle = unsafe { rwf_app_rackup(path.as_ptr()) };
+
+        Self::from_handle(handle)
+    }
+
+    fn from_handle(handle: *mut RackAppHandle) -> Result<Self, Error> {
+        if handle.is_null() {
+            Err(Error::App)
+        } else {
+            Ok(RackApp { handle })
+        }
+    }
+
+    /// Tell the app it can get requests from more than one thread at a time, with `rack.multithread`.
+    ///
+    /// [`RackApp::serve`] sets it for the app it serves. Apps called from its jobs
+    /// alongside it need it set here.
+    pub fn set_multithread(&mut self, multithread: bool) {
+        unsafe { rwf_app_set_multithread(self.handle, multithread as c_int) }
+    }
+
+    /// Tell the app other processes are serving it too, with `rack.multiprocess`.
+    /// Set in prefork workers, on the Ruby thread.
+    pub(crate) fn set_multiprocess(&self, multiprocess: bool) {
+        unsafe { rwf_app_set_multiprocess(self.handle, multiprocess as c_int) }
+    }
+
+    /// Run jobs concurrently, each in its own Ruby thread, until `jobs` is disconnected.
+    ///
+    /// At most `max_threads` jobs run at once; with more than one, `rack.multithread` is set.
+    /// While a job waits on I/O, e.g. the database, Ruby lets the others run. Jobs should
+    /// wrap anything that blocks on Rust with [`without_gvl`] for the same reason.
+    ///
+    /// With a `timeout`, `Rwf::RequestTimeout` is raised in requests spending longer than that
+    /// in `app.call`, so one slow request doesn't hold a thread forever. It's not a
+    /// `StandardError`; if the app doesn't handle it, [`RackRequest::send`] returns it.
+    ///
+    /// With a [`GcPolicy`], garbage is collected while no jobs are running.
+    ///
+    /// Call this from the Ruby thread, after [`Ruby::load_app`] booted the VM.
+    /// Returns once all the jobs are done.
+    pub fn serve(
+        &self,
+        max_threads: usize,
+        timeout: Option<Duration>,
+        gc: Option<GcPolicy>,
+        jobs: Receiver<Job>,
+    ) -> Result<(), Error> {
+        struct Serve<'a> {
+            app: &'a RackApp,
+            jobs: Receiver<Job>,
+            // Job received while checking if the queue is empty.
+            pending: Mutex<Option<Job>>,
+            gc: Option<OutOfBand>,
+        }
+
+        // Called without the GVL, from the thread that called serve.
+        extern "C" fn next(data: *mut c_void, job: *mut *mut c_void) -> c_int {
+            let serve = unsafe { &*(data as *const Serve) };
+
+            let next = match serve.pending.lock().unwrap().take() {
+                Some(next) => Ok(next),
+                None => serve.jobs.recv_timeout(JOB_POLL),
+            };
+
+            match next {
+                Ok(next) => {
+                    unsafe { *job = Box::into_raw(Box::new(next)) as *mut c_void };
+                    1
+                }
+                Err(RecvTimeoutError::Timeout) => 0,
+                Err(RecvTimeoutError::Disconnected) => -1,
+            }
+        }
+
+        // Called in a new Ruby thread.
+        extern "C" fn run(data: *mut c_void, job: *mut c_void) {
+            let serve = unsafe { &*(data as *const Serve) };
+            let job = unsafe { Box::from_raw(job as *mut Job) };
+
+            if let Some(ref gc) = serve.gc {
+                gc.request();
+            }
+
+            if catch_unwind(AssertUnwindSafe(|| job(serve.app))).is_err() {
+                error!("Rack job panicked");
+            }
+        }
+
+        // Called holding the GVL, when no jobs are running.
+        extern "C" fn idle(data: *mut c_void) {
+            let serve = unsafe { &*(data as *const Serve) };
+
+            if let Some(ref gc) = serve.gc {
+                let mut pending = serve.pending.lock().unwrap();
+
+                if pending.is_none() {
+                    *pending = serve.jobs.try_recv().ok();
+                }
+
+                gc.idle(pending.is_some());
+            }
+        }
+
+        let serve = Serve {
+            app: self,
+            jobs,
+            pending: Mutex::new(None),
+            gc: gc.map(OutOfBand::new),
+        };
+        let server = RwfServer {
+            app: self.handle,
+            max_threads: max_threads as c_int,
+            timeout_ms: timeout.map(|t| t.as_millis().max(1) as u64).unwrap_or(0),
+            next,
+            run,
+            idle: Some(idle),
+            data: &serve as *const Serve as *mut c_void,
+        };
+
+        if unsafe { rwf_serve(&server) } != 0 {
+            Err(Error::App)
+        } else {
+            Ok(())
+        }
+    }
+}
+
+/// Run `f` without holding Ruby's GVL, letting other Ruby threads run meanwhile.
+///
+/// Use this from a [`Job`] when waiting on something in Rust, e.g. a full channel.
+/// `f` must not call into Ruby.
+pub fn without_gvl<F, R>(f: F) -> R
+where
+    F: FnOnce() -> R,
+{
+    extern "C" fn call<F, R>(data: *mut c_void) -> *mut c_void
+    where
+        F: FnOnce() -> R,
+    {
+        let (f, result) =
+            unsafe { &mut *(data as *mut (Option<F>, Option<std::thread::Result<R>>)) };
+        let f = f.take().unwrap();
+
+        // Unwinding through Ruby isn't allowed.
+        *result = Some(catch_unwind(AssertUnwindSafe(f)));
+        std::ptr::null_mut()
+    }
+
+    let mut data: (Option<F>, Option<std::thread::Result<R>>) = (Some(f), None);
+    unsafe { rwf_without_gvl(call::<F, R>, &mut data as *mut _ as *mut c_void) };
+
+    match data.1.unwrap() {
+        Ok(result) => result,
+        Err(panic) => resume_unwind(panic),
+    }
+}
+
+#[repr(C)]
+struct RwfServer {
+    app: *mut RackAppHandle,
+    max_threads: c_int,
+    timeout_ms: u64,
+    next: extern "C" fn(*mut c_void, *mut *mut c_void) -> c_int,
+    run: extern "C" fn(*mut c_void, *mut c_void),
+    idle: Option<extern "C" fn(*mut c_void)>,
+    data: *mut c_void,
+}
+
+impl Drop for RackApp {
+    fn drop(&mut self) {
+        unsafe { rwf_app_drop(self.handle) }
+    }
 }
 
 /// Rack request, converted from an Rwf request.
@@ -60,59 +469,144 @@ pub struct RackRequest {
     length: c_int,
     // Request body as bytes.
     body: *const c_char,
+    // Length of the request body.
+    body_len: usize,
+    // Called by `rack.early_hints`, if set.
+    early_hints: Option<extern "C" fn(data: *mut c_void, headers: *const KeyValue, length: c_int)>,
+    early_hints_data: *mut c_void,
 }
 
+/// Headers the app sent with `rack.early_hints`, e.g. `Link` preloads.
+pub type EarlyHints = Vec<(String, String)>;
+
+/// Env pairs passed to the bindings, kept between requests so they aren't allocated for each.
+/// Shared by all threads, since the thread backend starts a new one for every request.
+static KEY_VALUES: Lazy<Mutex<Vec<SpareKeyValues>>> = Lazy::new(|| Mutex::new(vec![]));
+
+/// How many of them are kept.
+const SPARE_KEY_VALUES: usize = 64;
+
+/// A cleared vector for the env pairs.
+struct SpareKeyValues(Vec<KeyValue>);
+
+// Safety: it's empty, so there is nothing pointed to.
+unsafe impl Send for SpareKeyValues {}
+
 impl RackRequest {
     /// Send a request to Rack and get a response.
     ///
     /// `env` must follow the Rack spec and contain HTTP headers, and other request metadata.
     /// `body` contains the request body as bytes.
-    pub fn send(env: HashMap<String, String>, body: &[u8]) -> Result<RackResponse, Error> {
-        let mut keys = vec![];
-
-        let (mut k, mut v) = (vec![], vec![]);
-
-        for (key, value) in &env {
-            let key = CString::new(key.as_str()).unwrap();
-            let value = CString::new(value.as_str()).unwrap();
-            k.push(key);
-            v.push(value);
-
-            let env_key = KeyValue {
-                key: k.last().unwrap().as_ptr(),
-                value: v.last().unwrap().as_ptr(),
-            };
+    pub fn send(app: &RackApp, env: impl Into<Env>, body: &[u8]) -> Result<RackResponse, Error> {
+        Self::call(app, env.into(), body, None)
+    }
 
-            keys.push(env_key);
-        }
+    /// Same as [`RackRequest::send`], with `rack.early_hints` in the env. `hints` is called,
+    /// from the app's thread, each time the app sends them, e.g. Rails'
+    /// `request.send_early_hints`, before the response is ready.
+    pub fn send_with_early_hints(
+        app: &RackApp,
+        env: impl Into<Env>,
+        body: &[u8],
+        mut hints: impl FnMut(EarlyHints),
+    ) -> Result<RackResponse, Error> {
+        Self::call(app, env.into(), body, Some(&mut hints))
+    }
 
-        let body = CString::new(body).unwrap();
+    fn call(
+        app: &RackApp,
+        env: Env,
+        body: &[u8],
+        mut hints: Option<&mut dyn FnMut(EarlyHints)>,
+    ) -> Result<RackResponse, Error> {
+        PinnedBody::release();
+
+        // Borrows straight out of `env` and `body`, which outlive the call. The vector is one
+        // of the spares if there is any.
+        let spare = KEY_VALUES.lock().unwrap().pop();
+        let mut keys = spare.map(|spare| spare.0).unwrap_or_default();
+        env.fill_key_values(&mut keys);
+
+        // The bindings hold a pointer to this until the call returns.
+        let (early_hints, early_hints_data) = match hints {
+            Some(ref mut hints) => (
+                Some(early_hints as extern "C" fn(*mut c_void, *const KeyValue, c_int)),
+                hints as *mut &mut dyn FnMut(EarlyHints) as *mut c_void,
+            ),
+            None => (None, std::ptr::null_mut()),
+        };
 
         let req = RackRequest {
             length: keys.len() as c_int,
             env: keys.as_ptr(),
-            body: body.as_ptr(),
+            body: body.as_ptr() as *const c_char,
+            body_len: body.len(),
+            early_hints,
+            early_hints_data,
         };
 
-        // Hardcoded to Rails, but can be any other Rack app.
-        let app_name = CString::new("Rails.application").unwrap();
-
         let mut response: RackResponse = unsafe { MaybeUninit::zeroed().assume_init() };
+        let mut exception: RackException = unsafe { MaybeUninit::zeroed().assume_init() };
 
-        let start = Instant::now();
+        let result = unsafe { rwf_app_call(req, app.handle, &mut response, &mut exception) };
 
-        let result = unsafe { rwf_app_call(req, app_name.as_ptr(), &mut response) };
+        // Nothing points into `env` once it's put back.
+        keys.clear();
 
-        debug!(
-            "Rack request finished in {:.2}ms",
-            start.elapsed().as_secs_f64() * 1000.0
-        );
+        let mut spares = KEY_VALUES.lock().unwrap();
+        if spares.len() < SPARE_KEY_VALUES {
+            spares.push(SpareKeyValues(keys));
+        }
+        drop(spares);
+
+        if result == -2 {
+            return Err(Error::Interrupted);
+        }
 
         if result != 0 {
-            return Err(Error::App);
-        } else {
-            Ok(response)
+            if exception.class_name.is_null() {
+                return Err(Error::App);
+            }
+
+            let err = Exception::from(&exception);
+            unsafe { rwf_exception_drop(&mut exception) };
+
+            return Err(Error::Exception(err));
         }
+
+        let timings = &response.timings;
+        debug!(
+            "Rack request finished in {:.2}ms (app {:.2}ms, bindings {:.2}ms, {} allocations, {} minor and {} major GCs taking {:.2}ms)",
+            timings.total().as_secs_f64() * 1000.0,
+            timings.call().as_secs_f64() * 1000.0,
+            timings.ffi().as_secs_f64() * 1000.0,
+            timings.allocated_objects,
+            timings.minor_gc_count,
+            timings.major_gc_count,
+            timings.gc_time_us as f64 / 1000.0,
+        );
+
+        Ok(response)
+    }
+}
+
+extern "C" fn early_hints(data: *mut c_void, headers: *const KeyValue, length: c_int) {
+    let hints = unsafe { &mut *(data as *mut &mut dyn FnMut(EarlyHints)) };
+    let headers = unsafe { slice::from_raw_parts(headers, length as usize) };
+
+    let headers = headers
+        .iter()
+        .map(|header| unsafe {
+            (
+                String::from_utf8_lossy(header.key()).into_owned(),
+                String::from_utf8_lossy(header.value()).into_owned(),
+            )
+        })
+        .collect();
+
+    // Unwinding through Ruby isn't allowed.
+    if catch_unwind(AssertUnwindSafe(|| hints(headers))).is_err() {
+        error!("early hints handler panicked");
     }
 }
 
@@ -120,12 +614,16 @@ impl RackRequest {
 ///
 /// Upon receiving a response from Rack, we copy data into Rust
 /// and release C-allocated memory so the Ruby garbage collector can run.
+/// These copies are made for every response: unlike the env buffers and header arrays,
+/// which are reused, the response leaves the Ruby thread and lives as long as the caller wants.
 #[derive(Debug)]
 pub struct RackResponseOwned {
     code: u16,
-    headers: HashMap<String, String>,
-    body: Vec<u8>,
+    headers: Vec<(String, String)>,
+    body: Bytes,
     is_file: bool,
+    is_stream: bool,
+    timings: RackTimings,
 }
 
 impl RackResponseOwned {
@@ -134,6 +632,14 @@ impl RackResponseOwned {
         &self.body
     }
 
+    /// Take the body, e.g. to send it to the client.
+    ///
+    /// Large bodies are not copied: the bytes belong to the Ruby string
+    /// which is released once the returned value is dropped.
+    pub fn take_body(&mut self) -> Bytes {
+        std::mem::take(&mut self.body)
+    }
+
     /// Request HTTP code.
     pub fn code(&self) -> u16 {
         self.code
@@ -144,10 +650,31 @@ impl RackResponseOwned {
         self.is_file
     }
 
-    /// Request headers.
-    pub fn headers(&self) -> &HashMap<String, String> {
+    /// Is the body streamed? If so, [`RackResponseOwned::body`] is empty
+    /// and the chunks come from [`RackResponse::each`].
+    pub fn is_stream(&self) -> bool {
+        self.is_stream
+    }
+
+    /// Response headers, in the order Rack returned them.
+    ///
+    /// Headers with multiple values, e.g. `Set-Cookie`, appear once per value.
+    pub fn headers(&self) -> &[(String, String)] {
         &self.headers
     }
+
+    /// Where the request spent its time in Ruby.
+    pub fn timings(&self) -> &RackTimings {
+        &self.timings
+    }
+
+    /// First value of a response header.
+    pub fn header(&self, name: &str) -> Option<&str> {
+        self.headers
+            .iter()
+            .find(|(key, _)| key == name)
+            .map(|(_, value)| value.as_str())
+    }
 }
 
 impl From<RackResponse> for RackResponseOwned {
@@ -155,40 +682,147 @@ impl From<RackResponse> for RackResponseOwned {
     /// This also drops the reference to the Rack response array,
     /// allowing it to be garbage collected.
     fn from(response: RackResponse) -> RackResponseOwned {
+        RackResponseOwned::from(&response)
+    }
+}
+
+impl From<&RackResponse> for RackResponseOwned {
+    /// Copy the response out of C into Rust-owned memory, keeping the Rack response around,
+    /// e.g. to stream its body afterwards.
+    fn from(response: &RackResponse) -> RackResponseOwned {
         let code = response.code as u16;
 
-        let mut headers = HashMap::new();
+        let mut headers = Vec::with_capacity(response.num_headers as usize);
 
         for n in 0..response.num_headers {
-            let env_key = unsafe { response.headers.offset(n as isize) };
-            let name = unsafe { CStr::from_ptr((*env_key).key) };
-            let value = unsafe { CStr::from_ptr((*env_key).value) };
+            let env_key = unsafe { &*response.headers.offset(n as isize) };
+            let (name, value) = unsafe { (env_key.key(), env_key.value()) };
 
             // Headers should be valid UTF-8.
-            headers.insert(
-                name.to_string_lossy().to_string(),
-                value.to_string_lossy().to_string(),
-            );
+            headers.push((
+                String::from_utf8_lossy(name).to_string(),
+                String::from_utf8_lossy(value).to_string(),
+            ));
         }
 
         // Body can be anything.
-        let body = unsafe { CStr::from_ptr(response.body) };
-        let body = Vec::from(body.to_bytes());
+        let body = PinnedBody::new(response)
+            .map(Bytes::from_owner)
+            .unwrap_or_else(|| {
+                Bytes::copy_from_slice(unsafe {
+                    slice::from_raw_parts(response.body as *const u8, response.body_len)
+                })
+            });
 
         RackResponseOwned {
             code,
             headers,
             body,
             is_file: response.is_file == 1,
+            is_stream: response.is_stream == 1,
+            timings: response.timings,
         }
     }
 }
 
+/// Response body borrowed from Ruby.
+///
+/// The Ruby string is pinned, so its bytes can go to the client without copying them.
+/// It's unpinned from the Ruby thread after this is dropped.
+struct PinnedBody {
+    ptr: *const u8,
+    len: usize,
+    value: uintptr_t,
+}
+
+// The bytes are frozen and pinned until drop.
+unsafe impl Send for PinnedBody {}
+
+impl PinnedBody {
+    fn new(response: &RackResponse) -> Option<Self> {
+        if response.body_len < PIN_MIN_LEN {
+            return None;
+        }
+
+        let mut ptr = std::ptr::null();
+        let mut len = 0;
+        let value = unsafe { rwf_body_pin(response, &mut ptr, &mut len) };
+
+        if value == 0 {
+            None
+        } else {
+            Some(Self {
+                ptr: ptr as *const u8,
+                len,
+                value,
+            })
+        }
+    }
+
+    /// Unpin bodies dropped since the last call. Call this from the Ruby thread.
+    fn release() {
+        let values = std::mem::take(&mut *UNPINNED.lock().unwrap());
+
+        for value in values {
+            unsafe { rwf_body_unpin(value) }
+        }
+    }
+}
+
+impl AsRef<[u8]> for PinnedBody {
+    fn as_ref(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.ptr, self.len) }
+    }
+}
+
+impl Drop for PinnedBody {
+    fn drop(&mut self) {
+        // Could be dropped anywhere, but Ruby can only be called from its own thread.
+        UNPINNED.lock().unwrap().push(self.value);
+    }
+}
+
 impl RackResponse {
     /// Parse the Rack response from a Ruby value.
     pub fn new(value: &Value) -> Self {
         unsafe { rwf_rack_response_new(value.raw_ptr()) }
     }
+
+    /// The body has to be read with [`RackResponse::each`].
+    pub fn is_stream(&self) -> bool {
+        self.is_stream == 1
+    }
+
+    /// Stream the body, passing each chunk to `f` as soon as Ruby produces it.
+    ///
+    /// Return `false` from `f` to stop early, e.g. if the client disconnected.
+    /// The body is closed afterwards. Like everything else, call this from the Ruby thread.
+    pub fn each<F>(&self, mut f: F) -> Result<(), Error>
+    where
+        F: FnMut(&[u8]) -> bool,
+    {
+        extern "C" fn chunk<F>(data: *mut c_void, chunk: *const c_char, len: usize) -> c_int
+        where
+            F: FnMut(&[u8]) -> bool,
+        {
+            let f = unsafe { &mut *(data as *mut F) };
+            let chunk = unsafe { slice::from_raw_parts(chunk as *const u8, len) };
+
+            if f(chunk) {
+                0
+            } else {
+                1
+            }
+        }
+
+        let result = unsafe { rwf_body_each(self, chunk::<F>, &mut f as *mut F as *mut c_void) };
+
+        if result != 0 {
+            Err(Error::App)
+        } else {
+            Ok(())
+        }
+    }
 }
 
 impl Drop for RackResponse {
@@ -231,19 +865,82 @@ extern "C" {
 
     /// Deallocate memory allocated for converting the Rack response
     /// from Ruby to Rust.
-    fn rwf_rack_response_drop(response: &RackResponse);
+    fn rwf_rack_response_drop(response: &mut RackResponse);
 
     /// Load an app into the VM.
-    fn rwf_load_app(path: *const c_char) -> c_int;
+    fn rwf_load_app(
+        path: *const c_char,
+        num_options: c_int,
+        options: *const *const c_char,
+    ) -> c_int;
 
     /// Initialize Ruby correctly.
     fn rwf_init_ruby();
 
+    /// Resolve the app and the method IDs it needs once.
+    fn rwf_app_bind(app_name: *const c_char) -> *mut RackAppHandle;
+
+    /// Load the app from a rackup file with `Rack::Builder.parse_file`.
+    fn rwf_app_rackup(path: *const c_char) -> *mut RackAppHandle;
+
+    /// Set `rack.multithread` in the app's env.
+    fn rwf_app_set_multithread(app: *mut RackAppHandle, multithread: c_int);
+
+    /// Set `rack.multiprocess` in the app's env.
+    fn rwf_app_set_multiprocess(app: *mut RackAppHandle, multiprocess: c_int);
+
+    /// Release the app handle.
+    fn rwf_app_drop(app: *mut RackAppHandle);
+
+    /// Keep the body string alive after the response is gone.
+    fn rwf_body_pin(
+        response: *const RackResponse,
+        ptr: *mut *const c_char,
+        len: *mut usize,
+    ) -> uintptr_t;
+
+    /// Release a body pinned with `rwf_body_pin`.
+    fn rwf_body_unpin(value: uintptr_t);
+
+    /// Iterate over a streaming body.
+    fn rwf_body_each(
+        response: *const RackResponse,
+        f: extern "C" fn(*mut c_void, *const c_char, usize) -> c_int,
+        data: *mut c_void,
+    ) -> c_int;
+
+    /// Approximate heap size, from `GC.stat`.
+    fn rwf_gc_heap_bytes() -> usize;
+
+    /// Run a minor GC, or a major one if `full` is set or one is due.
+    fn rwf_gc_start(full: c_int);
+
+    /// Fork the VM with `Process.fork`. Returns the child's pid in the parent, 0 in the child.
+    fn rwf_fork() -> c_int;
+
+    /// Run jobs in Ruby threads.
+    fn rwf_serve(server: *const RwfServer) -> c_int;
+
+    /// Release the GVL while calling `f`.
+    fn rwf_without_gvl(f: extern "C" fn(*mut c_void) -> *mut c_void, data: *mut c_void);
+
     fn rwf_app_call(
         request: RackRequest,
-        app_name: *const c_char,
+        app: *const RackAppHandle,
         response: *mut RackResponse,
+        err: *mut RackException,
     ) -> c_int;
+
+    /// Free the strings of an exception returned by `rwf_app_call`.
+    fn rwf_exception_drop(err: *mut RackException);
+
+    /// Report exceptions the bindings can't return through this function.
+    fn rwf_set_error_handler(
+        handler: extern "C" fn(context: *const c_char, err: *const RackException),
+    );
+
+    /// Define the methods the ActionCable bridge calls the handler with.
+    fn rwf_cable_install(handler: extern "C" fn(event: *const cable::RwfCableEvent));
 }
 
 /// Errors returned from Ruby.
@@ -257,6 +954,13 @@ pub enum Error {
 
     #[error("Ruby app failed to load")]
     App,
+
+    #[error("{0}")]
+    Exception(Exception),
+
+    /// The thread was killed or the VM is exiting.
+    #[error("Ruby thread was interrupted")]
+    Interrupted,
 }
 
 /// Wrapper around Ruby's `VALUE`.
@@ -354,17 +1058,24 @@ impl Ruby {
     fn new() -> Result<Self, Error> {
         unsafe {
             rwf_init_ruby();
+            rwf_set_error_handler(log_exception);
             Ok(Ruby {})
         }
     }
 
     /// Preload the Rack app into memory. Run this before trying to run anything else.
     pub fn load_app(path: impl AsRef<Path> + Copy) -> Result<(), Error> {
-        Self::init()?;
-        let path = path.as_ref();
+        Self::load_app_with_options(path, &[])
+    }
 
-        let version = Self::eval("RUBY_VERSION").unwrap().to_string();
-        info!("Using Ruby v{}", version);
+    /// Preload the Rack app, passing flags to the VM like to the `ruby` command, e.g. `--yjit`.
+    ///
+    /// The VM boots when the app is loaded, which can only happen once per process.
+    pub fn load_app_with_options(
+        path: impl AsRef<Path> + Copy,
+        options: &[&str],
+    ) -> Result<(), Error> {
+        let path = path.as_ref();
 
         if path.exists() {
             // We use `require`, which only works with abslute paths.
@@ -372,10 +1083,39 @@ impl Ruby {
             let s = absolute.display().to_string();
             let cs = CString::new(s).unwrap();
 
-            unsafe {
-                if rwf_load_app(cs.as_ptr()) != 0 {
-                    return Err(Error::App);
-                }
+            Self::boot_vm(Some(&cs), options)
+        } else {
+            Self::init()
+        }
+    }
+
+    /// Boot the VM without loading an app, passing flags to it like to the `ruby` command.
+    ///
+    /// Use this to load apps with [`RackApp::rackup`] instead of [`Ruby::load_app`].
+    /// Like loading an app, it can only happen once per process.
+    pub fn boot(options: &[&str]) -> Result<(), Error> {
+        Self::boot_vm(None, options)
+    }
+
+    fn boot_vm(path: Option<&CString>, options: &[&str]) -> Result<(), Error> {
+        Self::init()?;
+
+        let version = Self::eval("RUBY_VERSION").unwrap().to_string();
+        info!("Using Ruby v{}", version);
+
+        let options = options
+            .iter()
+            .map(|option| CString::new(*option).unwrap())
+            .collect::<Vec<_>>();
+        let options = options
+            .iter()
+            .map(|option| option.as_ptr())
+            .collect::<Vec<_>>();
+        let path = path.map(|path| path.as_ptr()).unwrap_or(std::ptr::null());
+
+        unsafe {
+            if rwf_load_app(path, options.len() as c_int, options.as_ptr()) != 0 {
+                return Err(Error::App);
             }
         }
 
@@ -416,6 +1156,11 @@ impl Ruby {
             rb_gc_enable();
         }
     }
+
+    /// Compact the heap, e.g. before forking workers, so they share more memory with the parent.
+    pub fn gc_compact() -> Result<(), Error> {
+        Self::eval("GC.compact").map(|_| ())
+    }
 }
 
 impl Drop for Ruby {
@@ -427,12 +1172,97 @@ impl Drop for Ruby {
 }
 
 #[cfg(test)]
-mod test {
+pub(crate) mod test {
     use super::*;
+    use once_cell::sync::Lazy;
+    use std::collections::HashMap;
     use std::env::var;
+    use std::panic::{catch_unwind, AssertUnwindSafe};
+    use std::process::Command;
+    use std::sync::mpsc::{channel, Sender};
+    use std::sync::Mutex;
+    use std::thread;
+    use std::time::Instant;
+
+    type Test = Box<dyn FnOnce() + Send>;
+
+    // The VM only works on the thread that started it, but the test harness
+    // runs every test on a thread of its own.
+    static RUBY_THREAD: Lazy<Mutex<Sender<(Test, Sender<Result<(), String>>)>>> = Lazy::new(|| {
+        let (tx, rx) = channel::<(Test, Sender<Result<(), String>>)>();
+
+        thread::spawn(move || {
+            for (test, done) in rx {
+                let result = catch_unwind(AssertUnwindSafe(test)).map_err(|err| {
+                    err.downcast_ref::<String>()
+                        .cloned()
+                        .or_else(|| err.downcast_ref::<&str>().map(|s| s.to_string()))
+                        .unwrap_or_default()
+                });
+                let _ = done.send(result);
+            }
+        });
+
+        Mutex::new(tx)
+    });
+
+    /// Set in the process [`in_subprocess`] starts, to the test it runs.
+    const SUBPROCESS: &str = "RWF_RUBY_TEST_SUBPROCESS";
+
+    /// Boot the VM like [`Ruby::load_app`] does. It can only be booted once per process.
+    pub(crate) fn boot() {
+        static BOOT: std::sync::Once = std::sync::Once::new();
+
+        BOOT.call_once(|| {
+            let path = std::env::temp_dir().join("rwf_empty_app.rb");
+            std::fs::write(&path, "").unwrap();
+            Ruby::load_app(&path).unwrap();
+        });
+    }
+
+    pub(crate) fn on_ruby_thread(test: impl FnOnce() + Send + 'static) {
+        let (tx, rx) = channel();
+        RUBY_THREAD
+            .lock()
+            .unwrap()
+            .send((Box::new(test), tx))
+            .unwrap();
+
+        if let Err(err) = rx.recv().unwrap() {
+            panic!("{}", err);
+        }
+    }
+
+    /// Run the test named `name`, e.g. `prefork::test::test_prefork_worker`, in a copy of the
+    /// test binary running only that test, for tests that fork or boot the VM their own way.
+    pub(crate) fn in_subprocess(name: &str, test: impl FnOnce() + Send + 'static) {
+        if var(SUBPROCESS).as_deref() == Ok(name) {
+            return on_ruby_thread(test);
+        }
+
+        let output = Command::new(std::env::current_exe().unwrap())
+            .args([name, "--exact", "--test-threads=1", "--nocapture"])
+            .env(SUBPROCESS, name)
+            .output()
+            .unwrap();
+        let stdout = String::from_utf8_lossy(&output.stdout);
+
+        // A name that matches no test passes too.
+        assert!(
+            output.status.success() && stdout.contains("1 passed"),
+            "{} failed in its own process:\n{}\n{}",
+            name,
+            stdout,
+            String::from_utf8_lossy(&output.stderr)
+        );
+    }
 
     #[test]
     fn test_rack_response() {
+        on_ruby_thread(test_rack_response_inner);
+    }
+
+    fn test_rack_response_inner() {
         let response = Ruby::eval(r#"[200, {"hello": "world", "the year is 2024": "linux desktop is coming"}, ["apples and oranges"]]"#).unwrap();
         let response = RackResponse::new(&response);
 
@@ -441,8 +1271,8 @@ mod test {
 
         let owned = RackResponseOwned::from(response);
         assert_eq!(
-            owned.headers.get("the year is 2024"),
-            Some(&String::from("linux desktop is coming"))
+            owned.header("the year is 2024"),
+            Some("linux desktop is coming")
         );
         assert_eq!(
             String::from_utf8_lossy(&owned.body),
@@ -450,8 +1280,615 @@ mod test {
         );
     }
 
+    #[test]
+    fn test_header_arena() {
+        on_ruby_thread(test_header_arena_inner);
+    }
+
+    fn test_header_arena_inner() {
+        let large = Ruby::eval(r#"[200, (1..32).to_h { |i| ["x-#{i}", "1"] }, []]"#).unwrap();
+        let small = Ruby::eval(r#"[200, {"a": "1"}, []]"#).unwrap();
+
+        let response = RackResponse::new(&large);
+        let headers = response.headers;
+        assert_eq!(response.num_headers, 32);
+        drop(response);
+
+        // The array is given back and reused by the next response.
+        let response = RackResponse::new(&small);
+        assert_eq!(response.headers, headers);
+        assert_eq!(response.num_headers, 1);
+
+        // Both alive at once: the second one can't share it.
+        let other = RackResponse::new(&small);
+        assert_ne!(other.headers, headers);
+        assert_eq!(RackResponseOwned::from(other).header("a"), Some("1"));
+        assert_eq!(RackResponseOwned::from(response).header("a"), Some("1"));
+    }
+
+    #[test]
+    fn test_body_shapes() {
+        on_ruby_thread(test_body_shapes_inner);
+    }
+
+    fn test_body_shapes_inner() {
+        let response = Ruby::eval(
+            r#"
+            file = Object.new
+            def file.to_path = "/tmp/rwf.txt"
+            def file.each = nil
+            [200, {}, file]
+            "#,
+        )
+        .unwrap();
+        let owned = RackResponseOwned::from(RackResponse::new(&response));
+        assert!(owned.is_file());
+        assert_eq!(owned.body(), b"/tmp/rwf.txt");
+
+        let response = Ruby::eval(
+            r#"
+            proxy = Object.new
+            def proxy.to_ary = ["proxied"]
+            [200, {}, proxy]
+            "#,
+        )
+        .unwrap();
+        let owned = RackResponseOwned::from(RackResponse::new(&response));
+        assert!(!owned.is_file() && !owned.is_stream());
+        assert_eq!(owned.body(), b"proxied");
+
+        let response = Ruby::eval(r#"[204, {}, []]"#).unwrap();
+        let owned = RackResponseOwned::from(RackResponse::new(&response));
+        assert!(owned.body().is_empty());
+    }
+
+    #[test]
+    fn test_multi_value_headers() {
+        on_ruby_thread(test_multi_value_headers_inner);
+    }
+
+    fn test_multi_value_headers_inner() {
+        let response = Ruby::eval(
+            r#"[200, {content_type: "text/plain", "x-count" => 5, "set-cookie" => ["a=1", "b=2"], "link" => "</a.css>\n</b.js>"}, []]"#,
+        )
+        .unwrap();
+        let response = RackResponse::new(&response);
+        let owned = RackResponseOwned::from(&response);
+
+        assert_eq!(owned.header("content_type"), Some("text/plain"));
+        assert_eq!(owned.header("x-count"), Some("5"));
+        assert_eq!(
+            owned.headers()[2..],
+            [
+                ("set-cookie".to_string(), "a=1".to_string()),
+                ("set-cookie".to_string(), "b=2".to_string()),
+                ("link".to_string(), "</a.css>".to_string()),
+                ("link".to_string(), "</b.js>".to_string()),
+            ]
+        );
+        assert_eq!(response.num_headers, 6);
+    }
+
+    #[test]
+    fn test_app_call() {
+        on_ruby_thread(test_app_call_inner);
+    }
+
+    fn test_app_call_inner() {
+        Ruby::eval(
+            r#"
+            $rwf_test_app = lambda do |env|
+              headers = {
+                "x-method" => env["REQUEST_METHOD"].to_s,
+                "x-protocol" => env["SERVER_PROTOCOL"],
+                "x-seen" => env.key?("rwf.seen").to_s,
+              }
+              env["rwf.seen"] = true
+
+              body = env["rack.input"].read
+              headers["x-length"] = body.bytesize.to_s
+
+              [201, headers, [body.bytes.map { |b| "%02x" % b }.join]]
+            end
+            "#,
+        )
+        .unwrap();
+
+        let app = RackApp::bind("$rwf_test_app").unwrap();
+        let env = HashMap::from([("REQUEST_METHOD".to_string(), "POST".to_string())]);
+        let response = RackRequest::send(&app, env, b"hello").unwrap();
+        let owned = RackResponseOwned::from(response);
+
+        assert_eq!(owned.code, 201);
+        assert_eq!(owned.header("x-method"), Some("POST"));
+        assert_eq!(owned.header("x-protocol"), Some("HTTP/1.1"));
+        assert_eq!(owned.body(), b"68656c6c6f");
+
+        // Every request gets a fresh copy of the base env.
+        let response = RackRequest::send(&app, HashMap::new(), b"").unwrap();
+        let owned = RackResponseOwned::from(response);
+        assert_eq!(owned.header("x-seen"), Some("false"));
+
+        // Binary bodies go through as-is.
+        let response = RackRequest::send(&app, HashMap::new(), b"a\0b\0").unwrap();
+        let owned = RackResponseOwned::from(response);
+        assert_eq!(owned.header("x-length"), Some("4"));
+        assert_eq!(owned.body(), b"61006200");
+
+        assert!(RackApp::bind("raise 'not an app'").is_err());
+    }
+
+    #[test]
+    fn test_request_timings() {
+        on_ruby_thread(test_request_timings_inner);
+    }
+
+    fn test_request_timings_inner() {
+        boot();
+        Ruby::eval(
+            r#"$rwf_busy_app = lambda { |env| 10_000.times.map { |i| "object #{i}" }; [200, {}, ["ok"]] }"#,
+        )
+        .unwrap();
+        let app = RackApp::bind("$rwf_busy_app").unwrap();
+
+        let response = RackRequest::send(&app, HashMap::new(), b"").unwrap();
+        let timings = *RackResponseOwned::from(response).timings();
+
+        assert!(timings.allocated_objects >= 10_000);
+        assert!(timings.call_ns > 0);
+        assert!(timings.env_ns > 0);
+        assert!(timings.total() >= timings.call());
+        assert_eq!(timings.yjit_compiled_iseqs, 0);
+
+        // Measured finer than GC.stat(:time), which rounds them to milliseconds.
+        let app = RackApp::bind("lambda { |env| GC.start; [200, {}, []] }").unwrap();
+        let response = RackRequest::send(&app, HashMap::new(), b"").unwrap();
+        let timings = *RackResponseOwned::from(response).timings();
+
+        assert!(timings.major_gc_count >= 1);
+        assert!(timings.gc_time_us > 0);
+    }
+
+    #[test]
+    fn test_app_exception() {
+        on_ruby_thread(test_app_exception_inner);
+    }
+
+    fn test_app_exception_inner() {
+        Ruby::eval(
+            r#"
+            $rwf_raising_app = lambda do |env|
+              raise ArgumentError, "bad request" if env["PATH_INFO"] == "/raise"
+              env["PATH_INFO"] == "/invalid" ? "not a response" : [200, {}, ["ok"]]
+            end
+            "#,
+        )
+        .unwrap();
+        let app = RackApp::bind("$rwf_raising_app").unwrap();
+        let env = |path: &str| HashMap::from([("PATH_INFO".to_string(), path.to_string())]);
+
+        match RackRequest::send(&app, env("/raise"), b"") {
+            Err(Error::Exception(err)) => {
+                assert_eq!(err.class, "ArgumentError");
+                assert_eq!(err.message, "bad request");
+                assert!(!err.backtrace.is_empty());
+                assert_eq!(err.to_string(), "ArgumentError: bad request");
+            }
+            other => panic!("expected an exception, got {:?}", other.map(|_| ())),
+        }
+
+        match RackRequest::send(&app, env("/invalid"), b"") {
+            Err(Error::Exception(err)) => assert_eq!(err.class, "TypeError"),
+            other => panic!("expected an exception, got {:?}", other.map(|_| ())),
+        }
+
+        // The VM is still fine.
+        let response = RackRequest::send(&app, env("/"), b"").unwrap();
+        assert_eq!(RackResponseOwned::from(response).body(), b"ok");
+    }
+
+    #[test]
+    fn test_rackup() {
+        on_ruby_thread(test_rackup_inner);
+    }
+
+    fn test_rackup_inner() {
+        // Rack isn't a default gem; without it, stand in for the part of Rack::Builder we use.
+        Ruby::eval(
+            r#"
+            begin
+              require "rack"
+            rescue LoadError
+              module Rack
+                class Builder
+                  def self.parse_file(path)
+                    builder = new
+                    builder.instance_eval(File.read(path), path)
+                    [builder.to_app, {}]
+                  end
+
+                  def run(app)
+                    @app = app
+                  end
+
+                  def to_app
+                    @app
+                  end
+                end
+              end
+            end
+            "#,
+        )
+        .unwrap();
+
+        let dir = std::env::temp_dir();
+        let health = dir.join("rwf_health.ru");
+        let api = dir.join("rwf_api.ru");
+        std::fs::write(&health, r#"run lambda { |env| [200, {}, ["ok"]] }"#).unwrap();
+        std::fs::write(
+            &api,
+            r#"run lambda { |env| [200, {"content-type" => "application/json"}, ["{}"]] }"#,
+        )
+        .unwrap();
+
+        // Each file is its own app, side by side in the same VM.
+        let health = RackApp::rackup(&health).unwrap();
+        let mut api = RackApp::rackup(&api).unwrap();
+        api.set_multithread(true);
+
+        let response = RackRequest::send(&health, HashMap::new(), b"").unwrap();
+        assert_eq!(RackResponseOwned::from(response).body(), b"ok");
+
+        let response = RackRequest::send(&api, HashMap::new(), b"").unwrap();
+        let owned = RackResponseOwned::from(response);
+        assert_eq!(owned.header("content-type"), Some("application/json"));
+        assert_eq!(owned.body(), b"{}");
+
+        assert!(RackApp::rackup(dir.join("rwf_missing.ru")).is_err());
+    }
+
+    #[test]
+    fn test_binary_body() {
+        on_ruby_thread(test_binary_body_inner);
+    }
+
+    fn test_binary_body_inner() {
+        Ruby::eval(r#"$rwf_binary_app = lambda { |env| [200, {}, [env["rack.input"].read * (env["QUERY_STRING"].to_i)]] }"#).unwrap();
+        let app = RackApp::bind("$rwf_binary_app").unwrap();
+
+        // Short bodies are copied, long ones are pinned; neither stops at a NUL byte.
+        for times in [1, 10_000] {
+            let env = HashMap::from([("QUERY_STRING".to_string(), times.to_string())]);
+            let response = RackRequest::send(&app, env, b"a\0b").unwrap();
+            let mut owned = RackResponseOwned::from(response);
+            let body = owned.take_body();
+
+            assert_eq!(body.len(), 3 * times);
+            assert_eq!(&body[..3], b"a\0b");
+            assert!(owned.body().is_empty());
+
+            // Released on the next request.
+            drop(body);
+        }
+
+        let env = HashMap::from([("QUERY_STRING".to_string(), "0".to_string())]);
+        let response = RackRequest::send(&app, env, b"").unwrap();
+        assert!(RackResponseOwned::from(response).body().is_empty());
+        assert!(UNPINNED.lock().unwrap().is_empty());
+    }
+
+    #[test]
+    fn test_serve_concurrently() {
+        on_ruby_thread(test_serve_concurrently_inner);
+    }
+
+    fn test_serve_concurrently_inner() {
+        // Ruby threads need the VM booted the way load_app does it.
+        boot();
+        Ruby::eval(
+            r#"$rwf_sleepy_app = lambda { |env| sleep 0.2; [200, {"x-multithread" => env["rack.multithread"].to_s}, ["ok"]] }"#,
+        )
+        .unwrap();
+        let app = RackApp::bind("$rwf_sleepy_app").unwrap();
+
+        let (jobs, rx) = channel::<Job>();
+        let (results, responses) = channel();
+
+        for _ in 0..4 {
+            let results = results.clone();
+            jobs.send(Box::new(move |app| {
+                let response = RackRequest::send(app, HashMap::new(), b"").unwrap();
+                let owned = RackResponseOwned::from(response);
+                without_gvl(|| results.send(owned).unwrap());
+            }))
+            .unwrap();
+        }
+        drop(jobs);
+        drop(results);
+
+        let start = Instant::now();
+        app.serve(4, None, None, rx).unwrap();
+
+        // The requests slept at the same time.
+        assert!(start.elapsed() < Duration::from_millis(600));
+
+        let responses = responses.iter().collect::<Vec<_>>();
+        assert_eq!(responses.len(), 4);
+        for response in responses {
+            assert_eq!(response.body(), b"ok");
+            assert_eq!(response.header("x-multithread"), Some("true"));
+        }
+    }
+
+    #[test]
+    fn test_request_timeout() {
+        on_ruby_thread(test_request_timeout_inner);
+    }
+
+    fn test_request_timeout_inner() {
+        boot();
+        Ruby::eval(
+            r#"$rwf_slow_app = lambda { |env| raise "boom" if env["PATH_INFO"] == "/raise"; sleep(env["PATH_INFO"] == "/slow" ? 10 : 0); [200, {}, ["ok"]] }"#,
+        )
+        .unwrap();
+        let app = RackApp::bind("$rwf_slow_app").unwrap();
+
+        let (jobs, rx) = channel::<Job>();
+        let (results, responses) = channel();
+
+        // The deadline ends with app.call, even when it raises.
+        let (after_raise, after_raise_rx) = channel();
+        jobs.send(Box::new(move |app| {
+            let env = HashMap::from([("PATH_INFO".to_string(), "/raise".to_string())]);
+            assert!(RackRequest::send(app, env, b"").is_err());
+            without_gvl(|| std::thread::sleep(Duration::from_millis(500)));
+
+            let env = HashMap::from([("PATH_INFO".to_string(), "/fast".to_string())]);
+            let result = RackRequest::send(app, env, b"").map(RackResponseOwned::from);
+            without_gvl(|| after_raise.send(result.map(|r| r.body().to_vec())).unwrap());
+        }))
+        .unwrap();
+
+        for path in ["/slow", "/fast"] {
+            let results = results.clone();
+            jobs.send(Box::new(move |app| {
+                let env = HashMap::from([("PATH_INFO".to_string(), path.to_string())]);
+                let result = RackRequest::send(app, env, b"").map(RackResponseOwned::from);
+                without_gvl(|| results.send((path, result)).unwrap());
+            }))
+            .unwrap();
+        }
+        drop(jobs);
+        drop(results);
+
+        let start = Instant::now();
+        app.serve(2, Some(Duration::from_millis(200)), None, rx)
+            .unwrap();
+        assert!(start.elapsed() < Duration::from_secs(2));
+
+        for (path, result) in responses.iter() {
+            match (path, result) {
+                ("/slow", Err(Error::Exception(err))) => {
+                    assert_eq!(err.class, "Rwf::RequestTimeout")
+                }
+                ("/fast", Ok(response)) => assert_eq!(response.body(), b"ok"),
+                (path, result) => panic!("{}: {:?}", path, result.map(|_| ())),
+            }
+        }
+
+        assert_eq!(after_raise_rx.recv().unwrap().unwrap(), b"ok");
+    }
+
+    #[test]
+    fn test_thread_killed() {
+        on_ruby_thread(test_thread_killed_inner);
+    }
+
+    fn test_thread_killed_inner() {
+        boot();
+        Ruby::eval(
+            r#"$rwf_kill_app = lambda { |env| Thread.current.kill if env["PATH_INFO"] == "/kill"; [200, {}, ["ok"]] }"#,
+        )
+        .unwrap();
+        let app = RackApp::bind("$rwf_kill_app").unwrap();
+
+        let (jobs, rx) = channel::<Job>();
+        let (results, responses) = channel();
+
+        for path in ["/kill", "/fast"] {
+            let results = results.clone();
+            jobs.send(Box::new(move |app| {
+                let env = HashMap::from([("PATH_INFO".to_string(), path.to_string())]);
+                let result = RackRequest::send(app, env, b"").map(RackResponseOwned::from);
+                // The job finishes before the thread dies.
+                without_gvl(|| results.send((path, result)).unwrap());
+            }))
+            .unwrap();
+        }
+        drop(jobs);
+        drop(results);
+
+        app.serve(2, None, None, rx).unwrap();
+
+        let mut responses = responses.iter().collect::<Vec<_>>();
+        responses.sort_by_key(|(path, _)| *path);
+
+        match responses.as_slice() {
+            [("/fast", Ok(response)), ("/kill", Err(Error::Interrupted))] => {
+                assert_eq!(response.body(), b"ok")
+            }
+            _ => panic!(
+                "{:?}",
+                responses
+                    .iter()
+                    .map(|(path, r)| (path, r.is_ok()))
+                    .collect::<Vec<_>>()
+            ),
+        }
+    }
+
+    #[test]
+    fn test_early_hints() {
+        on_ruby_thread(test_early_hints_inner);
+    }
+    fn test_early_hints_inner() {
+        Ruby::eval(
+            r#"
+            $rwf_hints_app = lambda do |env|
+              hints = env["rack.early_hints"]
+              return [200, {}, ["none"]] unless hints
+
+              $rwf_hints = hints
+              hints.call("link" => ["</app.css>; rel=preload; as=style", "</app.js>; rel=preload; as=script"])
+              hints.call({})
+              [200, {}, ["sent"]]
+            end
+            "#,
+        )
+        .unwrap();
+
+        let app = RackApp::bind("$rwf_hints_app").unwrap();
+
+        let response = RackRequest::send(&app, HashMap::new(), b"").unwrap();
+        assert_eq!(RackResponseOwned::from(response).body(), b"none");
+
+        let mut sent = vec![];
+        let response =
+            RackRequest::send_with_early_hints(&app, HashMap::new(), b"", |hints| sent.push(hints))
+                .unwrap();
+        assert_eq!(RackResponseOwned::from(response).body(), b"sent");
+
+        // Empty hints aren't sent.
+        assert_eq!(
+            sent,
+            vec![vec![
+                (
+                    "link".to_string(),
+                    "</app.css>; rel=preload; as=style".to_string()
+                ),
+                (
+                    "link".to_string(),
+                    "</app.js>; rel=preload; as=script".to_string()
+                ),
+            ]]
+        );
+
+        // Too late once the response is ready.
+        Ruby::eval(r#"$rwf_hints.call("link" => "</late.css>")"#).unwrap();
+        assert_eq!(sent.len(), 1);
+    }
+
+    #[test]
+    fn test_rack_input() {
+        on_ruby_thread(test_rack_input_inner);
+    }
+
+    fn test_rack_input_inner() {
+        Ruby::eval(
+            r#"
+            $rwf_input_app = lambda do |env|
+              input = env["rack.input"]
+              $rwf_input = input
+
+              parts = [
+                input.gets,
+                input.read(3),
+                input.read(0),
+                input.read,
+                input.read(1).inspect,
+                input.read,
+                input.rewind.to_s,
+                input.each.to_a.size.to_s,
+                (input.rewind; input.read(2, buf = +"")).equal?(buf).to_s,
+                buf,
+                input.size.to_s,
+              ]
+
+              [200, {}, [parts.join("|")]]
+            end
+            "#,
+        )
+        .unwrap();
+
+        let app = RackApp::bind("$rwf_input_app").unwrap();
+        let response = RackRequest::send(&app, HashMap::new(), b"line\nabcdef").unwrap();
+        let owned = RackResponseOwned::from(response);
+
+        assert_eq!(
+            String::from_utf8_lossy(owned.body()),
+            "line\n|abc||def|nil||0|2|true|li|11"
+        );
+
+        // The body belongs to Rust and is gone after the request.
+        let err = Ruby::eval("$rwf_input.read").unwrap_err();
+        assert!(err.to_string().contains("not available"));
+    }
+
+    #[test]
+    fn test_streaming_body() {
+        on_ruby_thread(test_streaming_body_inner);
+    }
+
+    fn test_streaming_body_inner() {
+        Ruby::eval(
+            r#"
+            class RwfTestBody
+              def each
+                yield "one"
+                yield "two"
+                yield "three"
+              end
+
+              def close = $rwf_body_closed = true
+            end
+
+            $rwf_chunks_app = lambda { |env| [200, {}, ["a", "b", "c"]] }
+            $rwf_stream_app = lambda { |env| [200, {}, RwfTestBody.new] }
+            "#,
+        )
+        .unwrap();
+
+        let app = RackApp::bind("$rwf_chunks_app").unwrap();
+        let response = RackRequest::send(&app, HashMap::new(), b"").unwrap();
+        assert!(response.is_stream());
+
+        let mut chunks = vec![];
+        response
+            .each(|chunk| {
+                chunks.push(chunk.to_vec());
+                true
+            })
+            .unwrap();
+        assert_eq!(chunks, vec![b"a".to_vec(), b"b".to_vec(), b"c".to_vec()]);
+
+        let app = RackApp::bind("$rwf_stream_app").unwrap();
+        let response = RackRequest::send(&app, HashMap::new(), b"").unwrap();
+        let owned = RackResponseOwned::from(&response);
+        assert!(owned.is_stream());
+        assert!(owned.body().is_empty());
+
+        // Stop after the first chunk, the body still gets closed.
+        let mut chunks = vec![];
+        response
+            .each(|chunk| {
+                chunks.push(chunk.to_vec());
+                false
+            })
+            .unwrap();
+        assert_eq!(chunks, vec![b"one".to_vec()]);
+        assert_eq!(
+            Ruby::eval("$rwf_body_closed.to_s").unwrap().to_string(),
+            "true"
+        );
+    }
+
     #[test]
     fn test_load_rails() {
+        // The VM can only be booted once, and the other tests boot it already.
+        in_subprocess("test::test_load_rails", test_load_rails_inner);
+    }
+
+    fn test_load_rails_inner() {
         #[cfg(target_os = "linux")]
         if var("GEM_HOME").is_err() {
             panic!(
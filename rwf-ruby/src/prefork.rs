@@ -0,0 +1,609 @@
+//! Prefork workers: the app is loaded once, then forked into worker processes.
+//!
+//! Each worker serves one request at a time over a Unix socket shared with the parent.
+//! Requests and responses are framed with little-endian length prefixes:
+//!
+//! - request: app (`u32`), number of env entries (`u32`), env keys and values, body
+//! - response: code (`u16`), flags (`u8`), timings (`u64` each), number of headers (`u32`),
+//!   header names and values, body
+//! - streamed bodies follow the response as chunks, ending with an empty chunk
+//!
+//! Byte strings are sent as their length (`u64`) followed by the bytes.
+use std::io::{BufReader, BufWriter, ErrorKind, Read, Result, Write};
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::os::unix::net::UnixStream;
+use std::time::Duration;
+
+use bytes::Bytes;
+use tracing::{error, info};
+
+use super::env::SPARE_ENVS;
+use super::gc::{GcPolicy, OutOfBand};
+use super::{
+    ruby_cleanup, rwf_fork, Env, RackApp, RackRequest, RackResponseOwned, RackTimings, KEY_VALUES,
+    UNPINNED,
+};
+
+const FLAG_FILE: u8 = 1;
+const FLAG_STREAM: u8 = 2;
+const FLAG_RETIRING: u8 = 4;
+
+/// Worker process running a forked copy of the Rack app.
+#[derive(Debug)]
+pub struct Worker {
+    pid: i32,
+    reader: BufReader<UnixStream>,
+    writer: BufWriter<UnixStream>,
+    retiring: bool,
+    timeout: Option<Duration>,
+}
+
+impl Worker {
+    /// Fork a new worker serving these apps. Call this from the Ruby thread, after they're loaded.
+    ///
+    /// The worker exits after a response if its resident memory went over `max_rss` bytes;
+    /// [`Worker::retiring`] tells the parent to replace it. With a [`GcPolicy`], the worker
+    /// collects garbage after sending a response, before waiting for the next request.
+    pub fn spawn(apps: &[RackApp], max_rss: Option<usize>, gc: Option<GcPolicy>) -> Result<Self> {
+        let (parent, child) = UnixStream::pair()?;
+
+        // The child only gets this thread, so a lock another thread holds when forking
+        // would stay held in the child forever. Take the ones the child needs first: the
+        // globals RackRequest::send and Env use, and stdout, where tracing writes the logs.
+        let locks = (
+            UNPINNED.lock().unwrap(),
+            KEY_VALUES.lock().unwrap(),
+            SPARE_ENVS.lock().unwrap(),
+            std::io::stdout().lock(),
+        );
+        let pid = unsafe { rwf_fork() };
+        drop(locks);
+
+        match pid {
+            -1 => Err(std::io::Error::other("fork failed")),
+
+            0 => {
+                drop(parent);
+                close_server_sockets(child.as_raw_fd());
+
+                for app in apps {
+                    app.set_multiprocess(true);
+                }
+
+                serve(apps, child, max_rss, gc.map(OutOfBand::new));
+
+                unsafe {
+                    ruby_cleanup(0);
+                    libc::_exit(0);
+                }
+            }
+
+            pid => {
+                drop(child);
+                info!("Started Rack worker {}", pid);
+
+                Ok(Self {
+                    pid,
+                    reader: BufReader::new(parent.try_clone()?),
+                    writer: BufWriter::new(parent),
+                    retiring: false,
+                    timeout: None,
+                })
+            }
+        }
+    }
+
+    /// Worker process id.
+    pub fn pid(&self) -> i32 {
+        self.pid
+    }
+
+    /// The worker went over its memory limit and exited after the last response.
+    pub fn retiring(&self) -> bool {
+        self.retiring
+    }
+
+    /// Kill the worker if it doesn't answer a request within this long.
+    ///
+    /// A worker can't be interrupted like a Ruby thread, so it's killed with `SIGKILL`
+    /// and [`Worker::send`] fails with [`ErrorKind::TimedOut`]; spawn a new one to replace it.
+    /// The whole response has to arrive in time, but streamed bodies can take as long as
+    /// they need once the response started.
+    pub fn set_timeout(&mut self, timeout: Option<Duration>) {
+        self.timeout = timeout;
+    }
+
+    /// Send a request to one of the worker's apps, by its position in [`Worker::spawn`],
+    /// and read the response.
+    ///
+    /// If the response is a stream, read its body with [`Worker::chunk`]
+    /// before sending another request.
+    pub fn send(&mut self, app: usize, env: &Env, body: &[u8]) -> Result<RackResponseOwned> {
+        write_u32(&mut self.writer, app as u32)?;
+        write_u32(&mut self.writer, env.len() as u32)?;
+        for (key, value) in env.iter() {
+            write_bytes(&mut self.writer, key)?;
+            write_bytes(&mut self.writer, value)?;
+        }
+        write_bytes(&mut self.writer, body)?;
+        self.writer.flush()?;
+
+        // A worker stuck anywhere in the response is as stuck as one that didn't start it.
+        self.reader.get_ref().set_read_timeout(self.timeout)?;
+        let response = self.read_response();
+        self.reader.get_ref().set_read_timeout(None)?;
+
+        response.map_err(|err| self.timed_out(err))
+    }
+
+    fn read_response(&mut self) -> Result<RackResponseOwned> {
+        let mut code = [0u8; 2];
+        self.reader.read_exact(&mut code)?;
+        let mut flags = [0u8; 1];
+        self.reader.read_exact(&mut flags)?;
+        let flags = flags[0];
+        let timings = read_timings(&mut self.reader)?;
+
+        let num_headers = read_u32(&mut self.reader)?;
+        let mut headers = Vec::with_capacity(num_headers as usize);
+        for _ in 0..num_headers {
+            let name = read_bytes(&mut self.reader)?;
+            let value = read_bytes(&mut self.reader)?;
+            headers.push((
+                String::from_utf8_lossy(&name).to_string(),
+                String::from_utf8_lossy(&value).to_string(),
+            ));
+        }
+
+        let body = read_bytes(&mut self.reader)?;
+        self.retiring = flags & FLAG_RETIRING != 0;
+
+        Ok(RackResponseOwned {
+            code: u16::from_le_bytes(code),
+            headers,
+            body: Bytes::from(body),
+            is_file: flags & FLAG_FILE != 0,
+            is_stream: flags & FLAG_STREAM != 0,
+            timings,
+        })
+    }
+
+    /// Kill the worker if the read timed out: it's still busy with the request.
+    fn timed_out(&mut self, err: std::io::Error) -> std::io::Error {
+        match err.kind() {
+            ErrorKind::WouldBlock | ErrorKind::TimedOut => {
+                unsafe { libc::kill(self.pid, libc::SIGKILL) };
+                std::io::Error::new(ErrorKind::TimedOut, "request timed out")
+            }
+            _ => err,
+        }
+    }
+
+    /// Read the next chunk of a streamed body. Returns `None` after the last one.
+    pub fn chunk(&mut self) -> Result<Option<Vec<u8>>> {
+        let chunk = read_bytes(&mut self.reader)?;
+
+        if chunk.is_empty() {
+            Ok(None)
+        } else {
+            Ok(Some(chunk))
+        }
+    }
+}
+
+impl Drop for Worker {
+    fn drop(&mut self) {
+        // The worker exits when it sees the socket close.
+        let _ = self.writer.get_ref().shutdown(std::net::Shutdown::Both);
+        let pid = self.pid;
+
+        // Reap it without blocking whoever dropped it.
+        std::thread::spawn(move || unsafe {
+            let mut status = 0;
+            libc::waitpid(pid, &mut status, 0);
+        });
+    }
+}
+
+/// Close the server's sockets the worker got from the parent: the listener and the
+/// connections to clients. While a worker holds a copy of a connection, closing it in the
+/// parent doesn't end it.
+///
+/// They're the listening TCP sockets and the other TCP sockets on the same ports. Sockets the app
+/// opened, e.g. to the database, use other local ports and are left alone.
+fn close_server_sockets(keep: RawFd) {
+    let dir = if cfg!(target_os = "linux") {
+        "/proc/self/fd"
+    } else {
+        "/dev/fd"
+    };
+
+    // Collected first: reading the directory uses a descriptor too.
+    let fds = match std::fs::read_dir(dir) {
+        Ok(entries) => entries
+            .filter_map(|entry| entry.ok()?.file_name().to_str()?.parse::<RawFd>().ok())
+            .filter(|fd| *fd > 2 && *fd != keep)
+            .collect::<Vec<_>>(),
+        Err(_) => return,
+    };
+
+    let ports = fds
+        .iter()
+        .filter(|fd| listening(**fd))
+        .filter_map(|fd| tcp_port(*fd))
+        .collect::<Vec<_>>();
+
+    for fd in fds {
+        if matches!(tcp_port(fd), Some(port) if ports.contains(&port)) {
+            unsafe { libc::close(fd) };
+        }
+    }
+}
+
+fn listening(fd: RawFd) -> bool {
+    let mut value: libc::c_int = 0;
+    let mut len = std::mem::size_of::<libc::c_int>() as libc::socklen_t;
+    let result = unsafe {
+        libc::getsockopt(
+            fd,
+            libc::SOL_SOCKET,
+            libc::SO_ACCEPTCONN,
+            &mut value as *mut libc::c_int as *mut libc::c_void,
+            &mut len,
+        )
+    };
+
+    result == 0 && value != 0
+}
+
+/// Local port of a TCP socket.
+fn tcp_port(fd: RawFd) -> Option<u16> {
+    let mut addr: libc::sockaddr_storage = unsafe { std::mem::zeroed() };
+    let mut len = std::mem::size_of::<libc::sockaddr_storage>() as libc::socklen_t;
+    let result = unsafe {
+        libc::getsockname(
+            fd,
+            &mut addr as *mut libc::sockaddr_storage as *mut libc::sockaddr,
+            &mut len,
+        )
+    };
+
+    if result != 0 {
+        return None;
+    }
+
+    let port = match addr.ss_family as libc::c_int {
+        libc::AF_INET => {
+            let addr = unsafe { &*(&addr as *const _ as *const libc::sockaddr_in) };
+            addr.sin_port
+        }
+        libc::AF_INET6 => {
+            let addr = unsafe { &*(&addr as *const _ as *const libc::sockaddr_in6) };
+            addr.sin6_port
+        }
+        _ => return None,
+    };
+
+    Some(u16::from_be(port))
+}
+
+/// Serve requests coming from the parent until it closes the socket.
+fn serve(apps: &[RackApp], stream: UnixStream, max_rss: Option<usize>, gc: Option<OutOfBand>) {
+    let mut reader = match stream.try_clone() {
+        Ok(stream) => BufReader::new(stream),
+        Err(_) => return,
+    };
+    let mut writer = BufWriter::new(stream);
+
+    loop {
+        let result = serve_one(apps, &mut reader, &mut writer, max_rss, gc.as_ref());
+
+        if let Some(ref gc) = gc {
+            gc.idle(false);
+        }
+
+        match result {
+            Ok(true) => continue,
+            Ok(false) => break,
+            Err(err) if err.kind() == ErrorKind::UnexpectedEof => break,
+            Err(err) => {
+                error!("Rack worker error: {}", err);
+                break;
+            }
+        }
+    }
+}
+
+/// Serve one request. Returns `false` if the worker should exit.
+fn serve_one(
+    apps: &[RackApp],
+    reader: &mut impl Read,
+    writer: &mut impl Write,
+    max_rss: Option<usize>,
+    gc: Option<&OutOfBand>,
+) -> Result<bool> {
+    let app = read_u32(reader)? as usize;
+    let num_env = read_u32(reader)?;
+    let mut env = Env::with_capacity(num_env as usize, 0);
+    for _ in 0..num_env {
+        let key = read_bytes(reader)?;
+        let value = read_bytes(reader)?;
+        env.insert(key, value);
+    }
+    let body = read_bytes(reader)?;
+
+    if let Some(gc) = gc {
+        gc.request();
+    }
+
+    // Answered with a 500 like any other failed request.
+    let response = match apps.get(app) {
+        Some(app) => RackRequest::send(app, env, &body),
+        None => Err(super::Error::App),
+    };
+
+    let retiring = match max_rss {
+        Some(max_rss) => rss().map(|rss| rss > max_rss).unwrap_or(false),
+        None => false,
+    };
+    let retiring_flag = if retiring { FLAG_RETIRING } else { 0 };
+
+    let response = match response {
+        Ok(response) => response,
+        Err(err) => {
+            match err {
+                super::Error::Exception(ref exception) => error!(
+                    "Rack application raised {} in worker {}\n{}",
+                    exception,
+                    std::process::id(),
+                    exception.backtrace.join("\n")
+                ),
+                ref err => error!(
+                    "Rack request failed in worker {}: {}",
+                    std::process::id(),
+                    err
+                ),
+            }
+
+            writer.write_all(&500u16.to_le_bytes())?;
+            writer.write_all(&[retiring_flag])?;
+            write_timings(writer, &RackTimings::default())?;
+            write_u32(writer, 0)?;
+            write_bytes(writer, b"")?;
+            writer.flush()?;
+            return Ok(!retiring);
+        }
+    };
+
+    let owned = RackResponseOwned::from(&response);
+    let mut flags = retiring_flag;
+    if owned.is_file() {
+        flags |= FLAG_FILE;
+    }
+    if owned.is_stream() {
+        flags |= FLAG_STREAM;
+    }
+
+    writer.write_all(&owned.code().to_le_bytes())?;
+    writer.write_all(&[flags])?;
+    write_timings(writer, owned.timings())?;
+    write_u32(writer, owned.headers().len() as u32)?;
+    for (name, value) in owned.headers() {
+        write_bytes(writer, name.as_bytes())?;
+        write_bytes(writer, value.as_bytes())?;
+    }
+    write_bytes(writer, owned.body())?;
+    writer.flush()?;
+
+    if owned.is_stream() {
+        let mut result = Ok(());
+
+        let _ = response.each(|chunk| {
+            if chunk.is_empty() {
+                return true;
+            }
+
+            result = write_bytes(writer, chunk).and_then(|_| writer.flush());
+            result.is_ok()
+        });
+
+        result?;
+        write_bytes(writer, b"")?;
+        writer.flush()?;
+    }
+
+    Ok(!retiring)
+}
+
+/// Resident memory of this process, in bytes.
+#[cfg(target_os = "linux")]
+fn rss() -> Option<usize> {
+    let statm = std::fs::read_to_string("/proc/self/statm").ok()?;
+    let pages = statm.split_whitespace().nth(1)?.parse::<usize>().ok()?;
+    let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+
+    Some(pages * page_size)
+}
+
+#[cfg(not(target_os = "linux"))]
+fn rss() -> Option<usize> {
+    None
+}
+
+fn write_u32(writer: &mut impl Write, value: u32) -> Result<()> {
+    writer.write_all(&value.to_le_bytes())
+}
+
+fn write_bytes(writer: &mut impl Write, bytes: &[u8]) -> Result<()> {
+    writer.write_all(&(bytes.len() as u64).to_le_bytes())?;
+    writer.write_all(bytes)
+}
+
+fn write_timings(writer: &mut impl Write, timings: &RackTimings) -> Result<()> {
+    for value in [
+        timings.env_ns,
+        timings.call_ns,
+        timings.response_ns,
+        timings.allocated_objects as u64,
+        timings.minor_gc_count as u64,
+        timings.major_gc_count as u64,
+        timings.gc_time_us as u64,
+        timings.yjit_compiled_iseqs as u64,
+    ] {
+        writer.write_all(&value.to_le_bytes())?;
+    }
+
+    Ok(())
+}
+
+fn read_u32(reader: &mut impl Read) -> Result<u32> {
+    let mut value = [0u8; 4];
+    reader.read_exact(&mut value)?;
+    Ok(u32::from_le_bytes(value))
+}
+
+fn read_bytes(reader: &mut impl Read) -> Result<Vec<u8>> {
+    let mut len = [0u8; 8];
+    reader.read_exact(&mut len)?;
+
+    let mut bytes = vec![0u8; u64::from_le_bytes(len) as usize];
+    reader.read_exact(&mut bytes)?;
+
+    Ok(bytes)
+}
+
+fn read_timings(reader: &mut impl Read) -> Result<RackTimings> {
+    let mut values = [0u64; 8];
+    for value in values.iter_mut() {
+        let mut bytes = [0u8; 8];
+        reader.read_exact(&mut bytes)?;
+        *value = u64::from_le_bytes(bytes);
+    }
+
+    Ok(RackTimings {
+        env_ns: values[0],
+        call_ns: values[1],
+        response_ns: values[2],
+        allocated_objects: values[3] as usize,
+        minor_gc_count: values[4] as usize,
+        major_gc_count: values[5] as usize,
+        gc_time_us: values[6] as usize,
+        yjit_compiled_iseqs: values[7] as usize,
+    })
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::test::in_subprocess;
+    use crate::{Ruby, PIN_MIN_LEN};
+    use std::sync::mpsc::channel;
+    use std::time::Instant;
+
+    #[test]
+    fn test_prefork_worker() {
+        // Forks the test process, so not the harness with the other tests' threads in it.
+        in_subprocess(
+            "prefork::test::test_prefork_worker",
+            test_prefork_worker_inner,
+        );
+    }
+
+    fn test_prefork_worker_inner() {
+        Ruby::eval(
+            r#"
+            $rwf_worker_app = lambda do |env|
+              sleep 10 if env["PATH_INFO"] == "/slow"
+              return [200, {}, ["x" * 16384]] if env["PATH_INFO"] == "/large"
+              return [200, {}, [env["rack.multiprocess"].to_s]] if env["PATH_INFO"] == "/multiprocess"
+              body = env["PATH_INFO"] == "/stream" ? ["a", "b"] : [Process.pid.to_s]
+              [200, {"x-path" => env["PATH_INFO"].to_s}, body]
+            end
+            $rwf_worker_health = lambda { |env| [200, {}, ["ok"]] }
+            "#,
+        )
+        .unwrap();
+        let apps = [
+            RackApp::bind("$rwf_worker_app").unwrap(),
+            RackApp::bind("$rwf_worker_health").unwrap(),
+        ];
+
+        let mut worker = Worker::spawn(&apps, None, None).unwrap();
+        let mut env = Env::new();
+        env.insert("PATH_INFO", "/");
+
+        // Served by the forked process.
+        let response = worker.send(0, &env, b"").unwrap();
+        assert_eq!(response.code(), 200);
+        assert_eq!(response.header("x-path"), Some("/"));
+        assert_eq!(response.body(), worker.pid().to_string().as_bytes());
+        assert!(response.timings().call_ns > 0);
+        assert!(!worker.retiring());
+
+        // Same worker, other app.
+        assert_eq!(worker.send(1, &env, b"").unwrap().body(), b"ok");
+        assert_eq!(worker.send(2, &env, b"").unwrap().code(), 500);
+
+        // Only the forked copy of the app is told other processes serve it too.
+        let mut env = Env::new();
+        env.insert("PATH_INFO", "/multiprocess");
+        assert_eq!(worker.send(0, &env, b"").unwrap().body(), b"true");
+        let response = RackRequest::send(&apps[0], env, b"").unwrap();
+        assert_eq!(RackResponseOwned::from(response).body(), b"false");
+
+        let mut env = Env::new();
+        env.insert("PATH_INFO", "/stream");
+        let response = worker.send(0, &env, b"").unwrap();
+        assert!(response.is_stream());
+        assert_eq!(worker.chunk().unwrap(), Some(b"a".to_vec()));
+        assert_eq!(worker.chunk().unwrap(), Some(b"b".to_vec()));
+        assert_eq!(worker.chunk().unwrap(), None);
+
+        // Any process is over a 1 byte limit: the worker answers, then exits.
+        let mut worker = Worker::spawn(&apps, Some(1), None).unwrap();
+        let response = worker.send(0, &env, b"").unwrap();
+        assert!(worker.retiring());
+        assert!(response.is_stream());
+        while worker.chunk().unwrap().is_some() {}
+        assert!(worker.send(0, &env, b"").is_err());
+
+        // Forked while another thread holds a lock the worker takes after each large body.
+        let (locked, held) = channel();
+        let holder = std::thread::spawn(move || {
+            let _unpinned = UNPINNED.lock().unwrap();
+            locked.send(()).unwrap();
+            std::thread::sleep(Duration::from_millis(100));
+        });
+        held.recv().unwrap();
+        let mut worker = Worker::spawn(&apps, None, None).unwrap();
+        holder.join().unwrap();
+        worker.set_timeout(Some(Duration::from_secs(2)));
+        let mut env = Env::new();
+        env.insert("PATH_INFO", "/large");
+        for _ in 0..2 {
+            assert_eq!(worker.send(0, &env, b"").unwrap().body().len(), PIN_MIN_LEN);
+        }
+
+        // The worker doesn't keep the server's connections open.
+        let listener = std::net::TcpListener::bind("127.0.0.1:0").unwrap();
+        let mut client = std::net::TcpStream::connect(listener.local_addr().unwrap()).unwrap();
+        let (connection, _) = listener.accept().unwrap();
+        let worker = Worker::spawn(&apps, None, None).unwrap();
+        drop(connection);
+        client
+            .set_read_timeout(Some(Duration::from_secs(2)))
+            .unwrap();
+        assert_eq!(std::io::Read::read(&mut client, &mut [0u8; 1]).unwrap(), 0);
+        drop(worker);
+
+        // A worker stuck in a request is killed.
+        let mut worker = Worker::spawn(&apps, None, None).unwrap();
+        worker.set_timeout(Some(Duration::from_millis(200)));
+        let mut env = Env::new();
+        env.insert("PATH_INFO", "/slow");
+        let start = Instant::now();
+        let err = worker.send(0, &env, b"").unwrap_err();
+        assert_eq!(err.kind(), std::io::ErrorKind::TimedOut);
+        assert!(start.elapsed() < Duration::from_secs(2));
+    }
+}
@@ -0,0 +1,175 @@
+# Rack app running copies of another app in Ractors, so requests use more than one core.
+#
+# Each Ractor builds its own app from the same Ruby code and serves one request at a time.
+# Calls come in on Ruby threads of the main Ractor, like to any other app, and wait for
+# an idle Ractor. The env is copied to it with the body read into a String, and the response
+# comes back with the body read into one String, so only Strings, numbers, booleans and arrays
+# of them cross over: rack.input is a StringIO, and rack.early_hints and rack.hijack aren't
+# there.
+#
+# Responses are taken from the Ractors by one thread, which hands them to the calls waiting
+# for them; Ruby 3.3 deadlocks when several threads take from Ractors at the same time.
+#
+# Ruby is experimental about Ractors. Apps only work in them if they don't touch anything
+# that isn't shareable, e.g. constants holding mutable objects or global variables, and the
+# code they need has to be loaded by the main Ractor first.
+require "stringio"
+
+module Rwf
+  class Ractors
+    # Env values that can be copied to a Ractor.
+    COPIED = [String, Symbol, Integer, Float, TrueClass, FalseClass, NilClass, Array].freeze
+
+    def self.pools
+      @pools ||= []
+    end
+
+    # Start the Ractors. The pool is stopped on exit.
+    def self.start(count, source)
+      at_exit { pools.each(&:close) } if pools.empty?
+
+      pool = new(count, source)
+      pools << pool
+      pool
+    end
+
+    attr_reader :size
+
+    def initialize(count, source)
+      @source = source.dup.freeze
+      @size = count
+      @idle = Thread::Queue.new
+      @replies = {}
+      @ractors = []
+
+      begin
+        count.times { add(spawn) }
+      rescue Exception
+        @ractors.each { |ractor| ractor.send(:stop) }
+        raise
+      end
+
+      @collector = Thread.new { collect }
+    end
+
+    def call(env)
+      input = env["rack.input"]
+      body = input ? input.read.to_s : ""
+      copy = {}
+
+      env.each do |key, value|
+        copy[key] = value if COPIED.any? { |type| type === value }
+      end
+
+      ractor = @idle.pop
+      reply = @replies[ractor]
+
+      begin
+        ractor.send([copy, body])
+      rescue Exception
+        @idle << ractor
+        raise
+      end
+
+      begin
+        response = reply.pop
+      rescue Exception
+        # Interrupted while the app runs, e.g. by Rwf::RequestTimeout. Let it finish first.
+        Thread.new { release(ractor, reply.pop) }
+        raise
+      end
+
+      release(ractor, response)
+      raise response if response.is_a?(Exception)
+
+      response
+    end
+
+    # Stop the Ractors once the requests they're running are done. Ruby waits for them
+    # on exit otherwise.
+    def close
+      @ractors.each { |ractor| ractor.send(:stop) }
+      @collector.join
+    end
+
+    private
+
+    def add(ractor)
+      @replies[ractor] = Thread::Queue.new
+      @ractors << ractor
+      @idle << ractor
+    end
+
+    def release(ractor, response)
+      @idle << ractor unless response.is_a?(Ractor::RemoteError)
+    end
+
+    def collect
+      loop do
+        ractor, response = begin
+          Ractor.select(*@ractors)
+        rescue Ractor::RemoteError => e
+          # It died outside of the app; fail its request and start another.
+          @ractors.delete(e.ractor)
+          add(spawn)
+          [e.ractor, e]
+        end
+
+        # Ractors that stopped return :stopped. Threads waiting on Ractor.select can't be
+        # killed, so this one ends once they're all gone.
+        if response == :stopped
+          @ractors.delete(ractor)
+          break if @ractors.empty?
+          next
+        end
+
+        @replies[ractor] << response
+        @replies.delete(ractor) if response.is_a?(Ractor::RemoteError)
+      end
+    end
+
+    def spawn
+      experimental = Warning[:experimental]
+      Warning[:experimental] = false
+
+      ractor = Ractor.new(@source) do |source|
+        app = eval(source)
+        Ractor.yield(:ready)
+
+        loop do
+          message = Ractor.receive
+          break if message == :stop
+
+          env, input = message
+          env["rack.input"] = StringIO.new(input)
+          env["rack.errors"] = $stderr
+          env["rack.multithread"] = false
+
+          response = begin
+            status, headers, body = app.call(env)
+            # One chunk, so the response isn't streamed.
+            buffer = String.new(encoding: Encoding::BINARY)
+            body.each { |chunk| buffer << chunk.to_s.b }
+            [status, headers, [buffer]]
+          rescue Exception => e
+            # Copies of exceptions lose the backtrace unless it's set explicitly.
+            e.set_backtrace(e.backtrace)
+            e
+          ensure
+            body.close if body.respond_to?(:close)
+          end
+
+          Ractor.yield(response)
+        end
+
+        :stopped
+      end
+
+      # Errors loading the app come out of here, e.g. a NameError.
+      ractor.take
+      ractor
+    ensure
+      Warning[:experimental] = experimental
+    end
+  end
+end
@@ -0,0 +1,85 @@
+//! Serve a Rack app from Ractors, so it runs on more than one core in one process.
+//!
+//! [`pool`] starts Ractors that each build the app from the same Ruby code, and returns
+//! an app that hands requests to them, one at a time per Ractor. It's served like any other,
+//! with [`RackApp::serve`](crate::RackApp::serve); each request waits for its Ractor in a
+//! Ruby thread of the main Ractor, without holding the main Ractor's GVL, so other requests
+//! keep coming in.
+//!
+//! Only apps written for Ractors work: they can't touch unshareable state, e.g. constants
+//! holding mutable objects or global variables, and need their code loaded by the VM first.
+//! The env and the response are copied between Ractors, bodies included; streamed bodies
+//! are read whole, and `rack.early_hints` isn't available. See [src/ractor.rb](ractor.rb).
+use once_cell::sync::OnceCell;
+
+use super::{Error, RackApp, Ruby};
+use crate::util::quote;
+
+static LOADED: OnceCell<()> = OnceCell::new();
+
+/// Start `count` Ractors, each building its app by evaluating `app`, e.g. `HelloApp.new`.
+///
+/// Call this from the Ruby thread, once the VM is booted and the app's code is loaded.
+/// Errors building the app, e.g. a `Ractor::IsolationError`, are logged and fail the call.
+pub fn pool(count: usize, app: &str) -> Result<RackApp, Error> {
+    Ruby::init()?;
+
+    LOADED.get_or_try_init(|| Ruby::eval(include_str!("ractor.rb")).map(|_| ()))?;
+
+    RackApp::bind(&format!(
+        "Rwf::Ractors.start({}, {})",
+        count.max(1),
+        quote(app)
+    ))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::test::{boot, on_ruby_thread};
+    use crate::{RackRequest, RackResponseOwned};
+    use std::collections::HashMap;
+
+    #[test]
+    fn test_ractors() {
+        on_ruby_thread(test_ractors_inner);
+    }
+
+    fn test_ractors_inner() {
+        boot();
+
+        Ruby::eval(
+            r#"
+            class RwfRactorApp
+              def call(env)
+                raise ArgumentError, "from a Ractor" if env["PATH_INFO"] == "/raise"
+
+                [200, {"x-ractor" => (Ractor.current != Ractor.main).to_s}, [env["rack.input"].read, env["PATH_INFO"]]]
+              end
+            end
+            "#,
+        )
+        .unwrap();
+
+        let mut app = pool(2, "RwfRactorApp.new").unwrap();
+        app.set_multithread(true);
+
+        let env = HashMap::from([("PATH_INFO".to_string(), "/hello".to_string())]);
+        let response = RackResponseOwned::from(RackRequest::send(&app, env, b"body").unwrap());
+        assert_eq!(response.code(), 200);
+        assert_eq!(response.header("x-ractor"), Some("true"));
+        assert_eq!(response.body(), b"body/hello");
+
+        let env = HashMap::from([("PATH_INFO".to_string(), "/raise".to_string())]);
+        match RackRequest::send(&app, env, b"") {
+            Err(Error::Exception(err)) => assert_eq!(err.message, "from a Ractor"),
+            _ => panic!("expected the app's exception"),
+        }
+
+        // Still serving after the exception.
+        let response = RackRequest::send(&app, HashMap::new(), b"").unwrap();
+        assert_eq!(RackResponseOwned::from(response).code(), 200);
+
+        assert!(pool(1, "RwfMissingRactorApp.new").is_err());
+    }
+}
@@ -0,0 +1,31 @@
+//! Helpers shared by the modules generating Ruby code.
+
+/// Ruby string literal with this content.
+pub(crate) fn quote(code: &str) -> String {
+    let mut quoted = String::with_capacity(code.len() + 2);
+    quoted.push('"');
+
+    for c in code.chars() {
+        if matches!(c, '"' | '\\' | '#') {
+            quoted.push('\\');
+        }
+        quoted.push(c);
+    }
+
+    quoted.push('"');
+    quoted
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_quote() {
+        assert_eq!(quote("App.new"), "\"App.new\"");
+        assert_eq!(
+            quote(r##"App.new("#{x}\n")"##),
+            r##""App.new(\"\#{x}\\n\")""##
+        );
+    }
+}
@@ -0,0 +1,139 @@
+//! Lock-free histogram with power-of-two buckets.
+//!
+//! Cheap enough to record every request. Percentiles are approximate:
+//! they return the upper bound of the bucket the value falls into.
+use std::sync::atomic::{AtomicU64, Ordering};
+
+/// One bucket per bit length, i.e. `0`, `1`, `2..=3`, `4..=7`, and so on.
+const BUCKETS: usize = 65;
+
+/// Distribution of values, e.g. request durations.
+#[derive(Debug)]
+pub struct Histogram {
+    buckets: [AtomicU64; BUCKETS],
+    count: AtomicU64,
+    sum: AtomicU64,
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const EMPTY: AtomicU64 = AtomicU64::new(0);
+
+impl Histogram {
+    /// Create an empty histogram.
+    pub const fn new() -> Self {
+        Self {
+            buckets: [EMPTY; BUCKETS],
+            count: AtomicU64::new(0),
+            sum: AtomicU64::new(0),
+        }
+    }
+
+    /// Record a value.
+    pub fn record(&self, value: u64) {
+        let bucket = (u64::BITS - value.leading_zeros()) as usize;
+
+        self.buckets[bucket].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(value, Ordering::Relaxed);
+    }
+
+    /// Number of recorded values.
+    pub fn count(&self) -> u64 {
+        self.count.load(Ordering::Relaxed)
+    }
+
+    /// Sum of the recorded values.
+    pub fn sum(&self) -> u64 {
+        self.sum.load(Ordering::Relaxed)
+    }
+
+    /// Average of the recorded values. `0` if there aren't any.
+    pub fn mean(&self) -> f64 {
+        match self.count() {
+            0 => 0.0,
+            count => self.sum() as f64 / count as f64,
+        }
+    }
+
+    /// Approximate percentile, e.g. `0.99` for p99. `0` if there aren't any values.
+    pub fn percentile(&self, percentile: f64) -> u64 {
+        let count = self.count();
+        if count == 0 {
+            return 0;
+        }
+
+        let target = ((count as f64 * percentile.clamp(0.0, 1.0)).ceil() as u64).max(1);
+        let mut seen = 0;
+
+        for (upper, count) in self.buckets() {
+            seen += count;
+            if seen >= target {
+                return upper;
+            }
+        }
+
+        u64::MAX
+    }
+
+    /// Non-empty buckets, as their largest value and the number of values in them.
+    pub fn buckets(&self) -> impl Iterator<Item = (u64, u64)> + '_ {
+        self.buckets
+            .iter()
+            .enumerate()
+            .map(|(bucket, count)| (upper_bound(bucket), count.load(Ordering::Relaxed)))
+            .filter(|(_, count)| *count > 0)
+    }
+
+    /// Forget all recorded values.
+    pub fn reset(&self) {
+        for bucket in &self.buckets {
+            bucket.store(0, Ordering::Relaxed);
+        }
+        self.count.store(0, Ordering::Relaxed);
+        self.sum.store(0, Ordering::Relaxed);
+    }
+}
+
+fn upper_bound(bucket: usize) -> u64 {
+    match bucket {
+        0 => 0,
+        64 => u64::MAX,
+        bucket => (1 << bucket) - 1,
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_histogram() {
+        let histogram = Histogram::new();
+        assert_eq!(histogram.percentile(0.5), 0);
+
+        for value in [0, 1, 2, 3, 100, 1000] {
+            histogram.record(value);
+        }
+        histogram.record(u64::MAX);
+
+        assert_eq!(histogram.count(), 7);
+        assert_eq!(
+            histogram.buckets().collect::<Vec<_>>(),
+            vec![(0, 1), (1, 1), (3, 2), (127, 1), (1023, 1), (u64::MAX, 1)]
+        );
+        assert_eq!(histogram.percentile(0.0), 0);
+        assert_eq!(histogram.percentile(0.5), 3);
+        assert_eq!(histogram.percentile(0.8), 1023);
+        assert_eq!(histogram.percentile(1.0), u64::MAX);
+
+        histogram.reset();
+        assert_eq!(histogram.count(), 0);
+        assert_eq!(histogram.mean(), 0.0);
+    }
+}
@@ -4,6 +4,10 @@
 //!
 //! * Experiments (A/B testing)
 
+pub mod histogram;
+#[cfg(feature = "rack")]
+pub mod rack;
 pub mod requests;
 
+pub use histogram::Histogram;
 pub use requests::Request;
@@ -0,0 +1,94 @@
+//! Where Rack requests spend their time in Ruby.
+//!
+//! Recorded by [`crate::controller::RackController`] for every request, so a slow
+//! request can be pinned on the app, the garbage collector, or the bindings.
+//!
+//! ### Example
+//!
+//! ```rust
+//! use rwf::analytics::rack::RACK;
+//!
+//! println!("p99 app time: {}us", RACK.call.percentile(0.99));
+//! ```
+use std::sync::atomic::AtomicU64;
+
+use rwf_ruby::RackTimings;
+
+use super::Histogram;
+
+/// Rack request histograms.
+#[derive(Debug, Default)]
+pub struct RackMetrics {
+    /// Building the env hash, in microseconds.
+    pub env: Histogram,
+    /// Inside `app.call`, in microseconds.
+    pub call: Histogram,
+    /// Reading the response out of Ruby, in microseconds.
+    pub response: Histogram,
+    /// Objects allocated per request.
+    pub allocated_objects: Histogram,
+    /// Minor and major GCs per request.
+    pub gc_count: Histogram,
+    /// Time spent in GC per request, in microseconds.
+    pub gc_time: Histogram,
+    /// Methods compiled by YJIT per request, sampled at most once a second.
+    pub yjit_compiled_iseqs: Histogram,
+    /// Requests answered from the response cache.
+    pub cache_hits: AtomicU64,
+    /// Requests answered with a stale cached response while it was refreshed.
+    pub cache_stale: AtomicU64,
+    /// Cacheable requests sent to the app.
+    pub cache_misses: AtomicU64,
+    /// Requests that waited for another request to fetch the same response.
+    pub cache_collapsed: AtomicU64,
+    /// Cached responses dropped to stay under the size limit.
+    pub cache_evictions: AtomicU64,
+    /// Requests waiting for a Ruby thread or a worker right now.
+    pub queue_depth: AtomicU64,
+    /// Time requests waited for a Ruby thread or a worker, in microseconds.
+    pub queue_wait: Histogram,
+    /// Requests answered with `503` because too many were waiting already.
+    pub queue_rejected: AtomicU64,
+    /// Requests dropped without running because the client went away while they waited.
+    pub queue_abandoned: AtomicU64,
+}
+
+/// Metrics for all Rack requests served by this process.
+pub static RACK: RackMetrics = RackMetrics::new();
+
+impl RackMetrics {
+    const fn new() -> Self {
+        Self {
+            env: Histogram::new(),
+            call: Histogram::new(),
+            response: Histogram::new(),
+            allocated_objects: Histogram::new(),
+            gc_count: Histogram::new(),
+            gc_time: Histogram::new(),
+            yjit_compiled_iseqs: Histogram::new(),
+            cache_hits: AtomicU64::new(0),
+            cache_stale: AtomicU64::new(0),
+            cache_misses: AtomicU64::new(0),
+            cache_collapsed: AtomicU64::new(0),
+            cache_evictions: AtomicU64::new(0),
+            queue_depth: AtomicU64::new(0),
+            queue_wait: Histogram::new(),
+            queue_rejected: AtomicU64::new(0),
+            queue_abandoned: AtomicU64::new(0),
+        }
+    }
+
+    /// Record the timings of one request.
+    pub fn record(&self, timings: &RackTimings) {
+        self.env.record(timings.env_ns / 1000);
+        self.call.record(timings.call_ns / 1000);
+        self.response.record(timings.response_ns / 1000);
+        self.allocated_objects
+            .record(timings.allocated_objects as u64);
+        self.gc_count
+            .record((timings.minor_gc_count + timings.major_gc_count) as u64);
+        self.gc_time.record(timings.gc_time_us as u64);
+        self.yjit_compiled_iseqs
+            .record(timings.yjit_compiled_iseqs as u64);
+    }
+}
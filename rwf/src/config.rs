@@ -233,6 +233,9 @@ pub struct General {
     /// Maximum size allowed for an HTTP request.
     #[serde(default = "General::default_max_request_size")]
     pub max_request_size: usize,
+    /// Request bodies larger than this are written to a temporary file instead of held in memory.
+    #[serde(default = "General::default_spill_request_size")]
+    pub spill_request_size: usize,
     /// Global authentication handler. Used by default
     /// in all controllers.
     #[serde(skip)]
@@ -261,6 +264,7 @@ impl Default for General {
             tty: General::default_tty(),
             header_max_size: General::default_header_max_size(),
             max_request_size: General::default_max_request_size(),
+            spill_request_size: General::default_spill_request_size(),
             default_auth: AuthHandler::default(),
             default_middleware: MiddlewareSet::without_default(vec![]),
         }
@@ -383,6 +387,10 @@ impl General {
     fn default_max_request_size() -> usize {
         5 * 1024 * 1024 // 5M
     }
+
+    fn default_spill_request_size() -> usize {
+        1024 * 1024 // 1M
+    }
 }
 
 /// WebSocket connections configuration.
@@ -0,0 +1,500 @@
+//! ActionCable over Rwf's WebSockets.
+//!
+//! Connections stay in Rust: the handshake, framing and pings never touch Ruby.
+//! What clients send (subscribe, unsubscribe, perform) goes to ActionCable as connection
+//! events, see [`rwf_ruby::cable`], and runs there with the app's own connections and channels.
+//!
+//! Broadcasts to streams set up with `stream_from` are fanned out here: Ruby hands the payload
+//! over once and each connection streaming from the broadcasting gets its message from Rust.
+//!
+//! ### Example
+//!
+//! ```rust,ignore
+//! let rails = RackController::new("path/to/app").action_cable().boot();
+//!
+//! Server::new(vec![
+//!     rails.cable().route("/cable"),
+//!     rails.wildcard("/"),
+//! ]);
+//! ```
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+use async_trait::async_trait;
+use bytes::Bytes;
+use once_cell::sync::Lazy;
+use parking_lot::Mutex;
+use tokio::select;
+use tokio::sync::mpsc;
+use tokio::time::{interval_at, Instant};
+use tracing::{debug, info, warn};
+
+use super::rack::RackController;
+use super::{Controller, Error, WebsocketController};
+use crate::colors::MaybeColorize;
+use crate::http::websocket::{DataFrame, Message};
+use crate::http::{Request, Response, Stream};
+
+use rwf_ruby::cable::Event;
+use rwf_ruby::{Env, RackApp};
+
+/// Subprotocol spoken by the ActionCable JavaScript client.
+const PROTOCOL: &str = "actioncable-v1-json";
+
+/// How often clients are pinged, same as ActionCable. The client reconnects
+/// when it doesn't hear from the server for twice as long.
+const PING_INTERVAL: Duration = Duration::from_secs(3);
+
+/// Messages buffered for one connection. A client this far behind is disconnected;
+/// it reconnects and subscribes again.
+const BUFFER: usize = 1024;
+
+/// Commands from one client waiting for Ruby. Past that, we stop reading from the client.
+const COMMANDS: usize = 16;
+
+static NEXT_ID: AtomicU64 = AtomicU64::new(1);
+static CONNECTIONS: Lazy<Registry> = Lazy::new(Registry::default);
+
+/// Open connections and the broadcastings they stream from.
+#[derive(Default)]
+struct Registry {
+    inner: Mutex<Connections>,
+}
+
+#[derive(Default)]
+struct Connections {
+    senders: HashMap<u64, mpsc::Sender<Arc<Message>>>,
+    /// Connections streaming from each broadcasting, with the identifier of the subscription.
+    streams: HashMap<String, Vec<(u64, String)>>,
+    /// Broadcastings of each connection, to clean up when it goes away.
+    by_connection: HashMap<u64, Vec<String>>,
+}
+
+impl Registry {
+    /// Add a connection and get the messages for it.
+    fn connect(&self, id: u64) -> mpsc::Receiver<Arc<Message>> {
+        let (tx, rx) = mpsc::channel(BUFFER);
+        self.inner.lock().senders.insert(id, tx);
+        rx
+    }
+
+    /// Forget the connection and everything it streams from.
+    fn disconnect(&self, id: u64) {
+        let mut inner = self.inner.lock();
+        inner.senders.remove(&id);
+
+        for stream in inner.by_connection.remove(&id).unwrap_or_default() {
+            inner.unstream(&stream, |(connection, _)| *connection == id);
+        }
+    }
+
+    /// Send the rest of the buffered messages, then close the connection.
+    fn close(&self, id: u64) {
+        self.inner.lock().senders.remove(&id);
+    }
+
+    fn transmit(&self, id: u64, message: Message) {
+        let mut inner = self.inner.lock();
+        let behind = match inner.senders.get(&id) {
+            Some(tx) => tx.try_send(Arc::new(message)).is_err(),
+            None => false,
+        };
+
+        if behind {
+            inner.behind(id);
+        }
+    }
+
+    fn stream(&self, id: u64, identifier: &str, stream: &str) {
+        let mut inner = self.inner.lock();
+
+        // Closed while Ruby was subscribing it.
+        if !inner.senders.contains_key(&id) {
+            return;
+        }
+
+        inner
+            .streams
+            .entry(stream.to_string())
+            .or_default()
+            .push((id, identifier.to_string()));
+        inner
+            .by_connection
+            .entry(id)
+            .or_default()
+            .push(stream.to_string());
+    }
+
+    fn stop_stream(&self, id: u64, identifier: &str, stream: &str) {
+        let mut inner = self.inner.lock();
+        inner.unstream(stream, |(connection, subscription)| {
+            *connection == id && subscription == identifier
+        });
+
+        if let Some(streams) = inner.by_connection.get_mut(&id) {
+            if let Some(position) = streams.iter().position(|s| s == stream) {
+                streams.swap_remove(position);
+            }
+        }
+    }
+
+    /// Send the payload to every connection streaming from the broadcasting.
+    /// The message is built once per subscription identifier, not once per connection.
+    fn broadcast(&self, stream: &str, payload: &str) {
+        let mut guard = self.inner.lock();
+        let inner = &mut *guard;
+
+        let subscribers = match inner.streams.get(stream) {
+            Some(subscribers) => subscribers,
+            None => return,
+        };
+
+        let mut messages: HashMap<&str, Arc<Message>> = HashMap::new();
+        let mut behind = vec![];
+
+        for (id, identifier) in subscribers {
+            let message = messages
+                .entry(identifier)
+                .or_insert_with(|| Arc::new(stream_message(identifier, payload)))
+                .clone();
+
+            if let Some(tx) = inner.senders.get(id) {
+                if tx.try_send(message).is_err() {
+                    behind.push(*id);
+                }
+            }
+        }
+
+        for id in behind {
+            inner.behind(id);
+        }
+    }
+}
+
+impl Connections {
+    fn unstream(&mut self, stream: &str, matches: impl Fn(&(u64, String)) -> bool) {
+        let empty = match self.streams.get_mut(stream) {
+            Some(subscribers) => {
+                subscribers.retain(|subscriber| !matches(subscriber));
+                subscribers.is_empty()
+            }
+            None => false,
+        };
+
+        if empty {
+            self.streams.remove(stream);
+        }
+    }
+
+    /// The client isn't reading its messages fast enough, or is gone already.
+    fn behind(&mut self, id: u64) {
+        if self.senders.remove(&id).is_some() {
+            debug!("{} connection {} is too far behind", "cable".purple(), id);
+        }
+    }
+}
+
+/// Message for a subscription, with the broadcast payload as it was encoded by Ruby.
+fn stream_message(identifier: &str, payload: &str) -> Message {
+    let identifier = serde_json::to_string(identifier).unwrap_or_default();
+    Message::Text(format!(
+        r#"{{"identifier":{},"message":{}}}"#,
+        identifier, payload
+    ))
+}
+
+/// Events from ActionCable. Runs in Ruby, with the GVL held, so it only queues messages.
+fn event(event: Event<'_>) {
+    let text = |bytes: &[u8]| String::from_utf8_lossy(bytes).into_owned();
+
+    match event {
+        Event::Transmit {
+            connection,
+            message,
+        } => CONNECTIONS.transmit(connection, Message::Text(text(message))),
+
+        Event::Stream {
+            connection,
+            identifier,
+            stream,
+        } => CONNECTIONS.stream(connection, &text(identifier), &text(stream)),
+
+        Event::StopStream {
+            connection,
+            identifier,
+            stream,
+        } => CONNECTIONS.stop_stream(connection, &text(identifier), &text(stream)),
+
+        Event::Broadcast { stream, payload } => CONNECTIONS.broadcast(
+            &String::from_utf8_lossy(stream),
+            &String::from_utf8_lossy(payload),
+        ),
+
+        Event::Close { connection } => CONNECTIONS.close(connection),
+    }
+}
+
+/// Load the ActionCable bridge into the VM. Called once the app is loaded.
+pub(super) fn install() -> Result<RackApp, rwf_ruby::Error> {
+    rwf_ruby::cable::install(event)
+}
+
+/// A command sent by the ActionCable client, e.g. `{"command":"subscribe","identifier":"..."}`.
+fn is_command(text: &str) -> bool {
+    match serde_json::from_str::<serde_json::Value>(text) {
+        Ok(value) => value.get("command").map(|c| c.is_string()).unwrap_or(false),
+        Err(_) => false,
+    }
+}
+
+/// Serves ActionCable clients from the app's channels, with the connections held by Rwf.
+/// Get one with [`RackController::cable`].
+pub struct CableController {
+    rack: Arc<RackController>,
+}
+
+impl CableController {
+    pub(super) fn new(rack: RackController) -> Self {
+        Self {
+            rack: Arc::new(rack),
+        }
+    }
+
+    /// Env for a connection event.
+    fn event_env(kind: &str, id: u64) -> Env {
+        let mut env = Env::with_capacity(3, 64);
+        env.insert("REQUEST_METHOD", "POST");
+        env.insert("rwf.cable", kind);
+        env.insert("rwf.cable.connection", id.to_string());
+        env
+    }
+
+    /// Tell Ruby about the connection opening, each of its commands in the order they came in,
+    /// and, once the client is gone, the connection closing.
+    async fn events(
+        rack: Arc<RackController>,
+        id: u64,
+        mut open: Env,
+        mut commands: mpsc::Receiver<String>,
+    ) {
+        open.insert("rwf.cable", "open");
+        open.insert("rwf.cable.connection", id.to_string());
+
+        let opened = match rack.send(open, Bytes::new()).await {
+            Ok(response) => response.code() < 300,
+            Err(_) => false,
+        };
+
+        if !opened {
+            CONNECTIONS.close(id);
+            return;
+        }
+
+        while let Some(command) = commands.recv().await {
+            Self::event(&rack, "message", id, Bytes::from(command)).await;
+        }
+
+        Self::event(&rack, "close", id, Bytes::new()).await;
+    }
+
+    /// Send a connection event to Ruby. Events aren't shed when the Rack queue is full,
+    /// so a failure means the app couldn't handle it; it's logged and the connection goes on.
+    async fn event(rack: &RackController, kind: &str, id: u64, body: Bytes) {
+        let code = match rack.send(Self::event_env(kind, id), body).await {
+            Ok(response) => response.code(),
+            Err(response) => response.status().code(),
+        };
+
+        if code >= 300 {
+            warn!(
+                "{} connection {} {} event failed with {}",
+                "cable".purple(),
+                id,
+                kind,
+                code
+            );
+        }
+    }
+}
+
+#[async_trait]
+impl Controller for CableController {
+    /// Origins are checked by ActionCable.
+    fn skip_csrf(&self) -> bool {
+        true
+    }
+
+    async fn handle(&self, request: &Request) -> Result<Response, Error> {
+        let response = WebsocketController::handle(self, request).await?;
+
+        let offered = request
+            .headers()
+            .get("sec-websocket-protocol")
+            .map(|protocols| protocols.split(',').any(|p| p.trim() == PROTOCOL))
+            .unwrap_or(false);
+
+        if offered && response.status().code() == 101 {
+            Ok(response.header("sec-websocket-protocol", PROTOCOL))
+        } else {
+            Ok(response)
+        }
+    }
+
+    async fn handle_stream(
+        &self,
+        request: &Request,
+        mut stream: Stream<'_>,
+    ) -> Result<bool, Error> {
+        let id = NEXT_ID.fetch_add(1, Ordering::Relaxed);
+        let mut messages = CONNECTIONS.connect(id);
+        let (commands, commands_rx) = mpsc::channel(COMMANDS);
+
+        info!(
+            "{} {} connection {} opened",
+            "cable".purple(),
+            request.path().path().purple(),
+            id
+        );
+
+        tokio::spawn(Self::events(
+            self.rack.clone(),
+            id,
+            RackController::env(request),
+            commands_rx,
+        ));
+
+        let mut ping = interval_at(Instant::now() + PING_INTERVAL, PING_INTERVAL);
+
+        let result: Result<(), Error> = async {
+            loop {
+                select! {
+                    _ = ping.tick() => {
+                        let now = SystemTime::now()
+                            .duration_since(UNIX_EPOCH)
+                            .unwrap_or_default()
+                            .as_secs();
+                        Message::Text(format!(r#"{{"type":"ping","message":{}}}"#, now))
+                            .send(&mut stream)
+                            .await?;
+                    }
+
+                    message = messages.recv() => {
+                        match message {
+                            Some(message) => message.send(&mut stream).await?,
+                            // Closed by ActionCable, or the client is too far behind.
+                            None => break,
+                        }
+                    }
+
+                    frame = DataFrame::read(&mut stream) => {
+                        let frame = frame?;
+
+                        if frame.is_ping() {
+                            DataFrame::new_pong(frame).flush(&mut stream).await?;
+                            continue;
+                        } else if frame.is_pong() {
+                            continue;
+                        }
+
+                        let command = match frame.message() {
+                            Message::Text(text) if is_command(&text) => text,
+                            _ => {
+                                debug!("{} connection {} sent an invalid command", "cable".purple(), id);
+                                continue;
+                            }
+                        };
+
+                        // Ruby refused the connection.
+                        if commands.send(command).await.is_err() {
+                            break;
+                        }
+                    }
+                }
+            }
+
+            Ok(())
+        }
+        .await;
+
+        // Closing the commands tells Ruby, once it's done with the ones already sent.
+        CONNECTIONS.disconnect(id);
+        drop(commands);
+
+        info!("{} connection {} closed", "cable".purple(), id);
+
+        result.map(|_| false)
+    }
+}
+
+#[async_trait]
+impl WebsocketController for CableController {}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn text(message: Arc<Message>) -> String {
+        match &*message {
+            Message::Text(text) => text.clone(),
+            _ => panic!("not text"),
+        }
+    }
+
+    #[test]
+    fn test_broadcast() {
+        let registry = Registry::default();
+        let mut first = registry.connect(1);
+        let mut second = registry.connect(2);
+        let _third = registry.connect(3);
+
+        registry.stream(1, r#"{"channel":"ChatChannel"}"#, "room_1");
+        registry.stream(2, r#"{"channel":"ChatChannel"}"#, "room_1");
+        registry.stream(3, r#"{"channel":"ChatChannel"}"#, "room_2");
+        // Gone already.
+        registry.stream(4, r#"{"channel":"ChatChannel"}"#, "room_1");
+
+        registry.broadcast("room_1", r#"{"body":"hi"}"#);
+
+        let expected = r#"{"identifier":"{\"channel\":\"ChatChannel\"}","message":{"body":"hi"}}"#;
+        let message = first.try_recv().unwrap();
+        assert_eq!(text(message.clone()), expected);
+        // Built once for both.
+        assert!(Arc::ptr_eq(&message, &second.try_recv().unwrap()));
+
+        registry.stop_stream(2, r#"{"channel":"ChatChannel"}"#, "room_1");
+        registry.disconnect(1);
+        registry.broadcast("room_1", "{}");
+        assert!(second.try_recv().is_err());
+
+        let inner = registry.inner.lock();
+        assert!(inner.streams.get("room_1").is_none());
+        assert_eq!(inner.streams["room_2"].len(), 1);
+    }
+
+    #[test]
+    fn test_too_far_behind() {
+        let registry = Registry::default();
+        let mut messages = registry.connect(1);
+
+        for _ in 0..BUFFER + 1 {
+            registry.transmit(1, Message::Text("{}".into()));
+        }
+
+        // What's buffered is still delivered, then the connection ends.
+        let mut received = 0;
+        while messages.try_recv().is_ok() {
+            received += 1;
+        }
+        assert_eq!(received, BUFFER);
+        assert!(!registry.inner.lock().senders.contains_key(&1));
+    }
+
+    #[test]
+    fn test_is_command() {
+        assert!(is_command(r#"{"command":"subscribe","identifier":"{}"}"#));
+        assert!(!is_command(r#"{"type":"ping"}"#));
+        assert!(!is_command("not json"));
+    }
+}
@@ -40,10 +40,20 @@ pub mod wsgi;
 #[cfg(feature = "wsgi")]
 pub use wsgi::WsgiController;
 
+#[cfg(feature = "rack")]
+pub mod cable;
 pub mod openapi;
 #[cfg(feature = "rack")]
 pub mod rack;
+#[cfg(feature = "rack")]
+pub mod rack_cache;
+#[cfg(feature = "rack")]
+pub mod rack_compress;
+#[cfg(feature = "rack")]
+pub mod rack_queue;
 
+#[cfg(feature = "rack")]
+pub use cable::CableController;
 #[cfg(feature = "rack")]
 pub use rack::RackController;
 
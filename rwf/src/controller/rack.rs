@@ -1,39 +1,664 @@
 //! Handle Rack/Rails integration.
-use std::collections::HashMap;
-use std::path::PathBuf;
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
 
+use super::cable::{self, CableController};
+use super::rack_cache::{Entry, Fill, Lookup, RackCache};
+use super::rack_compress::{self, Compression};
+use super::rack_queue::{Admission, Ticket};
+use super::static_files::StaticIndex;
 use super::{Controller, Error};
-use crate::http::{Request, Response};
+use crate::analytics::rack::RACK;
+use crate::http::range::{self, ByteRange};
+use crate::http::server::ClientSocket;
+use crate::http::{file_cache, Body, EarlyHints, Request, Response};
 
 use async_trait::async_trait;
+use bytes::Bytes;
+use once_cell::sync::OnceCell;
 use rayon::{ThreadPool, ThreadPoolBuilder};
-use tokio::sync::oneshot::channel;
-use tracing::{info, warn};
+use tokio::select;
+use tokio::sync::mpsc::UnboundedSender;
+use tokio::sync::{mpsc, oneshot, oneshot::channel, watch, Mutex};
+use tokio::task::spawn_blocking;
+use tracing::{error, info, warn};
 
-use tokio::fs::{metadata, File};
+use rwf_ruby::prefork::Worker;
+use rwf_ruby::{without_gvl, Env, GcPolicy, Job, RackApp, RackRequest, RackResponseOwned, Ruby};
+use std::sync::mpsc::{channel as job_channel, Sender};
 
-use rwf_ruby::{RackRequest, RackResponseOwned, Ruby};
-use std::sync::Arc;
+/// Number of chunks buffered between Ruby and the client when streaming a body.
+/// When the client is slower than the app, Ruby waits instead of
+/// holding the whole body in memory.
+pub(super) const STREAM_BUFFER: usize = 16;
+
+/// Number of requests Rails runs at the same time by default, same as Puma.
+const MAX_THREADS: usize = 5;
 
 pub struct RackController {
-    pool: ThreadPool,
-    path: PathBuf,
-    loaded: Arc<AtomicBool>,
+    pool: Arc<ThreadPool>,
+    root: PathBuf,
+    /// Which of the loaded apps this controller serves: 0 is the main app, then the mounted ones.
+    app: usize,
+    apps: Arc<OnceCell<Vec<RackApp>>>,
+    max_threads: usize,
+    jobs: Arc<OnceCell<Sender<Job>>>,
+    workers: usize,
+    worker_max_memory: Option<usize>,
+    compact: bool,
+    gc: Option<GcPolicy>,
+    timeout: Option<Duration>,
+    boot: Arc<Boot>,
+    ready: Arc<OnceCell<()>>,
+    prefork: Arc<OnceCell<Arc<Prefork>>>,
+    public: Option<PathBuf>,
+    static_index: OnceCell<StaticIndex>,
+    cache: Option<Arc<RackCache>>,
+    compression: Option<Compression>,
+    queue: Arc<Admission>,
+}
+
+/// How the app is loaded.
+struct Boot {
+    app: Source,
+    mounts: Vec<(String, Source)>,
+    options: Vec<String>,
+    warmup: Vec<String>,
+}
+
+/// Where a Rack app comes from.
+enum Source {
+    /// `config/environment.rb`, then `Rails.application`.
+    Rails(PathBuf),
+    /// A rackup file, e.g. `config.ru`.
+    Rackup(PathBuf),
+    /// Ruby code evaluating to the app, run once the main app is loaded.
+    Eval(String),
+    /// The ActionCable bridge, see [`RackController::action_cable`].
+    Cable,
+    /// Ruby code building the app in each Ractor, see [`RackController::mount_ractors`].
+    Ractors(usize, String),
+}
+
+impl Boot {
+    fn new(app: Source) -> Self {
+        Self {
+            app,
+            mounts: vec![],
+            options: vec![],
+            warmup: vec![],
+        }
+    }
+
+    /// The main app, then the mounted ones, in the order they're loaded.
+    fn apps(&self) -> impl Iterator<Item = (&str, &Source)> + '_ {
+        std::iter::once(("main", &self.app))
+            .chain(self.mounts.iter().map(|(name, app)| (name.as_str(), app)))
+    }
+    /// Ractors serving the mounted apps.
+    fn ractors(&self) -> usize {
+        self.apps()
+            .map(|(_, app)| match app {
+                Source::Ractors(count, _) => *count,
+                _ => 0,
+            })
+            .sum()
+    }
+}
+
+/// Rack response and, for streamed bodies, its chunks.
+type Rack = (RackResponseOwned, Option<mpsc::Receiver<Vec<u8>>>);
+
+/// Where the Ruby side sends the response.
+type Reply = oneshot::Sender<Rack>;
+
+/// Forked workers, each serving one request at a time.
+struct Prefork {
+    idle: Mutex<mpsc::Receiver<Worker>>,
+    idle_tx: mpsc::Sender<Worker>,
+    respawn: Sender<()>,
+    /// Workers running, `None` until the first ones are started.
+    alive: Arc<watch::Sender<Option<usize>>>,
 }
 
+/// Wait before trying to start a worker again after this long, doubling up to the max.
+const SPAWN_BACKOFF: Duration = Duration::from_millis(100);
+const SPAWN_BACKOFF_MAX: Duration = Duration::from_secs(5);
+
 impl RackController {
+    /// Serve the Rails app in this directory, loaded from `config/environment.rb`.
     pub fn new(path: &str) -> Self {
+        let root = PathBuf::from(path);
+        let app = Source::Rails(root.join("config/environment.rb"));
+
+        Self::with_app(root, app)
+    }
+
+    /// Serve the Rack app in a rackup file, e.g. `config.ru`, loaded with `Rack::Builder.parse_file`
+    /// like `rackup` and Puma do. Works with any Rack app: Rails, Sinatra, Roda, etc.
+    pub fn rackup(path: &str) -> Self {
+        let path = PathBuf::from(path);
+        let root = path
+            .parent()
+            .map(|root| root.to_owned())
+            .unwrap_or_default();
+
+        Self::with_app(root, Source::Rackup(path))
+    }
+
+    fn with_app(root: PathBuf, app: Source) -> Self {
         Self {
             // There can only be _one_ Rust thread.
-            // The only way to multi-thread safely
-            // would be to do it in Ruby using GVL-protected threads.
             // Even if we have a Mutex in Rust, loading the app in one thread and running it in
-            // another will segfault.
-            pool: Self::runtime(1),
-            path: PathBuf::from(path).join("config/environment.rb"),
-            loaded: Arc::new(AtomicBool::new(false)),
+            // another will segfault. Requests run concurrently in Ruby threads instead,
+            // see [`RackApp::serve`].
+            pool: Arc::new(Self::runtime(1)),
+            public: Some(root.join("public")),
+            root,
+            app: 0,
+            apps: Arc::new(OnceCell::new()),
+            static_index: OnceCell::new(),
+            max_threads: MAX_THREADS,
+            jobs: Arc::new(OnceCell::new()),
+            workers: 0,
+            worker_max_memory: None,
+            compact: false,
+            gc: None,
+            timeout: None,
+            boot: Arc::new(Boot::new(app)),
+            ready: Arc::new(OnceCell::new()),
+            prefork: Arc::new(OnceCell::new()),
+            cache: None,
+            compression: None,
+            queue: Arc::new(Admission::default()),
+        }
+    }
+
+    /// Load another Rack app into the same VM, next to the main one, from a Ruby expression,
+    /// e.g. `HealthCheck` for a Sinatra app defined by the main app. Serve it with [`RackController::app`].
+    ///
+    /// It's called directly, without going through the main app's middleware, e.g. Rails',
+    /// which makes it a good fit for health checks, webhooks and hot JSON endpoints.
+    pub fn mount(mut self, name: &str, app: &str) -> Self {
+        self.boot_mut()
+            .mounts
+            .push((name.to_string(), Source::Eval(app.to_string())));
+        self
+    }
+
+    /// Load another Rack app into the same VM from a rackup file, e.g. `health.ru`.
+    /// Serve it with [`RackController::app`].
+    pub fn mount_rackup(mut self, name: &str, path: &str) -> Self {
+        self.boot_mut()
+            .mounts
+            .push((name.to_string(), Source::Rackup(PathBuf::from(path))));
+        self
+    }
+
+    /// Load another Rack app into the same VM, running in `count` Ractors, so its requests use
+    /// more than one core without forking. Serve it with [`RackController::app`].
+    ///
+    /// Each Ractor evaluates `app`, e.g. `HelloApp.new`, to build an app of its own, and serves
+    /// one request at a time. Only apps written for Ractors work: they can't use unshareable
+    /// state, e.g. constants holding mutable objects or global variables, and their code is
+    /// loaded by the main app first. Bodies are copied whole to and from the Ractors, so
+    /// responses aren't streamed, and early hints aren't sent. Ruby calls Ractors experimental.
+    ///
+    /// Requests wait for a Ractor in Ruby threads, so `count` is added to
+    /// [`RackController::max_threads`].
+    ///
+    /// # Panics
+    ///
+    /// When the app runs in forked workers; Ractors don't survive the fork.
+    pub fn mount_ractors(mut self, name: &str, count: usize, app: &str) -> Self {
+        self.boot_mut().mounts.push((
+            name.to_string(),
+            Source::Ractors(count.max(1), app.to_string()),
+        ));
+        self
+    }
+
+    /// Serve the app's ActionCable channels over Rwf's WebSockets, with [`RackController::cable`].
+    ///
+    /// Connections, pings and broadcasts to `stream_from` streams are handled in Rust;
+    /// Ruby only runs the connection's `connect` and the channels' actions.
+    pub fn action_cable(mut self) -> Self {
+        self.boot_mut()
+            .mounts
+            .push(("action_cable".to_string(), Source::Cable));
+        self
+    }
+
+    /// Controller for the ActionCable endpoint, usually `/cable`.
+    ///
+    /// # Panics
+    ///
+    /// If [`RackController::action_cable`] wasn't called, or the app runs in forked workers:
+    /// a connection's channels must stay in the process that opened it.
+    pub fn cable(&self) -> CableController {
+        if self.workers > 0 {
+            panic!("ActionCable needs the app to run in threads, not workers");
+        }
+
+        CableController::new(self.app("action_cable"))
+    }
+
+    /// Controller serving an app added with [`RackController::mount`], to put on a route of its own.
+    ///
+    /// It shares the VM, the threads or workers, the cache and the timeout with this controller.
+    /// Files in `public/` are only served by the main app. Mount all apps before calling this.
+    ///
+    /// # Panics
+    ///
+    /// If no app was mounted with this name.
+    pub fn app(&self, name: &str) -> Self {
+        let app = self
+            .boot
+            .apps()
+            .position(|(mounted, _)| mounted == name)
+            .filter(|&app| app > 0)
+            .unwrap_or_else(|| panic!("no Rack app mounted as \"{}\"", name));
+
+        Self {
+            pool: self.pool.clone(),
+            root: self.root.clone(),
+            app,
+            apps: self.apps.clone(),
+            max_threads: self.max_threads,
+            jobs: self.jobs.clone(),
+            workers: self.workers,
+            worker_max_memory: self.worker_max_memory,
+            compact: self.compact,
+            gc: self.gc.clone(),
+            timeout: self.timeout,
+            boot: self.boot.clone(),
+            ready: self.ready.clone(),
+            prefork: self.prefork.clone(),
+            public: None,
+            static_index: OnceCell::new(),
+            cache: self.cache.clone(),
+            compression: self.compression.clone(),
+            queue: self.queue.clone(),
+        }
+    }
+
+    /// Fork the app into this many worker processes, so Ruby can use more than one core.
+    ///
+    /// The app is loaded once before forking, so workers share its memory with the parent.
+    /// Each worker handles one request at a time; `max_threads` doesn't apply.
+    pub fn workers(mut self, workers: usize) -> Self {
+        self.workers = workers;
+        self
+    }
+
+    /// Replace a worker once its resident memory goes over this many bytes.
+    pub fn worker_max_memory(mut self, bytes: usize) -> Self {
+        self.worker_max_memory = Some(bytes);
+        self
+    }
+
+    /// Run `GC.compact` before forking workers. Objects packed together
+    /// stay shared with the parent for longer (copy-on-write).
+    pub fn compact_before_fork(mut self) -> Self {
+        self.compact = true;
+        self
+    }
+
+    /// Collect garbage between requests, after this many of them.
+    /// Collections run while no requests are running, so they don't add to response times.
+    pub fn gc_every(mut self, requests: usize) -> Self {
+        self.gc.get_or_insert_with(GcPolicy::default).requests = Some(requests.max(1));
+        self
+    }
+
+    /// Collect garbage between requests once the Ruby heap grew by this many bytes.
+    pub fn gc_on_heap_growth(mut self, bytes: usize) -> Self {
+        self.gc.get_or_insert_with(GcPolicy::default).heap_growth = Some(bytes);
+        self
+    }
+
+    /// Keep the GC off while requests are running and only collect between them.
+    /// Use with [`RackController::gc_every`] or [`RackController::gc_on_heap_growth`];
+    /// without either, garbage is collected once the heap grew by 64 MB.
+    pub fn defer_gc(mut self) -> Self {
+        self.gc.get_or_insert_with(GcPolicy::default).defer = true;
+        self
+    }
+
+    /// Stop requests that take longer than this in the app, and answer them with an error.
+    ///
+    /// In threads, `Rwf::RequestTimeout` is raised in the request, like `Thread#raise`;
+    /// it's an `Exception`, not a `StandardError`, so Rails reports it as a 500. Workers
+    /// are killed and replaced instead. Time spent waiting for a thread or a worker doesn't count.
+    pub fn timeout(mut self, timeout: Duration) -> Self {
+        self.timeout = Some(timeout);
+        self
+    }
+
+    /// Enable YJIT, Ruby's JIT compiler.
+    pub fn yjit(self) -> Self {
+        self.ruby_option("--yjit")
+    }
+
+    /// Pass a flag to the Ruby VM, like to the `ruby` command, e.g. `--yjit-exec-mem-size=64`.
+    pub fn ruby_option(mut self, option: &str) -> Self {
+        self.boot_mut().options.push(option.to_string());
+        self
+    }
+
+    /// Keep the app's Ruby files compiled in this directory, e.g. `tmp/cache/rwf`, so later
+    /// boots load them without parsing them again. Files that changed are compiled again.
+    /// Use it instead of Bootsnap's compile cache, not next to it.
+    pub fn iseq_cache(self, dir: &str) -> Self {
+        self.ruby_option(&rwf_ruby::iseq_cache::option(dir))
+    }
+
+    /// Send a `GET` request to this path after loading the app and before serving traffic,
+    /// so the JIT and the method caches are warm for the first real request.
+    /// Add the same path more than once to send it more than once.
+    pub fn warmup(mut self, path: &str) -> Self {
+        self.boot_mut().warmup.push(path.to_string());
+        self
+    }
+
+    /// Serve files in the app's `public/` directory, e.g. precompiled assets, straight from Rust.
+    /// It's on by default; requests for files that aren't there still go to the app.
+    pub fn serve_public(mut self, serve: bool) -> Self {
+        self.public = if serve {
+            Some(self.root.join("public"))
+        } else {
+            None
+        };
+        self
+    }
+
+    /// Cache responses the app marks as cacheable by shared caches, up to this many bytes.
+    ///
+    /// Responses with `Cache-Control: public, max-age=...` or `s-maxage=...` are served
+    /// from memory until they expire, without calling Ruby. Responses setting cookies,
+    /// and requests with an `Authorization` header, are never cached.
+    pub fn cache(mut self, bytes: usize) -> Self {
+        self.cache = Some(Arc::new(RackCache::new(bytes)));
+        self
+    }
+
+    /// Gzip text responses (HTML, CSS, JavaScript, JSON, etc.) for clients that accept it,
+    /// after they leave Ruby, so the Ruby thread doesn't spend its time compressing them like
+    /// it does with `Rack::Deflater`. Streamed bodies are compressed as they're sent.
+    ///
+    /// Bodies smaller than 1 KB, responses the app encoded already, and files sent from disk
+    /// are left alone.
+    pub fn compress(mut self) -> Self {
+        self.compression = Some(Compression::default());
+        self
+    }
+
+    /// Index the `public/` directory once. Files added to it later are served by the app.
+    fn static_index(&self) -> Option<&StaticIndex> {
+        let public = self.public.as_ref()?;
+
+        Some(
+            self.static_index
+                .get_or_init(|| Self::build_static_index(public)),
+        )
+    }
+
+    /// Same as [`RackController::static_index`], but if [`RackController::boot`] didn't
+    /// build the index, it's built on the blocking pool instead of the runtime's threads.
+    /// Requests that arrive while it's being built may build it too; the first one is kept.
+    async fn static_index_async(&self) -> Option<&StaticIndex> {
+        let public = self.public.as_ref()?;
+
+        if let Some(index) = self.static_index.get() {
+            return Some(index);
+        }
+
+        let path = public.clone();
+        let index = spawn_blocking(move || Self::build_static_index(&path))
+            .await
+            .unwrap_or_default();
+        let _ = self.static_index.set(index);
+
+        self.static_index.get()
+    }
+
+    fn build_static_index(public: &Path) -> StaticIndex {
+        match StaticIndex::build(public) {
+            Ok(index) => {
+                info!("Serving {} files from {}", index.len(), public.display());
+                index
+            }
+            Err(_) => StaticIndex::default(),
+        }
+    }
+
+    /// Load the app now and wait until it's ready, instead of on the first request.
+    ///
+    /// Call this before starting the server, so the first user doesn't wait for Rails to boot.
+    pub fn boot(self) -> Self {
+        self.static_index();
+
+        if self.workers > 0 {
+            self.prefork();
+        } else {
+            self.jobs();
+        }
+
+        self.ready.wait();
+        self
+    }
+
+    fn boot_mut(&mut self) -> &mut Boot {
+        Arc::get_mut(&mut self.boot).expect("app is already loading")
+    }
+
+    /// Load the apps and run the warmup requests. Returns `None` if any of them failed to load.
+    fn load(boot: &Boot) -> Option<Vec<RackApp>> {
+        info!("Loading the Rack application, this may take a while...");
+        let options = boot.options.iter().map(|o| o.as_str()).collect::<Vec<_>>();
+
+        let loaded = match boot.app {
+            Source::Rails(ref path) => Ruby::load_app_with_options(path, &options),
+            _ => Ruby::boot(&options),
+        };
+
+        if let Err(err) = loaded {
+            error!("Rack application failed to load: {}", err);
+            return None;
+        }
+
+        let mut apps = vec![];
+
+        for (name, source) in boot.apps() {
+            let app = match source {
+                Source::Rails(_) => RackApp::bind("Rails.application"),
+                Source::Rackup(path) => RackApp::rackup(path),
+                Source::Eval(app) => RackApp::bind(app),
+                Source::Cable => cable::install(),
+                Source::Ractors(count, app) => rwf_ruby::ractor::pool(*count, app),
+            };
+
+            match app {
+                Ok(app) => apps.push(app),
+                Err(err) => {
+                    error!("Rack application \"{}\" failed to load: {}", name, err);
+                    return None;
+                }
+            }
+        }
+        info!("Rack application loaded");
+
+        let app = &apps[0];
+
+        if !boot.warmup.is_empty() {
+            let start = Instant::now();
+
+            for path in &boot.warmup {
+                match RackRequest::send(&app, warmup_env(path), b"") {
+                    Ok(response) => {
+                        let code = RackResponseOwned::from(&response).code();
+                        if code >= 500 {
+                            warn!("Warmup request to \"{}\" returned {}", path, code);
+                        }
+                    }
+                    Err(err) => warn!("Warmup request to \"{}\" failed: {}", path, err),
+                }
+            }
+
+            info!(
+                "Sent {} warmup requests in {:.3}s",
+                boot.warmup.len(),
+                start.elapsed().as_secs_f64()
+            );
+        }
+
+        Some(apps)
+    }
+
+    /// Answer with `503 Service Unavailable` and `Retry-After: 1` once this many requests are
+    /// waiting for a Ruby thread or a worker, instead of queueing them until clients time out.
+    /// Load balancers then send the traffic elsewhere. Requests aren't limited by default.
+    ///
+    /// The limit is shared with the apps served with [`RackController::app`]; set it first.
+    pub fn max_queue(mut self, requests: usize) -> Self {
+        self.queue = Arc::new(Admission::new(Some(requests)));
+        self
+    }
+
+    /// Maximum number of requests the app handles at the same time, each in its own Ruby thread.
+    /// While one request waits on the database, the others keep going.
+    pub fn max_threads(mut self, threads: usize) -> Self {
+        self.max_threads = threads.max(1);
+        self
+    }
+
+    /// Load the app and start serving requests from the Ruby thread.
+    fn jobs(&self) -> &Sender<Job> {
+        self.jobs.get_or_init(|| {
+            let (tx, rx) = job_channel();
+            let apps = self.apps.clone();
+            let max_threads = self.max_threads + self.boot.ractors();
+            let timeout = self.timeout;
+            let gc = self.gc.clone();
+            let boot = self.boot.clone();
+            let ready = self.ready.clone();
+
+            self.pool.spawn(move || {
+                let loaded = Self::load(&boot);
+
+                // Requests fail with 500 if the app didn't load.
+                if let Some(mut loaded) = loaded {
+                    // The main app gets it from serve.
+                    for app in loaded.iter_mut().skip(1) {
+                        app.set_multithread(max_threads > 1);
+                    }
+
+                    let apps = apps.get_or_init(|| loaded);
+                    let _ = ready.set(());
+
+                    info!("Rack application ready");
+                    apps[0].serve(max_threads, timeout, gc, rx).unwrap();
+                } else {
+                    let _ = ready.set(());
+                }
+            });
+
+            tx
+        })
+    }
+
+    /// Load the app, fork the workers and replace the ones that retire.
+    fn prefork(&self) -> &Arc<Prefork> {
+        if self.boot.ractors() > 0 {
+            panic!("Ractors can't be used with workers");
         }
+
+        self.prefork.get_or_init(|| {
+            let (idle_tx, idle) = mpsc::channel(self.workers);
+            let (respawn, respawn_rx) = job_channel();
+            let alive = Arc::new(watch::channel(None).0);
+            let workers = self.workers;
+            let max_memory = self.worker_max_memory;
+            let compact = self.compact;
+            let timeout = self.timeout;
+            let gc = self.gc.clone();
+            let boot = self.boot.clone();
+            let ready = self.ready.clone();
+            let spawned = idle_tx.clone();
+            let running = alive.clone();
+            let retry = respawn.clone();
+
+            // Stays on this thread for good; that's where the VM lives.
+            self.pool.spawn(move || {
+                // Warmup runs before forking, so workers start with the caches warm.
+                let apps = match Self::load(&boot) {
+                    Some(apps) => apps,
+                    None => {
+                        // Requests fail with 500, there are no workers.
+                        running.send_replace(Some(0));
+                        let _ = ready.set(());
+                        return;
+                    }
+                };
+
+                if compact {
+                    if let Err(err) = Ruby::gc_compact() {
+                        warn!("GC.compact failed: {}", err);
+                    }
+                }
+
+                let spawn = || match Worker::spawn(&apps, max_memory, gc.clone()) {
+                    Ok(mut worker) => {
+                        worker.set_timeout(timeout);
+                        running.send_modify(|alive| *alive = Some(alive.unwrap_or(0) + 1));
+                        Some(spawned.blocking_send(worker).is_ok())
+                    }
+                    Err(err) => {
+                        warn!("Rack worker failed to start: {}", err);
+                        None
+                    }
+                };
+
+                // Workers that didn't start are tried again below.
+                for _ in 0..workers {
+                    match spawn() {
+                        Some(true) => (),
+                        Some(false) => return,
+                        None => {
+                            let _ = retry.send(());
+                        }
+                    }
+                }
+
+                running.send_modify(|alive| *alive = Some(alive.unwrap_or(0)));
+                info!("Rack application ready with {} workers", workers);
+                let _ = ready.set(());
+
+                for _ in respawn_rx.iter() {
+                    let mut backoff = SPAWN_BACKOFF;
+
+                    loop {
+                        match spawn() {
+                            Some(true) => break,
+                            Some(false) => return,
+                            None if spawned.is_closed() => return,
+                            None => {
+                                std::thread::sleep(backoff);
+                                backoff = (backoff * 2).min(SPAWN_BACKOFF_MAX);
+                            }
+                        }
+                    }
+                }
+            });
+
+            Arc::new(Prefork {
+                idle: Mutex::new(idle),
+                idle_tx,
+                respawn,
+                alive,
+            })
+        })
     }
 
     fn runtime(threads: usize) -> ThreadPool {
@@ -47,94 +672,662 @@ impl RackController {
     }
 }
 
-#[async_trait]
-impl Controller for RackController {
-    // Let Rails handle CSRF.
-    fn skip_csrf(&self) -> bool {
+impl Prefork {
+    /// Run the request on the next idle worker. Returns `false` if there are no workers left,
+    /// e.g. the app didn't load or workers keep failing to start.
+    async fn send(&self, app: usize, env: Env, body: Bytes, tx: Reply, ticket: Ticket) -> bool {
+        let mut alive = self.alive.subscribe();
+
+        let worker = {
+            let mut idle = self.idle.lock().await;
+
+            select! {
+                worker = idle.recv() => worker,
+                _ = alive.wait_for(|alive| *alive == Some(0)) => None,
+            }
+        };
+
+        let mut worker = match worker {
+            Some(worker) => worker,
+            None => return false,
+        };
+
+        let idle = self.idle_tx.clone();
+        let running = self.alive.clone();
+        let respawn = self.respawn.clone();
+        let replace = move || {
+            running.send_modify(|alive| *alive = alive.map(|alive| alive.saturating_sub(1)));
+            let _ = respawn.send(());
+        };
+
+        spawn_blocking(move || {
+            // The client went away while we waited for a worker.
+            if !ticket.start(tx.is_closed()) {
+                let _ = idle.blocking_send(worker);
+                return;
+            }
+
+            let response = match worker.send(app, &env, &body) {
+                Ok(response) => response,
+                Err(err) => {
+                    warn!("Rack worker {} failed: {}", worker.pid(), err);
+                    replace();
+                    return;
+                }
+            };
+
+            if response.is_stream() {
+                let (chunks_tx, chunks_rx) = mpsc::channel(STREAM_BUFFER);
+                let _ = tx.send((response, Some(chunks_rx)));
+
+                loop {
+                    match worker.chunk() {
+                        // Keep reading if the client went away, the worker sends the whole body anyway.
+                        Ok(Some(chunk)) => {
+                            let _ = chunks_tx.blocking_send(chunk);
+                        }
+                        Ok(None) => break,
+                        Err(err) => {
+                            warn!("Rack worker {} failed: {}", worker.pid(), err);
+                            replace();
+                            return;
+                        }
+                    }
+                }
+            } else {
+                let _ = tx.send((response, None));
+            }
+
+            if worker.retiring() {
+                info!(
+                    "Rack worker {} is over its memory limit, replacing it",
+                    worker.pid()
+                );
+                replace();
+            } else {
+                let _ = idle.blocking_send(worker);
+            }
+        });
+
         true
     }
+}
 
-    async fn handle(&self, request: &Request) -> Result<Response, Error> {
+/// Where requests go: Ruby threads in this process, or forked workers.
+///
+/// Owns everything it needs, so a request can also run in the background,
+/// e.g. to refresh a stale cached response.
+#[derive(Clone)]
+enum Backend {
+    Threads {
+        jobs: Sender<Job>,
+        apps: Arc<OnceCell<Vec<RackApp>>>,
+        app: usize,
+        /// `rack.early_hints` goes to the client, as a `103 Early Hints` response.
+        hints: Option<UnboundedSender<EarlyHints>>,
+        queue: Arc<Admission>,
+        /// Skip the request if the client is gone by the time it's picked up.
+        client: Option<Arc<ClientSocket>>,
+        /// Answer with a `503` if the queue is full.
+        shed: bool,
+    },
+    Workers {
+        prefork: Arc<Prefork>,
+        app: usize,
+        queue: Arc<Admission>,
+        client: Option<Arc<ClientSocket>>,
+        shed: bool,
+    },
+}
+
+/// Join the request queue; only requests that can be shed are turned away when it's full.
+fn admit(
+    queue: &Arc<Admission>,
+    client: Option<Arc<ClientSocket>>,
+    shed: bool,
+) -> Result<Ticket, Response> {
+    if shed {
+        queue.enter(client)
+    } else {
+        Ok(queue.join(client))
+    }
+}
+
+impl Backend {
+    /// Run the request through the app. On failure, returns the error response to send.
+    async fn call(self, env: Env, body: Bytes) -> Result<Rack, Response> {
         let (tx, rx) = channel();
-        let path = PathBuf::from(&self.path);
-        let loaded = self.loaded.clone();
 
-        let req_path = request.path().path().to_string();
-        let method = request.method().to_string();
+        match self {
+            Backend::Workers {
+                prefork,
+                app,
+                queue,
+                client,
+                shed,
+            } => {
+                let ticket = admit(&queue, client, shed)?;
+
+                if !prefork.send(app, env, body, tx, ticket).await {
+                    return Err(Response::internal_error(std::io::Error::other(
+                        "Rack workers are not running",
+                    )));
+                }
+            }
+
+            Backend::Threads {
+                jobs,
+                apps,
+                app,
+                hints,
+                queue,
+                client,
+                shed,
+            } => {
+                let ticket = admit(&queue, client, shed)?;
+
+                // Runs in its own Ruby thread, once the apps are loaded.
+                let job: Job = Box::new(move |_| {
+                    // The client went away while the request was queued.
+                    if !ticket.start(tx.is_closed()) {
+                        return;
+                    }
+
+                    let app = &apps.get().expect("Rack apps are loaded")[app];
+
+                    let response = match hints {
+                        Some(hints) => {
+                            RackRequest::send_with_early_hints(app, env, &body, |headers| {
+                                let _ = hints.send(headers);
+                            })
+                        }
+                        None => RackRequest::send(app, env, &body),
+                    };
+
+                    // Dropping `tx` answers with a 500; the app keeps running.
+                    let response = match response {
+                        Ok(response) => response,
+                        Err(err) => return log_error(&err),
+                    };
+                    let owned = RackResponseOwned::from(&response);
+
+                    if owned.is_stream() {
+                        // Send the head right away and forward each chunk as Ruby produces it.
+                        let (chunks_tx, chunks_rx) = mpsc::channel(STREAM_BUFFER);
+                        let _ = tx.send((owned, Some(chunks_rx)));
+
+                        // Stops when the client goes away and the receiver is dropped.
+                        // Other requests keep running while we wait for a slow client.
+                        let _ = response.each(|chunk| {
+                            let chunk = chunk.to_vec();
+                            without_gvl(|| chunks_tx.blocking_send(chunk).is_ok())
+                        });
+                    } else {
+                        let _ = tx.send((owned, None));
+                    }
+                });
+
+                if jobs.send(job).is_err() {
+                    warn!("Rack application is not running");
+                    return Err(Response::internal_error(std::io::Error::other(
+                        "Rack application is not running",
+                    )));
+                }
+            }
+        }
+
+        match rx.await {
+            Ok(response) => {
+                RACK.record(response.0.timings());
+                Ok(response)
+            }
+            Err(_) => Err(Response::internal_error(std::io::Error::other(
+                "Rack request failed",
+            ))),
+        }
+    }
+}
+
+impl RackController {
+    /// Backend for requests of our own. If `shed`, they're answered with a `503` when the queue is full.
+    fn backend(&self, shed: bool) -> Backend {
+        if self.workers > 0 {
+            Backend::Workers {
+                prefork: self.prefork().clone(),
+                app: self.app,
+                queue: self.queue.clone(),
+                client: None,
+                shed,
+            }
+        } else {
+            Backend::Threads {
+                jobs: self.jobs().clone(),
+                apps: self.apps.clone(),
+                app: self.app,
+                hints: None,
+                queue: self.queue.clone(),
+                client: None,
+                shed,
+            }
+        }
+    }
+
+    /// Backend for the client's request, which can send it early hints while the app runs
+    /// and is skipped if the client goes away first. Forked workers don't pass hints on.
+    fn backend_for(&self, request: &Request) -> Backend {
+        match self.backend(true) {
+            Backend::Threads {
+                jobs,
+                apps,
+                app,
+                queue,
+                ..
+            } => Backend::Threads {
+                jobs,
+                apps,
+                app,
+                hints: request.early_hints(),
+                queue,
+                client: request.client(),
+                shed: true,
+            },
+            Backend::Workers {
+                prefork,
+                app,
+                queue,
+                ..
+            } => Backend::Workers {
+                prefork,
+                app,
+                queue,
+                client: request.client(),
+                shed: true,
+            },
+        }
+    }
+
+    /// Run a request through the app, without the cache, and read the whole response.
+    /// It waits for Ruby even if the queue is full; it's never shed.
+    pub(super) async fn send(&self, env: Env, body: Bytes) -> Result<RackResponseOwned, Response> {
+        self.backend(false)
+            .call(env, body)
+            .await
+            .map(|(response, _)| response)
+    }
+
+    /// Rack env for the request.
+    pub(super) fn env(request: &Request) -> Env {
+        let path = request.path().path();
         let query = request.query().to_string();
-        let req_uri = format!("{}{}", req_path, query);
-        let body = request.body().to_vec();
-        let content_type = request
-            .headers()
-            .get("content-type")
-            .unwrap_or(&String::from("application/x-www-form-urlencoded"))
-            .to_string();
-        let content_length = request
+        let headers = request.headers();
+
+        // Sized for everything below, so the buffer is allocated once.
+        let bytes = 256
+            + path.len() * 3
+            + query.len() * 2
+            + headers
+                .iter()
+                .map(|(key, value)| key.len() + value.len() + "HTTP_".len())
+                .sum::<usize>();
+        let mut env = Env::with_capacity(headers.len() + 8, bytes);
+
+        env.insert("REQUEST_URI", format!("{}{}", path, query));
+        env.insert("PATH_INFO", path);
+        env.insert("REQUEST_PATH", path);
+        env.insert("REQUEST_METHOD", request.method().to_string());
+        env.insert("QUERY_STRING", query.replace("?", ""));
+        env.insert("rack.url_scheme", Self::url_scheme(request));
+        env.insert(
+            "CONTENT_TYPE",
+            headers
+                .get("content-type")
+                .map(|value| value.as_str())
+                .unwrap_or("application/x-www-form-urlencoded"),
+        );
+        match headers.get("content-length") {
+            Some(length) => env.insert("CONTENT_LENGTH", length),
+            None => env.insert("CONTENT_LENGTH", request.body().len().to_string()),
+        }
+
+        for (key, value) in headers.iter() {
+            env.header(key, value);
+        }
+
+        env
+    }
+
+    /// `https` if the client connected over TLS, or the proxy in front of us says it did.
+    fn url_scheme(request: &Request) -> &'static str {
+        let forwarded = request
             .headers()
-            .get("content-length")
-            .unwrap_or(&String::from(body.len().to_string().as_str()))
-            .to_string();
-
-        let mut env = HashMap::from([
-            ("REQUEST_URI".into(), req_uri),
-            ("PATH_INFO".into(), req_path.clone()),
-            ("REQUEST_PATH".into(), req_path),
-            ("SERVER_PROTOCOL".into(), "HTTP/1.1".into()),
-            ("REQUEST_METHOD".into(), method),
-            ("QUERY_STRING".into(), query.replace("?", "")),
-            ("CONTENT_TYPE".into(), content_type),
-            ("CONTENT_LENGTH".into(), content_length),
-        ]);
-
-        for (key, value) in request.headers().iter() {
-            env.insert(
-                format!("HTTP_{}", crate::snake_case(key).to_ascii_uppercase()),
-                value.to_string(),
-            );
+            .get("x-forwarded-proto")
+            .and_then(|proto| proto.split(',').next())
+            .map(|proto| proto.trim());
+
+        match forwarded {
+            Some(proto) if proto.eq_ignore_ascii_case("https") => "https",
+            Some(proto) if proto.eq_ignore_ascii_case("http") => "http",
+            _ if request.tls() => "https",
+            _ => "http",
         }
+    }
 
-        self.pool.spawn(move || {
-            // We only have one thread in Rust, so there is no race.
-            // Besides, if you try this from multiple threads, you'll segfault.
-            if !loaded.load(Ordering::Relaxed) {
-                info!("Loading the Rack application, this may take a while...");
-                Ruby::load_app(&path).unwrap();
-                loaded.store(true, Ordering::Relaxed);
-                info!("Rack application loaded");
-            }
+    /// Answer a cacheable request from the cache, or call the app and cache its response.
+    async fn handle_cached(
+        &self,
+        cache: &Arc<RackCache>,
+        key: String,
+        request: &Request,
+        env: Env,
+        body: Bytes,
+    ) -> Result<Response, Error> {
+        let mut waited = false;
 
-            let response = RackRequest::send(env, &body).unwrap();
-            let owned = RackResponseOwned::from(response);
+        loop {
+            match cache.lookup(&key, request) {
+                Lookup::Fresh(entry) => return Ok(cached(&entry)),
 
-            let _ = tx.send(owned);
-        });
+                Lookup::Stale(entry) => {
+                    if entry.start_revalidating() {
+                        let (cache, backend) = (cache.clone(), self.backend(true));
+                        let headers = request.headers().clone();
+
+                        tokio::spawn(async move {
+                            if let Ok((mut response, _)) = backend.call(env, body).await {
+                                cache.store(&key, &headers, &mut response);
+                            }
+                        });
+                    }
+
+                    return Ok(cached(&entry));
+                }
+
+                // The request we waited for didn't leave anything cacheable.
+                Lookup::Miss if waited => break,
+
+                Lookup::Miss => match cache.fill(&key) {
+                    Fill::Wait(mut done) => {
+                        let _ = done.changed().await;
+                        waited = true;
+                    }
+
+                    Fill::Fetch(filling) => {
+                        let (mut response, chunks) =
+                            match self.backend_for(request).call(env, body).await {
+                                Ok(response) => response,
+                                Err(response) => return Ok(response),
+                            };
+
+                        let entry = cache.store(&key, request.headers(), &mut response);
+                        drop(filling);
 
-        let response = rx.await.unwrap();
+                        return match entry {
+                            Some(entry) => Ok(cached(&entry)),
+                            None => self.respond(request, response, chunks).await,
+                        };
+                    }
+                },
+            }
+        }
+
+        match self.backend_for(request).call(env, body).await {
+            Ok((response, chunks)) => self.respond(request, response, chunks).await,
+            Err(response) => Ok(response),
+        }
+    }
 
+    /// Turn the Rack response into the response sent to the client.
+    async fn respond(
+        &self,
+        request: &Request,
+        mut response: RackResponseOwned,
+        chunks: Option<mpsc::Receiver<Vec<u8>>>,
+    ) -> Result<Response, Error> {
         if response.is_file() {
             let path = PathBuf::from(String::from_utf8_lossy(response.body()).to_string());
 
-            let meta = if let Ok(meta) = metadata(&path).await {
-                meta
+            // Hot files, e.g. assets, reuse the descriptor opened by a previous request.
+            let (file, meta) = if let Ok(file) = file_cache::open(&path).await {
+                file
             } else {
                 return Ok(Response::not_found());
             };
+            let len = meta.len();
 
-            // Don't think the file will disappear here, but you really can't know.
-            let file = if let Ok(file) = File::open(&path).await {
-                file
+            // The app can answer the range itself, e.g. Rack::Files, but its body is still the whole file.
+            let range = if response.code() == 206 {
+                response
+                    .header("content-range")
+                    .map(|header| ByteRange::from_content_range(header, len))
+                    .unwrap_or(ByteRange::Full)
             } else {
-                return Ok(Response::not_found());
+                match request.headers().get("range") {
+                    Some(range) if response.code() == 200 && if_range(request, &response) => {
+                        ByteRange::parse(range, len)
+                    }
+                    _ => ByteRange::Full,
+                }
+            };
+
+            let res = match range {
+                ByteRange::Full => Response::new()
+                    .body(Body::shared_file(&path, file, meta, None))
+                    .code(response.code()),
+                ByteRange::Partial(ref bytes) => Response::new()
+                    .body(Body::shared_file(&path, file, meta, Some(bytes.clone())))
+                    .code(206),
+                ByteRange::Unsatisfiable => Response::new().body(Body::bytes(vec![])).code(416),
             };
 
-            Ok(Response::new().body((path, file, meta)))
+            let res = copy_headers(res, response.headers(), |key| {
+                key.eq_ignore_ascii_case("content-length")
+                    || key.eq_ignore_ascii_case("content-range")
+                    || key.eq_ignore_ascii_case("transfer-encoding")
+            })
+            .header("accept-ranges", "bytes");
+
+            Ok(match range.content_range(len) {
+                Some(content_range) => res.header("content-range", content_range),
+                None => res,
+            })
+        } else if let Some(chunks) = chunks {
+            let compression = self
+                .compression
+                .as_ref()
+                .filter(|compression| compression.negotiate(request, &response));
+            let chunks = match compression {
+                Some(compression) => compression.stream(chunks),
+                None => chunks,
+            };
+
+            let res = Response::new().body(Body::stream(chunks));
+            // The body is sent with chunked encoding.
+            let res = copy_headers(res, response.headers(), |key| {
+                key.eq_ignore_ascii_case("content-length")
+                    || key.eq_ignore_ascii_case("transfer-encoding")
+            });
+            let res = match compression {
+                Some(_) => rack_compress::headers(res, &response),
+                None => res,
+            };
+
+            Ok(res.code(response.code()))
         } else {
-            let mut res = Response::new().body(response.body());
-            for (key, value) in response.headers() {
-                res = res.header(key, value);
-            }
+            let compression = self
+                .compression
+                .as_ref()
+                .filter(|compression| compression.negotiate(request, &response));
+            let body = response.take_body();
+
+            // Compressed on another thread; if that fails, the body goes as it is.
+            let compressed = match compression {
+                Some(compression) => compression.body(body.clone()).await,
+                None => None,
+            };
+
+            let res = match compressed {
+                Some(compressed) => {
+                    let res = copy_headers(
+                        Response::new().body(compressed),
+                        response.headers(),
+                        |key| key.eq_ignore_ascii_case("content-length"),
+                    );
+                    rack_compress::headers(res, &response)
+                }
+                None => copy_headers(Response::new().body(body), response.headers(), |_| false),
+            };
 
             Ok(res.code(response.code()))
         }
     }
 }
+
+#[async_trait]
+impl Controller for RackController {
+    // Let Rails handle CSRF.
+    fn skip_csrf(&self) -> bool {
+        true
+    }
+
+    async fn handle(&self, request: &Request) -> Result<Response, Error> {
+        // Assets and other public files don't need Ruby.
+        if let Some(index) = self.static_index_async().await {
+            if let Some(response) = index.respond(request).await {
+                return Ok(response);
+            }
+        }
+
+        let env = Self::env(request);
+        // Shared with the Ruby thread, not copied.
+        let body = request.body_bytes();
+
+        if let Some(cache) = &self.cache {
+            if let Some(key) = RackCache::key(request) {
+                return self.handle_cached(cache, key, request, env, body).await;
+            }
+        }
+
+        match self.backend_for(request).call(env, body).await {
+            Ok((response, chunks)) => self.respond(request, response, chunks).await,
+            Err(response) => Ok(response),
+        }
+    }
+}
+
+/// The client's copy, if it has one, is still current, so sending only a range of it is fine.
+fn if_range(request: &Request, response: &RackResponseOwned) -> bool {
+    match request.headers().get("if-range") {
+        Some(header) => range::if_range(
+            header,
+            response.header("etag"),
+            response.header("last-modified"),
+        ),
+        None => true,
+    }
+}
+
+/// Log an exception raised by the app, with its backtrace.
+fn log_error(err: &rwf_ruby::Error) {
+    match err {
+        rwf_ruby::Error::Exception(exception) => error!(
+            "Rack application raised {}\n{}",
+            exception,
+            exception.backtrace.join("\n")
+        ),
+        err => error!("Rack request failed: {}", err),
+    }
+}
+
+/// Response for a cached entry.
+fn cached(entry: &Entry) -> Response {
+    let res = Response::new().body(entry.body.clone());
+
+    copy_headers(res, &entry.headers, |_| false)
+        .header("age", entry.age().to_string())
+        .code(entry.code)
+}
+
+/// Env for a warmup request, sent before the server accepts traffic.
+fn warmup_env(uri: &str) -> Env {
+    let (path, query) = uri.split_once('?').unwrap_or((uri, ""));
+    let mut env = Env::new();
+
+    env.insert("REQUEST_URI", uri);
+    env.insert("PATH_INFO", path);
+    env.insert("REQUEST_PATH", path);
+    env.insert("REQUEST_METHOD", "GET");
+    env.insert("QUERY_STRING", query);
+    env.insert("CONTENT_TYPE", "application/x-www-form-urlencoded");
+    env.insert("CONTENT_LENGTH", "0");
+    env.header("host", "localhost");
+
+    env
+}
+
+/// Copy headers returned by Rack into the response.
+///
+/// Rack headers replace the defaults set by [`Response::new`]. Values of the same
+/// header (e.g. multiple `Set-Cookie`) come back to back from the bindings and are all sent.
+fn copy_headers(
+    mut res: Response,
+    headers: &[(String, String)],
+    skip: impl Fn(&str) -> bool,
+) -> Response {
+    let mut previous: Option<&str> = None;
+
+    for (key, value) in headers {
+        if skip(key) {
+            continue;
+        }
+
+        if previous == Some(key.as_str()) {
+            res.headers_mut().append(key, value);
+        } else {
+            res = res.header(key, value);
+        }
+
+        previous = Some(key);
+    }
+
+    res
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::sync::atomic::Ordering;
+
+    #[tokio::test]
+    async fn test_client_gone() {
+        // Handed to the job like a Ruby thread would; there are no `apps`, so running the
+        // request would panic.
+        Ruby::boot(&[]).unwrap();
+        let app = RackApp::bind("proc { |env| [200, {}, []] }").unwrap();
+
+        let queue = Arc::new(Admission::default());
+        let (jobs, queued) = job_channel();
+        let backend = Backend::Threads {
+            jobs,
+            apps: Arc::new(OnceCell::new()),
+            app: 0,
+            hints: None,
+            queue: queue.clone(),
+            client: None,
+            shed: true,
+        };
+
+        // The server drops the request, and the reply receiver with it, when the client
+        // disconnects while it's queued.
+        let request = backend.call(Env::new(), Bytes::new());
+        assert!(tokio::time::timeout(Duration::from_millis(10), request)
+            .await
+            .is_err());
+        assert_eq!(queue.waiting(), 1);
+
+        let abandoned = RACK.queue_abandoned.load(Ordering::Relaxed);
+        let job = queued.recv().unwrap();
+        job(&app);
+        assert!(RACK.queue_abandoned.load(Ordering::Relaxed) > abandoned);
+        assert_eq!(queue.waiting(), 0);
+    }
+}
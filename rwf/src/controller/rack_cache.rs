@@ -0,0 +1,487 @@
+//! Shared cache for Rack responses, so cacheable pages don't need Ruby at all.
+//!
+//! Responses are cached if the app allows shared caches to keep them, i.e. with
+//! `Cache-Control: public, max-age=...` or `s-maxage=...`, and don't set cookies.
+//! Entries are keyed on the method, host and URI, and on the request headers
+//! named by the response's `Vary` header.
+//!
+//! Stale entries inside their `stale-while-revalidate` window are served
+//! while one request refreshes them in the background. Concurrent misses for
+//! the same key wait for the first one instead of all of them calling the app.
+use std::collections::{HashMap, VecDeque};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use bytes::Bytes;
+use parking_lot::Mutex;
+use tokio::sync::watch;
+
+use crate::analytics::rack::RACK;
+use crate::http::{Headers, Method, Request};
+use rwf_ruby::RackResponseOwned;
+
+/// Response codes cacheable by default (RFC 9110, section 15.1).
+const CACHEABLE_CODES: &[u16] = &[200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501];
+
+/// Cached response.
+#[derive(Debug)]
+pub(crate) struct Entry {
+    pub(crate) code: u16,
+    pub(crate) headers: Vec<(String, String)>,
+    pub(crate) body: Bytes,
+    /// Request headers named by `Vary`, and their values when the response was stored.
+    vary: Vec<(String, Option<String>)>,
+    stored_at: Instant,
+    max_age: Duration,
+    stale_while_revalidate: Duration,
+    size: usize,
+    revalidating: AtomicBool,
+}
+
+impl Entry {
+    /// Seconds since the response was stored, for the `Age` header.
+    pub(crate) fn age(&self) -> u64 {
+        self.stored_at.elapsed().as_secs()
+    }
+
+    /// Only one request refreshes a stale entry. Returns `true` for that one.
+    pub(crate) fn start_revalidating(&self) -> bool {
+        !self.revalidating.swap(true, Ordering::Relaxed)
+    }
+
+    fn matches(&self, headers: &Headers) -> bool {
+        self.vary
+            .iter()
+            .all(|(name, value)| headers.get(name) == value.as_ref())
+    }
+}
+
+/// Result of looking up a request.
+pub(crate) enum Lookup {
+    Fresh(Arc<Entry>),
+    Stale(Arc<Entry>),
+    Miss,
+}
+
+/// Either fetch the response, or wait for the request already fetching it.
+pub(crate) enum Fill<'a> {
+    Fetch(Filling<'a>),
+    /// Resolves when the other request is done, whether it stored a response or not.
+    Wait(watch::Receiver<()>),
+}
+
+/// Fetching the response for a key. Requests waiting for it wake up once this is dropped.
+pub(crate) struct Filling<'a> {
+    cache: &'a RackCache,
+    key: String,
+    _done: watch::Sender<()>,
+}
+
+impl Drop for Filling<'_> {
+    fn drop(&mut self) {
+        // Waiters wake up when the sender is dropped, right after this.
+        self.cache.filling.lock().remove(&self.key);
+    }
+}
+
+#[derive(Default)]
+struct Entries {
+    variants: HashMap<String, Vec<Arc<Entry>>>,
+    /// Keys in the order they were stored, oldest first, to evict them.
+    order: VecDeque<String>,
+    size: usize,
+}
+
+/// In-memory cache of Rack responses, bounded by size.
+pub struct RackCache {
+    max_size: usize,
+    entries: Mutex<Entries>,
+    filling: Mutex<HashMap<String, watch::Receiver<()>>>,
+}
+
+impl RackCache {
+    /// Create a cache holding at most `max_size` bytes of responses.
+    pub fn new(max_size: usize) -> Self {
+        Self {
+            max_size,
+            entries: Mutex::new(Entries::default()),
+            filling: Mutex::new(HashMap::new()),
+        }
+    }
+
+    /// Cache key of the request, or `None` if the request can't be answered from the cache.
+    pub(crate) fn key(request: &Request) -> Option<String> {
+        if request.method() != &Method::Get {
+            return None;
+        }
+
+        // Responses to authenticated requests are for that user only.
+        if request.header("authorization").is_some() {
+            return None;
+        }
+
+        if let Some(cache_control) = request.header("cache-control") {
+            let directives = directives(cache_control);
+            if directives.contains_key("no-store") || directives.contains_key("no-cache") {
+                return None;
+            }
+        }
+
+        Some(format!(
+            "{} {}{}",
+            request
+                .header("host")
+                .map(|host| host.as_str())
+                .unwrap_or(""),
+            request.path().path(),
+            request.query(),
+        ))
+    }
+
+    /// Find a cached response for the request.
+    pub(crate) fn lookup(&self, key: &str, request: &Request) -> Lookup {
+        let entries = self.entries.lock();
+        let entry = entries.variants.get(key).and_then(|variants| {
+            variants
+                .iter()
+                .find(|entry| entry.matches(request.headers()))
+        });
+
+        match entry {
+            Some(entry) => {
+                let age = entry.stored_at.elapsed();
+
+                if age < entry.max_age {
+                    RACK.cache_hits.fetch_add(1, Ordering::Relaxed);
+                    Lookup::Fresh(entry.clone())
+                } else if age < entry.max_age + entry.stale_while_revalidate {
+                    RACK.cache_stale.fetch_add(1, Ordering::Relaxed);
+                    Lookup::Stale(entry.clone())
+                } else {
+                    Lookup::Miss
+                }
+            }
+
+            None => Lookup::Miss,
+        }
+    }
+
+    /// Start fetching the response for the key, unless another request is fetching it already.
+    pub(crate) fn fill(&self, key: &str) -> Fill<'_> {
+        let mut filling = self.filling.lock();
+
+        match filling.get(key) {
+            Some(done) => {
+                RACK.cache_collapsed.fetch_add(1, Ordering::Relaxed);
+                Fill::Wait(done.clone())
+            }
+
+            None => {
+                RACK.cache_misses.fetch_add(1, Ordering::Relaxed);
+                let (tx, rx) = watch::channel(());
+                filling.insert(key.to_string(), rx);
+
+                Fill::Fetch(Filling {
+                    cache: self,
+                    key: key.to_string(),
+                    _done: tx,
+                })
+            }
+        }
+    }
+
+    /// Store the response, if it's cacheable. Returns the stored entry.
+    ///
+    /// The body is moved into the entry, so send the entry instead of the response.
+    pub(crate) fn store(
+        &self,
+        key: &str,
+        request_headers: &Headers,
+        response: &mut RackResponseOwned,
+    ) -> Option<Arc<Entry>> {
+        if response.is_file() || response.is_stream() {
+            return None;
+        }
+
+        let freshness = Freshness::of(response.code(), response.headers(), request_headers)?;
+
+        let size = key.len()
+            + response.body().len()
+            + response
+                .headers()
+                .iter()
+                .map(|(name, value)| name.len() + value.len())
+                .sum::<usize>();
+
+        // One response can't push everything else out.
+        if size > self.max_size / 8 {
+            return None;
+        }
+
+        let entry = Arc::new(Entry {
+            code: response.code(),
+            headers: response.headers().to_vec(),
+            body: response.take_body(),
+            vary: freshness.vary,
+            stored_at: Instant::now(),
+            max_age: freshness.max_age,
+            stale_while_revalidate: freshness.stale_while_revalidate,
+            size,
+            revalidating: AtomicBool::new(false),
+        });
+
+        let mut entries = self.entries.lock();
+        let entries = &mut *entries;
+        let mut freed = 0;
+
+        match entries.variants.get_mut(key) {
+            Some(variants) => {
+                // Replace the variant with the same Vary values.
+                variants.retain(|existing| {
+                    let same = existing.vary == entry.vary;
+                    if same {
+                        freed += existing.size;
+                    }
+                    !same
+                });
+                variants.push(entry.clone());
+            }
+
+            None => {
+                entries
+                    .variants
+                    .insert(key.to_string(), vec![entry.clone()]);
+                entries.order.push_back(key.to_string());
+            }
+        }
+
+        entries.size = entries.size - freed + size;
+
+        // Evict the oldest keys, with all their variants.
+        while entries.size > self.max_size {
+            let oldest = match entries.order.pop_front() {
+                Some(oldest) => oldest,
+                None => break,
+            };
+
+            if let Some(variants) = entries.variants.remove(&oldest) {
+                entries.size -= variants.iter().map(|entry| entry.size).sum::<usize>();
+                RACK.cache_evictions
+                    .fetch_add(variants.len() as u64, Ordering::Relaxed);
+            }
+        }
+
+        Some(entry)
+    }
+
+    /// Bytes of responses in the cache.
+    pub fn size(&self) -> usize {
+        self.entries.lock().size
+    }
+}
+
+/// How long a response can be served from the cache, and to which requests.
+#[derive(Debug, PartialEq)]
+struct Freshness {
+    max_age: Duration,
+    stale_while_revalidate: Duration,
+    vary: Vec<(String, Option<String>)>,
+}
+
+impl Freshness {
+    /// Check the response headers. Returns `None` if the response can't be stored in a shared cache.
+    fn of(code: u16, headers: &[(String, String)], request_headers: &Headers) -> Option<Self> {
+        if !CACHEABLE_CODES.contains(&code) {
+            return None;
+        }
+
+        let mut cache_control = HashMap::new();
+        let mut vary = vec![];
+
+        for (name, value) in headers {
+            if name.eq_ignore_ascii_case("set-cookie") {
+                return None;
+            } else if name.eq_ignore_ascii_case("cache-control") {
+                cache_control.extend(directives(value));
+            } else if name.eq_ignore_ascii_case("vary") {
+                for name in value.split(',') {
+                    let name = name.trim().to_ascii_lowercase();
+
+                    if name == "*" {
+                        return None;
+                    } else if !name.is_empty() {
+                        let value = request_headers.get(&name).cloned();
+                        vary.push((name, value));
+                    }
+                }
+            }
+        }
+
+        if !cache_control.contains_key("public") && !cache_control.contains_key("s-maxage") {
+            return None;
+        }
+
+        if ["private", "no-store", "no-cache"]
+            .iter()
+            .any(|directive| cache_control.contains_key(*directive))
+        {
+            return None;
+        }
+
+        let seconds = |directive: &str| {
+            cache_control
+                .get(directive)
+                .and_then(|value| value.as_ref())
+                .and_then(|value| value.parse::<u64>().ok())
+                .map(Duration::from_secs)
+        };
+
+        let max_age = seconds("s-maxage").or_else(|| seconds("max-age"))?;
+        if max_age.is_zero() {
+            return None;
+        }
+
+        Some(Self {
+            max_age,
+            stale_while_revalidate: seconds("stale-while-revalidate").unwrap_or_default(),
+            vary,
+        })
+    }
+}
+
+/// Parse `Cache-Control` directives, e.g. `public, max-age=60`.
+fn directives(header: &str) -> HashMap<String, Option<String>> {
+    header
+        .split(',')
+        .filter_map(|directive| {
+            let mut parts = directive.splitn(2, '=');
+            let name = parts.next()?.trim().to_ascii_lowercase();
+            let value = parts
+                .next()
+                .map(|value| value.trim().trim_matches('"').to_string());
+
+            if name.is_empty() {
+                None
+            } else {
+                Some((name, value))
+            }
+        })
+        .collect()
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn headers(headers: &[(&str, &str)]) -> Vec<(String, String)> {
+        headers
+            .iter()
+            .map(|(name, value)| (name.to_string(), value.to_string()))
+            .collect()
+    }
+
+    #[test]
+    fn test_freshness() {
+        let request = Headers::new();
+
+        let freshness = Freshness::of(
+            200,
+            &headers(&[(
+                "Cache-Control",
+                "public, max-age=60, stale-while-revalidate=30",
+            )]),
+            &request,
+        )
+        .unwrap();
+        assert_eq!(freshness.max_age, Duration::from_secs(60));
+        assert_eq!(freshness.stale_while_revalidate, Duration::from_secs(30));
+
+        let freshness = Freshness::of(
+            404,
+            &headers(&[("cache-control", "max-age=60, s-maxage=10")]),
+            &request,
+        )
+        .unwrap();
+        assert_eq!(freshness.max_age, Duration::from_secs(10));
+
+        for (code, response) in [
+            (200, vec![("cache-control", "max-age=60")]),
+            (200, vec![("cache-control", "public")]),
+            (200, vec![("cache-control", "public, max-age=0")]),
+            (200, vec![("cache-control", "public, max-age=60, private")]),
+            (200, vec![("cache-control", "public, max-age=60, no-store")]),
+            (
+                200,
+                vec![
+                    ("cache-control", "public, max-age=60"),
+                    ("set-cookie", "session=1"),
+                ],
+            ),
+            (
+                200,
+                vec![("cache-control", "public, max-age=60"), ("vary", "*")],
+            ),
+            (500, vec![("cache-control", "public, max-age=60")]),
+            (302, vec![("cache-control", "public, max-age=60")]),
+        ] {
+            assert!(
+                Freshness::of(code, &headers(&response), &request).is_none(),
+                "{:?}",
+                response
+            );
+        }
+    }
+
+    #[test]
+    fn test_vary() {
+        let mut request = Headers::new();
+        request.insert("accept-encoding", "gzip");
+
+        let freshness = Freshness::of(
+            200,
+            &headers(&[
+                ("cache-control", "public, max-age=60"),
+                ("vary", "Accept-Encoding, Accept-Language"),
+            ]),
+            &request,
+        )
+        .unwrap();
+
+        assert_eq!(
+            freshness.vary,
+            vec![
+                ("accept-encoding".to_string(), Some("gzip".to_string())),
+                ("accept-language".to_string(), None),
+            ]
+        );
+
+        let entry = Entry {
+            code: 200,
+            headers: vec![],
+            body: Bytes::new(),
+            vary: freshness.vary,
+            stored_at: Instant::now(),
+            max_age: freshness.max_age,
+            stale_while_revalidate: freshness.stale_while_revalidate,
+            size: 0,
+            revalidating: AtomicBool::new(false),
+        };
+
+        assert!(entry.matches(&request));
+        request.insert("accept-encoding", "br");
+        assert!(!entry.matches(&request));
+
+        assert!(entry.start_revalidating());
+        assert!(!entry.start_revalidating());
+    }
+
+    #[test]
+    fn test_directives() {
+        let directives = directives("Public, max-age=\"60\", , no-transform");
+        assert_eq!(directives.get("public"), Some(&None));
+        assert_eq!(directives.get("max-age"), Some(&Some("60".to_string())));
+        assert_eq!(directives.get("no-transform"), Some(&None));
+        assert_eq!(directives.len(), 3);
+    }
+}
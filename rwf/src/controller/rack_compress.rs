@@ -0,0 +1,259 @@
+//! Gzip for Rack responses, done by Rwf once the response has left Ruby.
+//!
+//! `Rack::Deflater` compresses in the Ruby thread, holding the GVL, so every other request
+//! waits for it. Here, bodies are compressed on tokio's blocking threads and streamed bodies
+//! chunk by chunk as they arrive, while Ruby moves on to the next request.
+//!
+//! Responses are compressed if the client accepts gzip, the body is text-like (HTML, CSS,
+//! JavaScript, JSON, XML, SVG) and at least [`Compression::min_size`] bytes, and the app
+//! didn't encode it already or ask for it to be left alone with `Cache-Control: no-transform`.
+use std::io::Write;
+
+use bytes::Bytes;
+use flate2::write::GzEncoder;
+use tokio::sync::mpsc::{channel, Receiver};
+use tokio::task::spawn_blocking;
+
+use super::static_files::accepted_encodings;
+use crate::http::{Method, Request, Response};
+use rwf_ruby::RackResponseOwned;
+
+/// Bodies smaller than this aren't worth it: the gzip header and the extra CPU cost more than
+/// the bytes saved.
+const MIN_SIZE: usize = 1024;
+
+/// Compression settings, see [`RackController::compress`](super::RackController::compress).
+#[derive(Debug, Clone)]
+pub(crate) struct Compression {
+    /// Smallest body compressed. Streamed bodies are always compressed, their size isn't known.
+    pub(crate) min_size: usize,
+    level: flate2::Compression,
+}
+
+impl Default for Compression {
+    fn default() -> Self {
+        Self {
+            min_size: MIN_SIZE,
+            // Same as nginx's default: most of the savings for a fraction of the CPU of level 6.
+            level: flate2::Compression::new(1),
+        }
+    }
+}
+
+impl Compression {
+    /// Should the response be compressed for this request?
+    pub(crate) fn negotiate(&self, request: &Request, response: &RackResponseOwned) -> bool {
+        if request.method() == &Method::Head || response.is_file() {
+            return false;
+        }
+
+        // No body, or the client asked for a part of it.
+        if matches!(response.code(), 204 | 206 | 304) || response.code() < 200 {
+            return false;
+        }
+
+        if !response.is_stream() && response.body().len() < self.min_size {
+            return false;
+        }
+
+        let header = |name: &str| {
+            response
+                .headers()
+                .iter()
+                .find(|(key, _)| key.eq_ignore_ascii_case(name))
+                .map(|(_, value)| value.to_ascii_lowercase())
+        };
+
+        if header("content-encoding").is_some()
+            || header("content-range").is_some()
+            || header("cache-control")
+                .map(|value| value.contains("no-transform"))
+                .unwrap_or(false)
+        {
+            return false;
+        }
+
+        if !header("content-type")
+            .map(|value| compressible(&value))
+            .unwrap_or(false)
+        {
+            return false;
+        }
+
+        request
+            .header("accept-encoding")
+            .map(|header| accepted_encodings(header).iter().any(|e| e == "gzip"))
+            .unwrap_or(false)
+    }
+
+    /// Compress the whole body off the async threads. Returns `None` if that failed,
+    /// and the body should be sent as it is.
+    pub(crate) async fn body(&self, body: Bytes) -> Option<Bytes> {
+        let level = self.level;
+
+        spawn_blocking(move || {
+            let mut encoder = GzEncoder::new(Vec::with_capacity(body.len() / 4), level);
+            encoder.write_all(&body)?;
+            encoder.finish()
+        })
+        .await
+        .ok()?
+        .ok()
+        .map(Bytes::from)
+    }
+
+    /// Compress a streamed body. Each chunk is flushed through the encoder as it comes in,
+    /// so the client gets it right away, e.g. server-sent events and Turbo streams.
+    pub(crate) fn stream(&self, mut chunks: Receiver<Vec<u8>>) -> Receiver<Vec<u8>> {
+        let (tx, rx) = channel(super::rack::STREAM_BUFFER);
+        let level = self.level;
+
+        tokio::spawn(async move {
+            let mut encoder = GzEncoder::new(vec![], level);
+
+            while let Some(chunk) = chunks.recv().await {
+                if encoder
+                    .write_all(&chunk)
+                    .and_then(|_| encoder.flush())
+                    .is_err()
+                {
+                    return;
+                }
+
+                let compressed = std::mem::take(encoder.get_mut());
+                if !compressed.is_empty() && tx.send(compressed).await.is_err() {
+                    // The client went away; dropping `chunks` tells Ruby to stop.
+                    return;
+                }
+            }
+
+            if let Ok(trailer) = encoder.finish() {
+                let _ = tx.send(trailer).await;
+            }
+        });
+
+        rx
+    }
+}
+
+/// Content types worth compressing. Images, video and archives are compressed already.
+fn compressible(content_type: &str) -> bool {
+    let mime = content_type.split(';').next().unwrap_or("").trim();
+
+    mime.starts_with("text/")
+        || mime.ends_with("+json")
+        || mime.ends_with("+xml")
+        || matches!(
+            mime,
+            "application/json"
+                | "application/javascript"
+                | "application/x-javascript"
+                | "application/xml"
+                | "application/wasm"
+                | "image/svg+xml"
+        )
+}
+
+/// Headers of a compressed response, on top of the ones copied from Rack.
+pub(crate) fn headers(res: Response, response: &RackResponseOwned) -> Response {
+    let header = |name: &str| {
+        response
+            .headers()
+            .iter()
+            .find(|(key, _)| key.eq_ignore_ascii_case(name))
+            .map(|(_, value)| value.as_str())
+    };
+
+    let res = res
+        .header("content-encoding", "gzip")
+        .header("vary", vary(header("vary")));
+
+    match header("etag") {
+        Some(etag) => res.header("etag", weak_etag(etag)),
+        None => res,
+    }
+}
+
+/// `Vary` with `Accept-Encoding` added, if it isn't there already.
+fn vary(existing: Option<&str>) -> String {
+    match existing {
+        Some(vary)
+            if vary.split(',').any(|name| {
+                name.trim().eq_ignore_ascii_case("accept-encoding") || name.trim() == "*"
+            }) =>
+        {
+            vary.to_string()
+        }
+        Some(vary) if !vary.trim().is_empty() => format!("{}, Accept-Encoding", vary),
+        _ => "Accept-Encoding".to_string(),
+    }
+}
+
+/// Strong validators describe the exact bytes, which changed; a weak one still matches.
+fn weak_etag(etag: &str) -> String {
+    if etag.starts_with("W/") {
+        etag.to_string()
+    } else {
+        format!("W/{}", etag)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use flate2::read::GzDecoder;
+    use std::io::Read;
+
+    fn gunzip(bytes: &[u8]) -> Vec<u8> {
+        let mut out = vec![];
+        GzDecoder::new(bytes).read_to_end(&mut out).unwrap();
+        out
+    }
+
+    #[test]
+    fn test_compressible() {
+        assert!(compressible("text/html; charset=utf-8"));
+        assert!(compressible("application/json"));
+        assert!(compressible("application/vnd.api+json"));
+        assert!(!compressible("image/png"));
+        assert!(!compressible("application/octet-stream"));
+    }
+
+    #[test]
+    fn test_headers() {
+        assert_eq!(vary(None), "Accept-Encoding");
+        assert_eq!(
+            vary(Some("Accept-Language")),
+            "Accept-Language, Accept-Encoding"
+        );
+        assert_eq!(vary(Some("accept-encoding")), "accept-encoding");
+        assert_eq!(weak_etag("\"abc\""), "W/\"abc\"");
+        assert_eq!(weak_etag("W/\"abc\""), "W/\"abc\"");
+    }
+
+    #[tokio::test]
+    async fn test_compress() {
+        let compression = Compression::default();
+        let body = "<p>hello</p>".repeat(1000);
+
+        let compressed = compression.body(Bytes::from(body.clone())).await.unwrap();
+        assert!(compressed.len() < body.len() / 10);
+        assert_eq!(gunzip(&compressed), body.as_bytes());
+
+        let (tx, rx) = channel(4);
+        let mut rx = compression.stream(rx);
+        tx.send(b"data: one\n\n".to_vec()).await.unwrap();
+
+        // Flushed before the next chunk comes.
+        let mut stream = rx.recv().await.unwrap();
+        assert!(!stream.is_empty());
+
+        tx.send(b"data: two\n\n".to_vec()).await.unwrap();
+        drop(tx);
+
+        while let Some(chunk) = rx.recv().await {
+            stream.extend(chunk);
+        }
+        assert_eq!(gunzip(&stream), b"data: one\n\ndata: two\n\n");
+    }
+}
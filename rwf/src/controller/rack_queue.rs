@@ -0,0 +1,157 @@
+//! Limit on Rack requests waiting for Ruby, so a traffic spike is shed instead of queued.
+//!
+//! Requests wait for a free Ruby thread or worker. Past [`Admission::limit`] of them,
+//! new requests are answered right away with `503 Service Unavailable` and `Retry-After`,
+//! which tells load balancers to send them elsewhere, instead of waiting until the client
+//! gives up. How many requests are waiting, and for how long, is in [`RACK`].
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Arc;
+use std::time::Instant;
+
+use crate::analytics::rack::RACK;
+use crate::http::server::ClientSocket;
+use crate::http::Response;
+
+/// Seconds clients are asked to wait before trying again.
+const RETRY_AFTER: u64 = 1;
+
+/// Requests waiting for Ruby, shared by all the controllers of one app.
+#[derive(Debug, Default)]
+pub(crate) struct Admission {
+    limit: Option<usize>,
+    waiting: AtomicUsize,
+}
+
+/// A request's place in the queue, until it starts running or is dropped.
+#[derive(Debug)]
+pub(crate) struct Ticket {
+    admission: Arc<Admission>,
+    queued_at: Instant,
+    client: Option<Arc<ClientSocket>>,
+}
+
+impl Admission {
+    /// Let at most `limit` requests wait at the same time.
+    pub(crate) fn new(limit: Option<usize>) -> Self {
+        Self {
+            limit,
+            waiting: AtomicUsize::new(0),
+        }
+    }
+
+    /// Join the queue, or get the `503` to answer with if it's full. With the client's socket,
+    /// the request is dropped if the client resets the connection while it waits.
+    pub(crate) fn enter(
+        self: &Arc<Self>,
+        client: Option<Arc<ClientSocket>>,
+    ) -> Result<Ticket, Response> {
+        let waiting = self.waiting.fetch_add(1, Ordering::Relaxed);
+
+        if self.limit.map(|limit| waiting >= limit).unwrap_or(false) {
+            self.waiting.fetch_sub(1, Ordering::Relaxed);
+            RACK.queue_rejected.fetch_add(1, Ordering::Relaxed);
+
+            return Err(Response::service_unavailable().header("retry-after", RETRY_AFTER));
+        }
+
+        Ok(self.ticket(client))
+    }
+
+    /// Join the queue even if it's full, for requests that can't be retried,
+    /// like ActionCable connection events.
+    pub(crate) fn join(self: &Arc<Self>, client: Option<Arc<ClientSocket>>) -> Ticket {
+        self.waiting.fetch_add(1, Ordering::Relaxed);
+        self.ticket(client)
+    }
+
+    /// The ticket of a request counted in `waiting`.
+    fn ticket(self: &Arc<Self>, client: Option<Arc<ClientSocket>>) -> Ticket {
+        RACK.queue_depth.fetch_add(1, Ordering::Relaxed);
+
+        Ticket {
+            admission: self.clone(),
+            queued_at: Instant::now(),
+            client,
+        }
+    }
+
+    /// Requests waiting right now.
+    #[cfg(test)]
+    pub(crate) fn waiting(&self) -> usize {
+        self.waiting.load(Ordering::Relaxed)
+    }
+}
+
+impl Ticket {
+    /// The request got a thread or a worker. Returns `false` if nobody is waiting for the
+    /// response anymore, because the reply was dropped or the client went away; don't run it then.
+    pub(crate) fn start(self, reply_closed: bool) -> bool {
+        RACK.queue_wait
+            .record(self.queued_at.elapsed().as_micros() as u64);
+
+        let client_gone = reply_closed
+            || self
+                .client
+                .as_ref()
+                .map(|client| client.gone())
+                .unwrap_or(false);
+
+        if client_gone {
+            RACK.queue_abandoned.fetch_add(1, Ordering::Relaxed);
+        }
+
+        !client_gone
+    }
+}
+
+impl Drop for Ticket {
+    fn drop(&mut self) {
+        self.admission.waiting.fetch_sub(1, Ordering::Relaxed);
+        RACK.queue_depth.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_admission() {
+        let admission = Arc::new(Admission::new(Some(2)));
+
+        let first = admission.enter(None).unwrap();
+        let second = admission.enter(None).unwrap();
+
+        let full = admission.enter(None).unwrap_err();
+        assert_eq!(full.status().code(), 503);
+        assert_eq!(
+            full.headers().get("retry-after").map(|v| v.as_str()),
+            Some("1")
+        );
+
+        // Started requests no longer wait.
+        assert!(first.start(false));
+        assert_eq!(admission.waiting(), 1);
+        assert!(admission.enter(None).is_ok());
+
+        assert!(!second.start(true));
+        assert_eq!(admission.waiting(), 0);
+
+        let unlimited = Arc::new(Admission::default());
+        let tickets = (0..100)
+            .map(|_| unlimited.enter(None).unwrap())
+            .collect::<Vec<_>>();
+        assert_eq!(unlimited.waiting(), 100);
+        drop(tickets);
+        assert_eq!(unlimited.waiting(), 0);
+
+        // Joining doesn't check the limit, but counts towards it.
+        let first = admission.join(None);
+        let second = admission.join(None);
+        let third = admission.join(None);
+        assert_eq!(admission.waiting(), 3);
+        assert!(admission.enter(None).is_err());
+        drop((first, second, third));
+        assert_eq!(admission.waiting(), 0);
+    }
+}
@@ -10,7 +10,7 @@
 use super::{Controller, Error};
 use crate::model::value::{ToValue, Value};
 use crate::{
-    http::{Body, Handler, Request, Response},
+    http::{body::mime_type_for, file_cache, urldecode, Body, Handler, Method, Request, Response},
     model::{get_connection, FromRow, Model},
     prelude::{utoipa, OpenApi, ToConnectionRequest},
 };
@@ -385,6 +385,238 @@ impl StaticFiles {
     }
 }
 
+/// Files of a static folder indexed in memory, e.g. a Rails app's `public/` directory.
+///
+/// Unlike [`StaticFiles`], this doesn't need a database: ETags are computed
+/// from the size and modification time of each file when the index is built.
+/// Precompressed siblings (`app.js.br`, `app.js.gz`) are sent to clients that accept them.
+#[derive(Debug, Default)]
+pub struct StaticIndex {
+    files: HashMap<String, IndexedFile>,
+}
+
+#[derive(Debug)]
+struct IndexedFile {
+    path: PathBuf,
+    len: u64,
+    mtime: i64,
+    etag: String,
+    last_modified: String,
+    mime_type: &'static str,
+    cache_control: String,
+    /// Precompressed siblings, best first, as their `Content-Encoding` and path.
+    encoded: Vec<(&'static str, PathBuf)>,
+}
+
+/// Fingerprinted assets, e.g. `/assets/application-2d3f0a.js`, never change.
+const IMMUTABLE_PREFIXES: &[&str] = &["/assets/", "/packs/", "/vite/"];
+
+/// Precompressed siblings, in order of preference.
+const ENCODINGS: &[(&str, &str)] = &[("br", "br"), ("gzip", "gz")];
+
+impl StaticIndex {
+    /// Index all files in the folder. Files added later aren't served until it's rebuilt.
+    pub fn build(root: impl AsRef<Path>) -> std::io::Result<Self> {
+        let mut index = Self::default();
+        let mut dirs = vec![root.as_ref().to_owned()];
+
+        while let Some(dir) = dirs.pop() {
+            for entry in std::fs::read_dir(&dir)? {
+                let entry = entry?;
+                let file_type = entry.file_type()?;
+
+                // Don't follow symlinked folders, they could loop.
+                if file_type.is_dir() {
+                    dirs.push(entry.path());
+                    continue;
+                }
+
+                let metadata = match std::fs::metadata(entry.path()) {
+                    Ok(metadata) if metadata.is_file() => metadata,
+                    _ => continue,
+                };
+
+                let relative = match entry.path().strip_prefix(root.as_ref()) {
+                    Ok(relative) => relative.to_owned(),
+                    Err(_) => continue,
+                };
+                let url = relative
+                    .components()
+                    .map(|component| component.as_os_str().to_string_lossy())
+                    .fold(String::new(), |url, component| url + "/" + &component);
+
+                let file = IndexedFile::new(&url, entry.path(), &metadata);
+                index.files.insert(url, file);
+            }
+        }
+
+        // Link precompressed siblings, listing the ones the folder actually has.
+        let urls = index.files.keys().cloned().collect::<Vec<_>>();
+        for url in urls {
+            let encoded = ENCODINGS
+                .iter()
+                .filter_map(|(encoding, extension)| {
+                    index
+                        .files
+                        .get(&format!("{}.{}", url, extension))
+                        .map(|file| (*encoding, file.path.clone()))
+                })
+                .collect::<Vec<_>>();
+
+            if let Some(file) = index.files.get_mut(&url) {
+                file.encoded = encoded;
+            }
+        }
+
+        Ok(index)
+    }
+
+    /// Number of indexed files.
+    pub fn len(&self) -> usize {
+        self.files.len()
+    }
+
+    /// The index has no files.
+    pub fn is_empty(&self) -> bool {
+        self.files.is_empty()
+    }
+
+    /// Respond to the request with a file from the index, if there is one for its path.
+    ///
+    /// Returns `None` if the file is not in the index or changed on disk since it was built,
+    /// so the request can go to whoever would handle it otherwise.
+    pub async fn respond(&self, request: &Request) -> Option<Response> {
+        if !matches!(request.method(), Method::Get | Method::Head) {
+            return None;
+        }
+
+        let path = urldecode(request.path().path());
+        let file = self.find(&path)?;
+
+        // The index only knows the file as it was when it was built.
+        let (_, metadata) = file_cache::open(&file.path).await.ok()?;
+        if metadata.len() != file.len || metadata.mtime() != file.mtime {
+            return None;
+        }
+
+        let mut response = Response::new()
+            .header("etag", &file.etag)
+            .header("last-modified", &file.last_modified)
+            .header("cache-control", &file.cache_control);
+        if !file.encoded.is_empty() {
+            response = response.header("vary", "accept-encoding");
+        }
+
+        if let Some(etags) = request.header("if-none-match") {
+            if etags
+                .split(',')
+                .any(|etag| etag.trim() == file.etag || etag.trim() == "*")
+            {
+                // Not modified has no body, so nothing to describe it either.
+                let mut response = response.code(304);
+                response.headers_mut().remove("content-type");
+                return Some(response);
+            }
+        }
+
+        let accepted = request
+            .header("accept-encoding")
+            .map(|header| accepted_encodings(header))
+            .unwrap_or_default();
+        let encoded = file
+            .encoded
+            .iter()
+            .find(|(encoding, _)| accepted.iter().any(|accepted| accepted == encoding));
+
+        let (path, encoding) = match encoded {
+            Some((encoding, path)) => (path, Some(*encoding)),
+            None => (&file.path, None),
+        };
+
+        let (handle, metadata) = file_cache::open(path).await.ok()?;
+        let mut response = response
+            .body(Body::shared_file(path, handle, metadata, None))
+            .header("content-type", file.mime_type);
+
+        if let Some(encoding) = encoding {
+            response = response.header("content-encoding", encoding);
+        }
+
+        Some(if request.method() == &Method::Head {
+            response.without_body()
+        } else {
+            response
+        })
+    }
+
+    /// Find the file like Rails does: the exact path, then with `.html`, then its `index.html`.
+    fn find(&self, path: &str) -> Option<&IndexedFile> {
+        let path = path.trim_end_matches('/');
+
+        self.files
+            .get(path)
+            .or_else(|| self.files.get(&format!("{}.html", path)))
+            .or_else(|| self.files.get(&format!("{}/index.html", path)))
+    }
+}
+
+impl IndexedFile {
+    fn new(url: &str, path: PathBuf, metadata: &std::fs::Metadata) -> Self {
+        let mtime = metadata.mtime();
+        let modified =
+            OffsetDateTime::from_unix_timestamp(mtime).unwrap_or(OffsetDateTime::UNIX_EPOCH);
+        let cache_control = if IMMUTABLE_PREFIXES
+            .iter()
+            .any(|prefix| url.starts_with(prefix))
+        {
+            format!(
+                "public, {}, immutable",
+                CacheControl::MaxAge(Duration::days(365))
+            )
+        } else {
+            CacheControl::NoCache.to_string()
+        };
+
+        Self {
+            etag: format!(r#""{:x}-{:x}""#, mtime, metadata.len()),
+            last_modified: modified
+                .format(StaticFileMeta::format())
+                .unwrap_or_default(),
+            mime_type: mime_type_for(&path),
+            len: metadata.len(),
+            mtime,
+            cache_control,
+            encoded: vec![],
+            path,
+        }
+    }
+}
+
+/// Content codings the client accepts, without the ones it refused with `q=0`.
+pub(crate) fn accepted_encodings(header: &str) -> Vec<String> {
+    header
+        .split(',')
+        .filter_map(|coding| {
+            let mut parts = coding.split(';');
+            let name = parts.next()?.trim().to_ascii_lowercase();
+            let refused = parts.any(|param| {
+                param
+                    .trim()
+                    .strip_prefix("q=")
+                    .and_then(|q| q.trim().parse::<f32>().ok())
+                    .map(|q| q == 0.0)
+                    .unwrap_or(false)
+            });
+
+            if refused || name.is_empty() {
+                None
+            } else {
+                Some(name)
+            }
+        })
+        .collect()
+}
+
 #[async_trait]
 impl Controller for StaticFiles {
     async fn handle(&self, request: &Request) -> Result<Response, Error> {
@@ -488,3 +720,110 @@ impl Controller for StaticFiles {
         }
     }
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    async fn request(path: &str, headers: &str) -> Request {
+        let req = format!("GET {} HTTP/1.1\r\n{}\r\n", path, headers);
+        Request::read("127.0.0.1:1234".parse().unwrap(), req.as_bytes())
+            .await
+            .unwrap()
+    }
+
+    #[tokio::test]
+    async fn test_static_index() {
+        let root = tempdir::TempDir::new("rwf_static_index").unwrap();
+        std::fs::create_dir(root.path().join("assets")).unwrap();
+        std::fs::write(root.path().join("assets/app-abc.js"), b"let a = 1;").unwrap();
+        std::fs::write(root.path().join("assets/app-abc.js.br"), b"brotli").unwrap();
+        std::fs::write(root.path().join("assets/app-abc.js.gz"), b"gzip").unwrap();
+        std::fs::write(root.path().join("index.html"), b"<h1>hi</h1>").unwrap();
+
+        let index = StaticIndex::build(root.path()).unwrap();
+        assert_eq!(index.len(), 4);
+
+        let response = index
+            .respond(&request("/assets/app-abc.js", "").await)
+            .await
+            .unwrap();
+        assert_eq!(response.get_body().len(), 10);
+        assert_eq!(
+            response.headers().get("content-type").unwrap(),
+            "text/javascript"
+        );
+        assert!(response.headers().get("content-encoding").is_none());
+        assert!(response
+            .headers()
+            .get("cache-control")
+            .unwrap()
+            .contains("immutable"));
+        let etag = response.headers().get("etag").unwrap().clone();
+
+        let response = index
+            .respond(&request("/assets/app-abc.js", "Accept-Encoding: gzip, br\r\n").await)
+            .await
+            .unwrap();
+        assert_eq!(response.headers().get("content-encoding").unwrap(), "br");
+        assert_eq!(
+            response.headers().get("content-type").unwrap(),
+            "text/javascript"
+        );
+        assert_eq!(response.get_body().len(), 6);
+
+        let response = index
+            .respond(&request("/assets/app-abc.js", "Accept-Encoding: br;q=0, gzip\r\n").await)
+            .await
+            .unwrap();
+        assert_eq!(response.headers().get("content-encoding").unwrap(), "gzip");
+
+        let response = index
+            .respond(
+                &request(
+                    "/assets/app-abc.js",
+                    &format!("If-None-Match: {}\r\n", etag),
+                )
+                .await,
+            )
+            .await
+            .unwrap();
+        assert_eq!(response.status().code(), 304);
+        assert!(response.headers().get("content-type").is_none());
+        assert!(response.headers().get("content-length").is_none());
+        assert_eq!(response.headers().get("etag"), Some(&etag));
+
+        let head = Request::read(
+            "127.0.0.1:1234".parse().unwrap(),
+            &b"HEAD /assets/app-abc.js HTTP/1.1\r\n\r\n"[..],
+        )
+        .await
+        .unwrap();
+        let response = index.respond(&head).await.unwrap();
+        assert_eq!(response.get_body().len(), 0);
+        assert_eq!(
+            response.headers().get("content-length").map(|v| v.as_str()),
+            Some("10")
+        );
+        assert_eq!(
+            response.headers().get("content-type").unwrap(),
+            "text/javascript"
+        );
+
+        let response = index.respond(&request("/", "").await).await.unwrap();
+        assert_eq!(response.get_body().len(), 11);
+
+        assert!(index
+            .respond(&request("/missing.js", "").await)
+            .await
+            .is_none());
+    }
+
+    #[test]
+    fn test_accepted_encodings() {
+        assert_eq!(
+            accepted_encodings("gzip, deflate;q=0.5, br;q=0"),
+            vec!["gzip".to_string(), "deflate".to_string()]
+        );
+    }
+}
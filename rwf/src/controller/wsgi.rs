@@ -1,19 +1,29 @@
 //! WSGI interface to Python applications, e.g. Django and Flask.
+//!
+//! The application is imported once, on the first request, and shared by all the threads.
+//! Python code still runs one thread at a time, holding the GIL: threads help apps that
+//! wait on I/O, e.g. the database, but not CPU-bound ones. PyO3 doesn't support
+//! sub-interpreters or free-threaded Python, so using more cores means running more processes.
+use std::sync::Arc;
+
 use super::{Controller, Error};
 use crate::http::{wsgi::WsgiRequest, Request, Response};
 
 use async_trait::async_trait;
+use once_cell::sync::OnceCell;
 use pyo3::prelude::*;
+use pyo3::types::PyTracebackMethods;
 use rayon::{ThreadPool, ThreadPoolBuilder};
 use tokio::sync::oneshot::channel;
 use tokio::time::{timeout, Duration};
 
-use tracing::warn;
+use tracing::{error, warn};
 
 pub struct WsgiController {
     path: &'static str,
     timeout: Duration,
     pool: ThreadPool,
+    application: Arc<OnceCell<Py<PyAny>>>,
 }
 
 impl WsgiController {
@@ -22,6 +32,7 @@ impl WsgiController {
             path,
             timeout: Duration::from_secs(60),
             pool: Self::runtime(2),
+            application: Arc::new(OnceCell::new()),
         }
     }
 
@@ -30,6 +41,8 @@ impl WsgiController {
         self
     }
 
+    /// Number of threads calling the application. They share the GIL, so more of them
+    /// only help while requests wait on I/O.
     pub fn max_threads(mut self, threads: usize) -> Self {
         self.pool = Self::runtime(threads);
         self
@@ -46,6 +59,17 @@ impl WsgiController {
     }
 }
 
+/// Log an exception raised by the application, with its traceback.
+fn log_error(err: &PyErr) {
+    let traceback = Python::with_gil(|py| {
+        err.traceback_bound(py)
+            .and_then(|traceback| traceback.format().ok())
+            .unwrap_or_default()
+    });
+
+    error!("WSGI application raised {}\n{}", err, traceback);
+}
+
 #[async_trait]
 impl Controller for WsgiController {
     // Let Django/Flask handle CSRF.
@@ -56,17 +80,31 @@ impl Controller for WsgiController {
     async fn handle(&self, request: &Request) -> Result<Response, Error> {
         let request = WsgiRequest::from_request(request)?;
         let path = self.path;
+        let application = self.application.clone();
         let (tx, rx) = channel();
 
         self.pool.spawn(move || {
-            let response = Python::with_gil(|py| {
-                // Import is cached.
-                let module = PyModule::import_bound(py, path).unwrap();
-                let application: Py<PyAny> = module.getattr("application").unwrap().into();
-                request.send(&application)
-            })
-            .unwrap();
+            let application = application.get_or_try_init(|| {
+                Python::with_gil(|py| -> PyResult<Py<PyAny>> {
+                    let module = PyModule::import_bound(py, path)?;
+                    Ok(module.getattr("application")?.into())
+                })
+            });
+
+            // Dropping `tx` answers with a 500; the import is tried again on the next request,
+            // and the pool thread goes on to the next one if the application raises.
+            let application = match application {
+                Ok(application) => application,
+                Err(err) => {
+                    error!("WSGI application \"{}\" failed to load: {}", path, err);
+                    return;
+                }
+            };
 
+            let response = match request.send(application) {
+                Ok(response) => response,
+                Err(err) => return log_error(&err),
+            };
             let _ = tx.send(response);
         });
 
@@ -1,13 +1,22 @@
 //! Handle sending a response body to the client.
 //!
-//! The body can be text, HTML, raw bytes, JSON and a static file. The `Content-Type` and `Content-Length` headers
+//! The body can be text, HTML, raw bytes, JSON, a static file or a stream of chunks. The `Content-Type` and `Content-Length` headers
 //! are set automatically.
 use std::fmt::Debug;
 use std::fs::Metadata;
 use std::marker::Unpin;
-use std::path::PathBuf;
+use std::ops::Range;
+use std::os::unix::fs::FileExt;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
 use tokio::fs::File;
 use tokio::io::{copy, AsyncWrite, AsyncWriteExt};
+use tokio::sync::mpsc::Receiver;
+use tokio::task::spawn_blocking;
+
+/// Bytes read at a time when a shared file can't be sent with `sendfile(2)`, e.g. over TLS.
+const FILE_CHUNK: u64 = 256 * 1024;
 
 /// Response body.
 #[derive(Debug)]
@@ -28,6 +37,18 @@ pub enum Body {
     Json(Vec<u8>),
     /// A file that's already read into memory.
     FileInclude { path: PathBuf, bytes: Vec<u8> },
+    /// Chunks sent to the client as they arrive, using `Transfer-Encoding: chunked`.
+    Stream(Receiver<Vec<u8>>),
+    /// Raw bytes owned by someone else, e.g. a Ruby string, sent without copying.
+    Shared(bytes::Bytes),
+    /// Static file opened by someone else, e.g. [`crate::http::file_cache`], or just a range of it.
+    /// It's read with positional I/O, so the descriptor can be shared.
+    SharedFile {
+        path: PathBuf,
+        file: Arc<std::fs::File>,
+        metadata: Metadata,
+        range: Option<Range<u64>>,
+    },
 }
 
 impl Clone for Body {
@@ -47,9 +68,24 @@ impl Clone for Body {
             Text(text) => Text(text.clone()),
             Json(json) => Json(json.clone()),
             Bytes(bytes) => Bytes(bytes.clone()),
+            Shared(bytes) => Shared(bytes.clone()),
+            SharedFile {
+                path,
+                file,
+                metadata,
+                range,
+            } => SharedFile {
+                path: path.clone(),
+                file: file.clone(),
+                metadata: metadata.clone(),
+                range: range.clone(),
+            },
             File { .. } => {
                 panic!("file body cannot be cloned, it contains an open file descriptor")
             }
+            Stream(_) => {
+                panic!("stream body cannot be cloned, its chunks can only be consumed once")
+            }
         }
     }
 }
@@ -73,8 +109,56 @@ impl Body {
         }
     }
 
+    /// Create a body which streams chunks from the receiver as they arrive.
+    pub fn stream(chunks: Receiver<Vec<u8>>) -> Self {
+        Self::Stream(chunks)
+    }
+
+    /// Create a body sending a shared file, or only the bytes in `range`.
+    pub fn shared_file(
+        path: &PathBuf,
+        file: Arc<std::fs::File>,
+        metadata: Metadata,
+        range: Option<Range<u64>>,
+    ) -> Self {
+        Self::SharedFile {
+            path: path.to_owned(),
+            file,
+            metadata,
+            range,
+        }
+    }
+
+    /// File descriptor, offset and number of bytes to send, if the body
+    /// is a file that can be sent straight from the kernel with `sendfile(2)`.
+    pub(crate) fn file_span(&self) -> Option<(RawFd, u64, u64)> {
+        match self {
+            Self::File { file, metadata, .. } => Some((file.as_raw_fd(), 0, metadata.len())),
+            Self::SharedFile { file, .. } => {
+                let range = self.file_range()?;
+                Some((file.as_raw_fd(), range.start, range.end - range.start))
+            }
+            _ => None,
+        }
+    }
+
+    fn file_range(&self) -> Option<Range<u64>> {
+        match self {
+            Self::SharedFile {
+                metadata, range, ..
+            } => Some(range.clone().unwrap_or(0..metadata.len())),
+            _ => None,
+        }
+    }
+
+    /// The body is sent in chunks and its length isn't known upfront.
+    pub fn is_stream(&self) -> bool {
+        matches!(self, Self::Stream(_))
+    }
+
     /// Send the body to the stream. If the body is a file,
-    /// it will be sent efficiently using [`tokio::io::copy`].
+    /// it will be sent efficiently using [`tokio::io::copy`]. Stream bodies
+    /// are flushed after each chunk.
     /// The stream is not flushed, so if call `stream.flush().await`
     /// to make sure the data reaches the client.
     pub async fn send(
@@ -89,24 +173,76 @@ impl Body {
                 Ok(())
             }
             Bytes(bytes) => Ok(stream.write_all(bytes).await?),
+            Shared(bytes) => Ok(stream.write_all(bytes).await?),
+            SharedFile {
+                file,
+                metadata,
+                range,
+                ..
+            } => {
+                let range = range.clone().unwrap_or(0..metadata.len());
+                let mut offset = range.start;
+
+                while offset < range.end {
+                    let len = (range.end - offset).min(FILE_CHUNK) as usize;
+                    let file = file.clone();
+
+                    let chunk = spawn_blocking(move || {
+                        let mut chunk = vec![0u8; len];
+                        file.read_exact_at(&mut chunk, offset).map(|_| chunk)
+                    })
+                    .await
+                    .map_err(std::io::Error::other)??;
+
+                    stream.write_all(&chunk).await?;
+                    offset += len as u64;
+                }
+
+                Ok(())
+            }
             Text(text) => Ok(stream.write_all(text.as_bytes()).await?),
             Html(html) => Ok(stream.write_all(html.as_bytes()).await?),
             Json(json) => Ok(stream.write_all(json.as_slice()).await?),
             FileInclude { bytes, .. } => Ok(stream.write_all(bytes).await?),
+            Stream(chunks) => {
+                while let Some(chunk) = chunks.recv().await {
+                    // An empty chunk would end the body early in chunked encoding, so it's skipped.
+                    // The body ends when the sender is dropped.
+                    if chunk.is_empty() {
+                        continue;
+                    }
+
+                    stream
+                        .write_all(format!("{:x}\r\n", chunk.len()).as_bytes())
+                        .await?;
+                    stream.write_all(&chunk).await?;
+                    stream.write_all(b"\r\n").await?;
+                    stream.flush().await?;
+                }
+
+                stream.write_all(b"0\r\n\r\n").await
+            }
         }
     }
 
     /// Get the body size. Used in the `Content-Length` header.
+    /// Stream bodies don't know their size, so this is `0`.
     pub fn len(&self) -> usize {
         use Body::*;
 
         match self {
             File { metadata, .. } => metadata.len() as usize,
             Bytes(bytes) => bytes.len(),
+            Shared(bytes) => bytes.len(),
+            SharedFile { .. } => self
+                .file_range()
+                .map(|range| (range.end - range.start) as usize)
+                .unwrap_or(0),
             Html(html) => html.len(),
             Json(json) => json.len(),
             Text(text) => text.len(),
             FileInclude { bytes, .. } => bytes.len(),
+            Stream(_) => 0,
         }
     }
 
@@ -125,107 +261,115 @@ impl Body {
         use Body::*;
 
         match self {
-            File { path, .. } | FileInclude { path, .. } => {
-                // Guessing the mime by the extension.
-                let extension = match path.extension() {
-                    Some(extension) => extension.to_str().expect("OsStr to_str"),
-                    None => "",
-                }
-                .to_lowercase();
-
-                // https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types/Common_types
-                match extension.as_str() {
-                    "aac" => "audio/aac",
-                    "abw" => "application/x-abiword",
-                    "arc" => "application/x-freearc",
-                    "avif" => "image/avif",
-                    "avi" => "video/x-msvideo",
-                    "azw" => "application/vnd.amazon.ebook",
-                    "bin" => "application/octet-stream",
-                    "bmp" => "image/bmp",
-                    "bz" => "application/x-bzip",
-                    "bz2" => "application/x-bzip2",
-                    "cda" => "application/x-cdf",
-                    "csh" => "application/x-csh",
-                    "css" => "text/css",
-                    "csv" => "text/csv",
-                    "doc" => "application/msword",
-                    "docx" => {
-                        "application/vnd.openxmlformats-officedocument.wordprocessingml.document"
-                    }
-                    "eot" => "application/vnd.ms-fontobject",
-                    "epub" => "application/epub+zip",
-                    "gz" => "application/gzip",
-                    "gif" => "image/gif",
-                    "htm" => "text/html",
-                    "html" => "text/html",
-                    "ico" => "image/vnd.microsoft.icon",
-                    "ics" => "text/calendar",
-                    "jar" => "application/java-archive",
-                    "jpeg" => "image/jpeg",
-                    "jpg" => "image/jpeg",
-                    "js" => "text/javascript",
-                    "json" => "application/json",
-                    "jsonld" => "application/ld+json",
-                    "mid" => "audio/midi",
-                    "midi" => "audio/midi",
-                    "mjs" => "text/javascript",
-                    "mp3" => "audio/mpeg",
-                    "mp4" => "video/mp4",
-                    "mpeg" => "video/mpeg",
-                    "mpkg" => "application/vnd.apple.installer+xml",
-                    "odp" => "application/vnd.oasis.opendocument.presentation",
-                    "ods" => "application/vnd.oasis.opendocument.spreadsheet",
-                    "odt" => "application/vnd.oasis.opendocument.text",
-                    "oga" => "audio/ogg",
-                    "ogv" => "video/ogg",
-                    "ogx" => "application/ogg",
-                    "opus" => "audio/opus",
-                    "otf" => "font/otf",
-                    "png" => "image/png",
-                    "pdf" => "application/pdf",
-                    "php" => "application/x-httpd-php",
-                    "ppt" => "application/vnd.ms-powerpoint",
-                    "pptx" => {
-                        "application/vnd.openxmlformats-officedocument.presentationml.presentation"
-                    }
-                    "rar" => "application/vnd.rar",
-                    "rtf" => "application/rtf",
-                    "sh" => "application/x-sh",
-                    "svg" => "image/svg+xml",
-                    "tar" => "application/x-tar",
-                    "tif" => "image/tiff",
-                    "tiff" => "image/tiff",
-                    "ts" => "video/mp2t",
-                    "ttf" => "font/ttf",
-                    "txt" => "text/plain",
-                    "vsd" => "application/vnd.visio",
-                    "wav" => "audio/wav",
-                    "weba" => "audio/webm",
-                    "webm" => "video/webm",
-                    "webp" => "image/webp",
-                    "woff" => "font/woff",
-                    "woff2" => "font/woff2",
-                    "xhtml" => "application/xhtml+xml",
-                    "xls" => "application/vnd.ms-excel",
-                    "xlsx" => "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet",
-                    "xml" => "application/xml",
-                    "xul" => "application/vnd.mozilla.xul+xml",
-                    "zip" => "application/zip",
-                    "3gp" => "video/3gpp",
-                    "3g2" => "video/3gpp2",
-                    "7z" => "application/x-7z-compressed",
-                    _ => "application/octet-stream",
-                }
+            File { path, .. } | FileInclude { path, .. } | SharedFile { path, .. } => {
+                mime_type_for(path)
             }
             Text(_) => "text/plain",
             Html(_) => "text/html; charset=utf-8",
             Json(_) => "application/json",
-            Bytes(_) => "application/octet-stream",
+            Bytes(_) | Shared(_) | Stream(_) => "application/octet-stream",
         }
     }
 }
 
+/// Guess the MIME type of a file from its extension.
+///
+/// # Example
+///
+/// ```
+/// # use rwf::http::body::mime_type_for;
+/// assert_eq!(mime_type_for(std::path::Path::new("app.js")), "text/javascript");
+/// ```
+pub fn mime_type_for(path: &Path) -> &'static str {
+    // Guessing the mime by the extension.
+    let extension = match path.extension() {
+        Some(extension) => extension.to_str().expect("OsStr to_str"),
+        None => "",
+    }
+    .to_lowercase();
+
+    // https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types/Common_types
+    match extension.as_str() {
+        "aac" => "audio/aac",
+        "abw" => "application/x-abiword",
+        "arc" => "application/x-freearc",
+        "avif" => "image/avif",
+        "avi" => "video/x-msvideo",
+        "azw" => "application/vnd.amazon.ebook",
+        "bin" => "application/octet-stream",
+        "bmp" => "image/bmp",
+        "bz" => "application/x-bzip",
+        "bz2" => "application/x-bzip2",
+        "cda" => "application/x-cdf",
+        "csh" => "application/x-csh",
+        "css" => "text/css",
+        "csv" => "text/csv",
+        "doc" => "application/msword",
+        "docx" => "application/vnd.openxmlformats-officedocument.wordprocessingml.document",
+        "eot" => "application/vnd.ms-fontobject",
+        "epub" => "application/epub+zip",
+        "gz" => "application/gzip",
+        "gif" => "image/gif",
+        "htm" => "text/html",
+        "html" => "text/html",
+        "ico" => "image/vnd.microsoft.icon",
+        "ics" => "text/calendar",
+        "jar" => "application/java-archive",
+        "jpeg" => "image/jpeg",
+        "jpg" => "image/jpeg",
+        "js" => "text/javascript",
+        "json" => "application/json",
+        "jsonld" => "application/ld+json",
+        "mid" => "audio/midi",
+        "midi" => "audio/midi",
+        "mjs" => "text/javascript",
+        "mp3" => "audio/mpeg",
+        "mp4" => "video/mp4",
+        "mpeg" => "video/mpeg",
+        "mpkg" => "application/vnd.apple.installer+xml",
+        "odp" => "application/vnd.oasis.opendocument.presentation",
+        "ods" => "application/vnd.oasis.opendocument.spreadsheet",
+        "odt" => "application/vnd.oasis.opendocument.text",
+        "oga" => "audio/ogg",
+        "ogv" => "video/ogg",
+        "ogx" => "application/ogg",
+        "opus" => "audio/opus",
+        "otf" => "font/otf",
+        "png" => "image/png",
+        "pdf" => "application/pdf",
+        "php" => "application/x-httpd-php",
+        "ppt" => "application/vnd.ms-powerpoint",
+        "pptx" => "application/vnd.openxmlformats-officedocument.presentationml.presentation",
+        "rar" => "application/vnd.rar",
+        "rtf" => "application/rtf",
+        "sh" => "application/x-sh",
+        "svg" => "image/svg+xml",
+        "tar" => "application/x-tar",
+        "tif" => "image/tiff",
+        "tiff" => "image/tiff",
+        "ts" => "video/mp2t",
+        "ttf" => "font/ttf",
+        "txt" => "text/plain",
+        "vsd" => "application/vnd.visio",
+        "wav" => "audio/wav",
+        "weba" => "audio/webm",
+        "webm" => "video/webm",
+        "webp" => "image/webp",
+        "woff" => "font/woff",
+        "woff2" => "font/woff2",
+        "xhtml" => "application/xhtml+xml",
+        "xls" => "application/vnd.ms-excel",
+        "xlsx" => "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet",
+        "xml" => "application/xml",
+        "xul" => "application/vnd.mozilla.xul+xml",
+        "zip" => "application/zip",
+        "3gp" => "video/3gpp",
+        "3g2" => "video/3gpp2",
+        "7z" => "application/x-7z-compressed",
+        _ => "application/octet-stream",
+    }
+}
+
 impl From<Vec<u8>> for Body {
     fn from(body: Vec<u8>) -> Self {
         Self::Bytes(body)
@@ -238,6 +382,18 @@ impl From<&[u8]> for Body {
     }
 }
 
+impl From<bytes::Bytes> for Body {
+    fn from(body: bytes::Bytes) -> Self {
+        Self::Shared(body)
+    }
+}
+
+impl From<Receiver<Vec<u8>>> for Body {
+    fn from(chunks: Receiver<Vec<u8>>) -> Self {
+        Self::Stream(chunks)
+    }
+}
+
 impl From<(PathBuf, File, Metadata)> for Body {
     fn from(file: (PathBuf, File, Metadata)) -> Self {
         Self::File {
@@ -255,3 +411,47 @@ impl TryFrom<serde_json::Value> for Body {
         Ok(Self::Json(serde_json::to_vec(&json)?))
     }
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use tokio::sync::mpsc::channel;
+
+    #[tokio::test]
+    async fn test_stream_chunked() {
+        let (tx, rx) = channel(4);
+        let mut body = Body::stream(rx);
+        assert!(body.is_stream());
+
+        tx.send(b"hello".to_vec()).await.unwrap();
+        tx.send(vec![]).await.unwrap();
+        tx.send(b" world!".to_vec()).await.unwrap();
+        drop(tx);
+
+        let mut sent = vec![];
+        body.send(&mut sent).await.unwrap();
+        assert_eq!(sent, b"5\r\nhello\r\n7\r\n world!\r\n0\r\n\r\n");
+    }
+
+    #[tokio::test]
+    async fn test_shared_file_range() {
+        let path = std::env::temp_dir().join("rwf_shared_file_test.txt");
+        std::fs::write(&path, b"hello world").unwrap();
+        let file = Arc::new(std::fs::File::open(&path).unwrap());
+        let metadata = file.metadata().unwrap();
+
+        let mut body = Body::shared_file(&path, file.clone(), metadata.clone(), Some(6..11));
+        assert_eq!(body.len(), 5);
+        assert_eq!(body.mime_type(), "text/plain");
+        assert_eq!(body.file_span().unwrap().1, 6);
+
+        let mut sent = vec![];
+        body.send(&mut sent).await.unwrap();
+        assert_eq!(sent, b"world");
+
+        let mut body = Body::shared_file(&path, file, metadata, None);
+        let mut sent = vec![];
+        body.send(&mut sent).await.unwrap();
+        assert_eq!(sent, b"hello world");
+    }
+}
@@ -0,0 +1,92 @@
+//! Open files and their metadata, kept for a short time.
+//!
+//! Sending the same file again within [`TTL`] doesn't cost an `open` and a `stat`.
+//! Files are read with positional I/O (`sendfile(2)`, `pread(2)`), so all requests
+//! sending a file share one descriptor.
+use std::collections::HashMap;
+use std::fs::{File, Metadata};
+use std::io::{Error, ErrorKind};
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use once_cell::sync::Lazy;
+use parking_lot::Mutex;
+use tokio::task::spawn_blocking;
+
+/// How long an open file is reused. A file replaced on disk is picked up after this.
+pub const TTL: Duration = Duration::from_secs(1);
+
+/// Maximum number of files kept open.
+const CAPACITY: usize = 1024;
+
+struct Entry {
+    file: Arc<File>,
+    metadata: Metadata,
+    opened_at: Instant,
+}
+
+static CACHE: Lazy<Mutex<HashMap<PathBuf, Entry>>> = Lazy::new(|| Mutex::new(HashMap::new()));
+
+/// Open a regular file for reading, or reuse a recently opened one.
+pub async fn open(path: &Path) -> Result<(Arc<File>, Metadata), Error> {
+    if let Some(entry) = CACHE.lock().get(path) {
+        if entry.opened_at.elapsed() < TTL {
+            return Ok((entry.file.clone(), entry.metadata.clone()));
+        }
+    }
+
+    let owned = path.to_owned();
+    let (file, metadata) = spawn_blocking(move || {
+        let file = File::open(&owned)?;
+        let metadata = file.metadata()?;
+        Ok::<_, Error>((file, metadata))
+    })
+    .await
+    .map_err(Error::other)??;
+
+    if !metadata.is_file() {
+        return Err(Error::new(ErrorKind::NotFound, "not a file"));
+    }
+
+    let file = Arc::new(file);
+    let mut cache = CACHE.lock();
+
+    if cache.len() >= CAPACITY {
+        cache.retain(|_, entry| entry.opened_at.elapsed() < TTL);
+
+        if cache.len() >= CAPACITY {
+            cache.clear();
+        }
+    }
+
+    cache.insert(
+        path.to_owned(),
+        Entry {
+            file: file.clone(),
+            metadata: metadata.clone(),
+            opened_at: Instant::now(),
+        },
+    );
+
+    Ok((file, metadata))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[tokio::test]
+    async fn test_open_cached() {
+        let path = std::env::temp_dir().join("rwf_file_cache_test.txt");
+        std::fs::write(&path, b"hello").unwrap();
+
+        let (first, metadata) = open(&path).await.unwrap();
+        let (second, _) = open(&path).await.unwrap();
+
+        assert_eq!(metadata.len(), 5);
+        assert!(Arc::ptr_eq(&first, &second));
+
+        assert!(open(&std::env::temp_dir()).await.is_err());
+    }
+}
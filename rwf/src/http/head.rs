@@ -209,6 +209,11 @@ impl Head {
         &self.method
     }
 
+    /// HTTP version used by the client.
+    pub fn version(&self) -> &Version {
+        &self.version
+    }
+
     /// Is this a POST request?
     pub fn post(&self) -> bool {
         self.method() == &Method::Post
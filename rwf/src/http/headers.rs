@@ -5,6 +5,9 @@ use std::collections::{hash_map::Iter, HashMap};
 #[derive(Clone, Debug, Default, crate::prelude::Deserialize, crate::prelude::Serialize)]
 pub struct Headers {
     headers: HashMap<String, String>,
+    /// Additional values for headers sent more than once, e.g. `Set-Cookie` coming from a Rack app.
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    repeated: Vec<(String, String)>,
 }
 
 impl Headers {
@@ -12,6 +15,7 @@ impl Headers {
     pub fn new() -> Self {
         Self {
             headers: HashMap::new(),
+            repeated: Vec::new(),
         }
     }
 
@@ -27,13 +31,49 @@ impl Headers {
     ///
     /// #### Implementation note
     ///
-    /// This implementation doesn't support adding
-    /// multiple headers with the same name. This is
-    /// only needed for the `Set-Cookie` header which
-    /// is handled separately.
+    /// This replaces every value set for the name, including
+    /// the ones added with [`Headers::append`]:
+    ///
+    /// ```
+    /// # use rwf::http::Headers;
+    /// let mut headers = Headers::new();
+    /// headers.append("set-cookie", "a=1");
+    /// headers.append("set-cookie", "b=2");
+    /// headers.insert("set-cookie", "c=3");
+    /// assert_eq!(headers.to_bytes(), b"set-cookie: c=3\r\n");
+    /// ```
     pub fn insert(&mut self, name: impl ToString, value: impl ToString) {
-        self.headers
-            .insert(name.to_string().to_lowercase(), value.to_string());
+        let name = name.to_string().to_lowercase();
+
+        if !self.repeated.is_empty() {
+            self.repeated.retain(|(key, _)| key != &name);
+        }
+
+        self.headers.insert(name, value.to_string());
+    }
+
+    /// Add a header value without replacing values already set for that name.
+    /// The name will be converted to lowercase.
+    ///
+    /// The first value is returned by [`Headers::get`]; all values are sent to the client.
+    ///
+    /// # Example
+    ///
+    /// ```
+    /// # use rwf::http::Headers;
+    /// let mut headers = Headers::new();
+    /// headers.append("set-cookie", "a=1");
+    /// headers.append("set-cookie", "b=2");
+    /// assert_eq!(headers.get("set-cookie"), Some(&String::from("a=1")));
+    /// ```
+    pub fn append(&mut self, name: impl ToString, value: impl ToString) {
+        let name = name.to_string().to_lowercase();
+
+        if self.headers.contains_key(&name) {
+            self.repeated.push((name, value.to_string()));
+        } else {
+            self.headers.insert(name, value.to_string());
+        }
     }
 
     /// Get a header value by name. Case insensitive.
@@ -61,7 +101,9 @@ impl Headers {
     /// headers.remove("x-my-header");
     /// ```
     pub fn remove(&mut self, name: &str) -> Option<String> {
-        self.headers.remove(&name.to_lowercase())
+        let name = name.to_lowercase();
+        self.repeated.retain(|(key, _)| key != &name);
+        self.headers.remove(&name)
     }
 
     /// Remove all headers.
@@ -76,14 +118,17 @@ impl Headers {
     /// ```
     pub fn clear(&mut self) {
         self.headers.clear();
+        self.repeated.clear();
     }
 
     /// Convert headers into a [`HashMap`] keyed by header name.
+    /// Only the first value of headers added with [`Headers::append`] is kept.
     pub fn into_raw(self) -> HashMap<String, String> {
         self.headers
     }
 
     /// Get a borrowing interator to the headers.
+    /// Only the first value of each header is returned.
     pub fn iter(&self) -> Iter<'_, String, String> {
         self.headers.iter()
     }
@@ -98,12 +143,21 @@ impl Headers {
             bytes.extend_from_slice(value.as_bytes());
             bytes.extend_from_slice(b"\r\n");
         }
+        for (name, value) in &self.repeated {
+            bytes.extend_from_slice(name.as_bytes());
+            bytes.extend_from_slice(b": ");
+            bytes.extend_from_slice(value.as_bytes());
+            bytes.extend_from_slice(b"\r\n");
+        }
         bytes
     }
 }
 
 impl From<HashMap<String, String>> for Headers {
     fn from(headers: HashMap<String, String>) -> Self {
-        Self { headers }
+        Self {
+            headers,
+            repeated: Vec::new(),
+        }
     }
 }
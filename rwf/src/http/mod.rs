@@ -13,16 +13,19 @@ pub mod authorization;
 pub mod body;
 pub mod cookies;
 pub mod error;
+pub mod file_cache;
 pub mod form;
 pub mod form_data;
 pub mod handler;
 pub mod head;
 pub mod headers;
 pub mod path;
+pub mod range;
 pub mod request;
 pub mod response;
 pub mod router;
 pub mod server;
+pub mod upload;
 pub mod url;
 pub mod websocket;
 
@@ -36,10 +39,10 @@ pub use error::Error;
 pub use form::{Form, FromFormData};
 pub use form_data::FormData;
 pub use handler::Handler;
-pub use head::{Head, Method};
+pub use head::{Head, Method, Version};
 pub use headers::Headers;
 pub use path::{Params, Path, Query, ToParameter};
-pub use request::Request;
+pub use request::{EarlyHints, Request};
 pub use response::Response;
 pub use router::Router;
 pub use server::{Server, Stream};
@@ -0,0 +1,179 @@
+//! `Range` requests, used to send part of a file, e.g. to resume a download or seek a video.
+//!
+//! Only single byte ranges are supported. Anything else is ignored
+//! and the whole body is sent instead, which [RFC 9110](https://www.rfc-editor.org/rfc/rfc9110#section-14.2) allows.
+use std::ops::Range;
+
+/// Part of the body to send.
+#[derive(Debug, Clone, PartialEq)]
+pub enum ByteRange {
+    /// The whole body.
+    Full,
+    /// Only these bytes, sent with `206 Partial Content`.
+    Partial(Range<u64>),
+    /// The range starts past the end of the body, answered with `416 Range Not Satisfiable`.
+    Unsatisfiable,
+}
+
+impl ByteRange {
+    /// Parse the `Range` header for a body of `len` bytes.
+    ///
+    /// # Example
+    ///
+    /// ```
+    /// # use rwf::http::range::ByteRange;
+    /// assert_eq!(ByteRange::parse("bytes=0-99", 1000), ByteRange::Partial(0..100));
+    /// assert_eq!(ByteRange::parse("bytes=-100", 1000), ByteRange::Partial(900..1000));
+    /// assert_eq!(ByteRange::parse("bytes=1000-", 1000), ByteRange::Unsatisfiable);
+    /// ```
+    pub fn parse(header: &str, len: u64) -> Self {
+        let spec = match header.trim().split_once('=') {
+            Some((unit, spec)) if unit.trim().eq_ignore_ascii_case("bytes") => spec.trim(),
+            _ => return Self::Full,
+        };
+
+        // Multiple ranges need a multipart body.
+        if spec.contains(',') {
+            return Self::Full;
+        }
+
+        let (start, end) = match spec.split_once('-') {
+            Some(bounds) => bounds,
+            None => return Self::Full,
+        };
+
+        match (start.trim(), end.trim()) {
+            // Last n bytes.
+            ("", suffix) => match suffix.parse::<u64>() {
+                Ok(0) => Self::Unsatisfiable,
+                Ok(_) if len == 0 => Self::Unsatisfiable,
+                Ok(suffix) => Self::Partial(len.saturating_sub(suffix)..len),
+                Err(_) => Self::Full,
+            },
+
+            (start, end) => {
+                let start = match start.parse::<u64>() {
+                    Ok(start) => start,
+                    Err(_) => return Self::Full,
+                };
+
+                let end = if end.is_empty() {
+                    len
+                } else {
+                    match end.parse::<u64>() {
+                        Ok(end) if end >= start => end.saturating_add(1).min(len),
+                        _ => return Self::Full,
+                    }
+                };
+
+                if start >= len {
+                    Self::Unsatisfiable
+                } else {
+                    Self::Partial(start..end)
+                }
+            }
+        }
+    }
+
+    /// Read the range back from a `Content-Range` header, e.g. one set by the app.
+    pub fn from_content_range(header: &str, len: u64) -> Self {
+        let range = match header.trim().strip_prefix("bytes ") {
+            Some(range) => range,
+            None => return Self::Full,
+        };
+        let range = range.split('/').next().unwrap_or("");
+
+        match Self::parse(&format!("bytes={}", range), len) {
+            // Content-Range always has both ends.
+            Self::Partial(range) if !range.is_empty() => Self::Partial(range),
+            _ => Self::Full,
+        }
+    }
+
+    /// Value of the `Content-Range` header for a body of `len` bytes.
+    pub fn content_range(&self, len: u64) -> Option<String> {
+        match self {
+            Self::Full => None,
+            Self::Partial(range) => Some(format!(
+                "bytes {}-{}/{}",
+                range.start,
+                range.end.saturating_sub(1),
+                len
+            )),
+            Self::Unsatisfiable => Some(format!("bytes */{}", len)),
+        }
+    }
+}
+
+/// Check the `If-Range` header against the response validators.
+///
+/// The range is only honoured if the client's copy is still current: the entity tag must match
+/// exactly (weak tags never do), or the date must be the `Last-Modified` date of the response.
+pub fn if_range(header: &str, etag: Option<&str>, last_modified: Option<&str>) -> bool {
+    let header = header.trim();
+
+    if header.starts_with("W/") {
+        false
+    } else if header.starts_with('"') {
+        etag.map(|etag| etag.trim() == header).unwrap_or(false)
+    } else {
+        last_modified
+            .map(|last_modified| last_modified.trim() == header)
+            .unwrap_or(false)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_parse() {
+        for (header, expected) in [
+            ("bytes=0-0", ByteRange::Partial(0..1)),
+            ("bytes=10-19", ByteRange::Partial(10..20)),
+            ("bytes=10-", ByteRange::Partial(10..100)),
+            ("bytes=90-1000", ByteRange::Partial(90..100)),
+            ("bytes=-10", ByteRange::Partial(90..100)),
+            ("bytes=-1000", ByteRange::Partial(0..100)),
+            ("Bytes = 5-6", ByteRange::Partial(5..7)),
+            ("bytes=100-", ByteRange::Unsatisfiable),
+            ("bytes=-0", ByteRange::Unsatisfiable),
+            ("bytes=20-10", ByteRange::Full),
+            ("bytes=0-1,5-6", ByteRange::Full),
+            ("bytes=abc", ByteRange::Full),
+            ("items=0-1", ByteRange::Full),
+        ] {
+            assert_eq!(ByteRange::parse(header, 100), expected, "{}", header);
+        }
+
+        assert_eq!(ByteRange::parse("bytes=-5", 0), ByteRange::Unsatisfiable);
+    }
+
+    #[test]
+    fn test_content_range() {
+        let range = ByteRange::parse("bytes=10-19", 100);
+        assert_eq!(range.content_range(100).unwrap(), "bytes 10-19/100");
+        assert_eq!(ByteRange::from_content_range("bytes 10-19/100", 100), range);
+        assert_eq!(
+            ByteRange::Unsatisfiable.content_range(100).unwrap(),
+            "bytes */100"
+        );
+        assert_eq!(ByteRange::Full.content_range(100), None);
+        assert_eq!(
+            ByteRange::from_content_range("bytes */100", 100),
+            ByteRange::Full
+        );
+    }
+
+    #[test]
+    fn test_if_range() {
+        let date = "Wed, 21 Oct 2015 07:28:00 GMT";
+
+        assert!(if_range("\"abc\"", Some("\"abc\""), None));
+        assert!(!if_range("\"abc\"", Some("\"def\""), None));
+        assert!(!if_range("W/\"abc\"", Some("W/\"abc\""), None));
+        assert!(if_range(date, None, Some(date)));
+        assert!(!if_range(date, Some("\"abc\""), None));
+    }
+}
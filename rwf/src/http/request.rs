@@ -5,12 +5,15 @@ use std::ops::Deref;
 use std::sync::Arc;
 use std::{collections::HashMap, fmt::Debug};
 
+use bytes::Bytes;
 use serde::Deserialize;
 use serde_json::{Deserializer, Value};
 use time::OffsetDateTime;
 use tokio::io::{AsyncRead, AsyncReadExt};
+use tokio::sync::mpsc::UnboundedSender;
 
-use super::{Cookies, Error, FormData, FromFormData, Head, Params, Response, ToParameter};
+use super::server::ClientSocket;
+use super::{upload, Cookies, Error, FormData, FromFormData, Head, Params, Response, ToParameter};
 use crate::controller::auth::{IdType, ToIdType};
 use crate::prelude::ToConnectionRequest;
 use crate::{
@@ -31,8 +34,17 @@ pub struct Request {
     // Don't check for valid CSRF token.
     skip_csrf: bool,
     renew_session: bool,
+    #[serde(skip)]
+    early_hints: Option<UnboundedSender<EarlyHints>>,
+    #[serde(skip)]
+    client: Option<Arc<ClientSocket>>,
+    #[serde(default)]
+    tls: bool,
 }
 
+/// Headers of a `103 Early Hints` response, e.g. `Link` preloads.
+pub type EarlyHints = Vec<(String, String)>;
+
 impl Default for Request {
     fn default() -> Self {
         Self {
@@ -43,13 +55,17 @@ impl Default for Request {
             received_at: OffsetDateTime::now_utc(),
             skip_csrf: false,
             renew_session: false,
+            early_hints: None,
+            client: None,
+            tls: false,
         }
     }
 }
 
 #[derive(Debug, Clone, crate::prelude::Deserialize, crate::prelude::Serialize)]
 struct Inner {
-    body: Vec<u8>,
+    #[serde(with = "super::upload::serde_bytes")]
+    body: Bytes,
     cookies: Cookies,
     peer: SocketAddr,
 }
@@ -57,7 +73,7 @@ struct Inner {
 impl Default for Inner {
     fn default() -> Inner {
         Inner {
-            body: Vec::default(),
+            body: Bytes::new(),
             cookies: Cookies::default(),
             peer: "127.0.0.1:8000".parse().unwrap(), // Just used for testing.
         }
@@ -93,9 +109,8 @@ impl Request {
             return Err(Error::ContentTooLarge(head));
         }
 
-        let mut body = vec![0u8; content_length];
-        stream
-            .read_exact(&mut body)
+        // Large bodies go to a temporary file.
+        let body = upload::read(&mut stream, content_length)
             .await
             .map_err(|_| Error::MalformedRequest("incorrect content length"))?;
 
@@ -118,6 +133,9 @@ impl Request {
             received_at: OffsetDateTime::now_utc(),
             skip_csrf: false,
             renew_session,
+            early_hints: None,
+            client: None,
+            tls: false,
         })
     }
 
@@ -170,6 +188,11 @@ impl Request {
         &self.inner.body
     }
 
+    /// The request body, shared without copying it, e.g. to pass it to another thread.
+    pub fn body_bytes(&self) -> Bytes {
+        self.inner.body.clone()
+    }
+
     /// Request body parsed JSON value. If the body isn't JSON, an error is returned.
     pub fn json_raw(&self) -> Result<Value, serde_json::Error> {
         self.json()
@@ -310,6 +333,50 @@ impl Request {
         self
     }
 
+    /// Send a `103 Early Hints` response with these headers, e.g. `Link` preloads, so the browser
+    /// can start fetching them while the final response is still being prepared.
+    ///
+    /// Returns `false` if the hints can't be sent, e.g. the client doesn't speak HTTP/1.1.
+    /// Hints sent once the response is on its way are dropped.
+    pub fn send_early_hints(&self, headers: EarlyHints) -> bool {
+        match self.early_hints {
+            Some(ref tx) => tx.send(headers).is_ok(),
+            None => false,
+        }
+    }
+
+    /// Where early hints for this request go, if the client can get them.
+    pub(crate) fn early_hints(&self) -> Option<UnboundedSender<EarlyHints>> {
+        self.early_hints.clone()
+    }
+
+    /// Let the controller send early hints. Set by the HTTP server.
+    pub(crate) fn with_early_hints(mut self, tx: UnboundedSender<EarlyHints>) -> Self {
+        self.early_hints = Some(tx);
+        self
+    }
+
+    /// The client's socket, to check it's still there. Set by the HTTP server.
+    pub(crate) fn client(&self) -> Option<Arc<ClientSocket>> {
+        self.client.clone()
+    }
+
+    pub(crate) fn with_client(mut self, client: Arc<ClientSocket>) -> Self {
+        self.client = Some(client);
+        self
+    }
+
+    /// The request came in over TLS, directly from the client.
+    pub fn tls(&self) -> bool {
+        self.tls
+    }
+
+    /// Set by the HTTP server for TLS connections.
+    pub(crate) fn with_tls(mut self, tls: bool) -> Self {
+        self.tls = tls;
+        self
+    }
+
     /// Did the client request a HTTP connection upgrade to WebSocket?
     pub fn upgrade_websocket(&self) -> bool {
         self.headers()
@@ -393,7 +460,7 @@ impl Request {
 
     pub(crate) fn replace_body(&mut self, body: Vec<u8>) {
         self.inner = Arc::new(Inner {
-            body,
+            body: Bytes::from(body),
             cookies: self.inner.cookies.clone(),
             peer: self.inner.peer,
         });
@@ -260,13 +260,26 @@ impl Response {
     /// when building a response.
     pub fn body(mut self, body: impl Into<Body>) -> Self {
         self.body = body.into();
-        self.headers
-            .insert("content-length".to_string(), self.body.len().to_string());
+        if self.body.is_stream() {
+            self.headers.remove("content-length");
+            self.headers.insert("transfer-encoding", "chunked");
+        } else {
+            self.headers.remove("transfer-encoding");
+            self.headers
+                .insert("content-length".to_string(), self.body.len().to_string());
+        }
         self.headers
             .insert("content-type", self.body.mime_type().to_string());
         self
     }
 
+    /// Don't send the body, but keep the headers that describe it, like `Content-Length`,
+    /// e.g. to answer a `HEAD` request.
+    pub fn without_body(mut self) -> Self {
+        self.body = Body::bytes(vec![]);
+        self
+    }
+
     /// Get response status, e.g. 200 OK.
     pub fn status(&self) -> Status {
         self.code.into()
@@ -356,6 +369,15 @@ impl Response {
 
     /// Send the response to a stream, serialized as bytes.
     pub async fn send(mut self, mut stream: impl AsyncWrite + Unpin) -> Result<(), std::io::Error> {
+        self.send_head(&mut stream).await?;
+        self.body.send(stream).await
+    }
+
+    /// Send the status line and the headers, but not the body.
+    pub(crate) async fn send_head(
+        &self,
+        mut stream: impl AsyncWrite + Unpin,
+    ) -> Result<(), std::io::Error> {
         let mut response = format!("{} {}\r\n", self.version, self.code)
             .as_bytes()
             .to_vec();
@@ -364,8 +386,7 @@ impl Response {
         response.extend_from_slice(&self.cookies.to_headers());
         response.extend_from_slice(b"\r\n");
 
-        stream.write_all(&response).await?;
-        self.body.send(stream).await
+        stream.write_all(&response).await
     }
 
     /// Mutable reference to response cookies. Used to set cookies on the response.
@@ -529,6 +550,11 @@ impl Response {
         Self::error_pretty("429 - Too Many", "").code(429)
     }
 
+    /// Create `503 - Service Unavailable` response.
+    pub fn service_unavailable() -> Self {
+        Self::error_pretty("503 - Service Unavailable", "").code(503)
+    }
+
     /// Create `302 - Found` response, also known as a redirect.
     pub fn redirect(self, to: impl ToString) -> Self {
         self.html("")
@@ -5,23 +5,28 @@
 //!
 //! The server is using Tokio and can support millions of concurrent clients.
 
-use super::{Error, Handler, Request, Response, Router};
+use super::{EarlyHints, Error, Handler, Request, Response, Router, Version};
 use std::cell::OnceCell;
 
 use crate::colors::MaybeColorize;
 use crate::config::get_config;
 
+use parking_lot::Mutex;
 use rustls::pki_types::pem::PemObject;
 use rustls::pki_types::{CertificateDer, PrivateKeyDer};
+use std::io::ErrorKind;
 use std::net::SocketAddr;
+use std::os::unix::io::{AsRawFd, RawFd};
 use std::pin::Pin;
 use std::sync::Arc;
 use std::task::{Context, Poll};
 use std::time::{Duration, Instant};
+use tokio::io::Interest;
 use tokio::io::{AsyncRead, AsyncWrite, AsyncWriteExt, BufReader, BufWriter, ReadBuf};
 use tokio::net::{TcpListener, TcpStream};
 use tokio::select;
 use tokio::signal::ctrl_c;
+use tokio::sync::mpsc::unbounded_channel;
 use tokio::task::JoinHandle;
 use tokio_rustls::{server::TlsStream, TlsAcceptor};
 use tracing::{debug, error, info, warn};
@@ -57,6 +62,14 @@ impl Conn {
             Self::Tls(stream) => Stream::Tls(stream),
         }
     }
+
+    /// The TCP socket, under TLS if there is any.
+    fn fd(&self) -> RawFd {
+        match self {
+            Self::Plain(stream) => stream.get_ref().get_ref().as_raw_fd(),
+            Self::Tls(stream) => stream.get_ref().get_ref().get_ref().0.as_raw_fd(),
+        }
+    }
 }
 
 impl AsyncRead for Conn {
@@ -155,6 +168,63 @@ impl<'a> Stream<'a> {
     }
 }*/
 
+/// The client's socket, for controllers to check that the client is still there without
+/// reading from it.
+#[derive(Debug)]
+pub(crate) struct ClientSocket {
+    /// `None` once the connection is closed, so the descriptor isn't used after that.
+    fd: Mutex<Option<RawFd>>,
+}
+
+impl ClientSocket {
+    fn new(fd: RawFd) -> Self {
+        Self {
+            fd: Mutex::new(Some(fd)),
+        }
+    }
+
+    /// The client reset the connection, or it's closed already.
+    ///
+    /// A client closing its side after sending the request isn't gone: it can still be
+    /// waiting for the response, e.g. after `shutdown(SHUT_WR)`.
+    pub(crate) fn gone(&self) -> bool {
+        // Held while peeking, so the connection can't close it meanwhile.
+        let open = self.fd.lock();
+
+        let fd = match *open {
+            Some(fd) => fd,
+            None => return true,
+        };
+
+        let mut byte = 0u8;
+        let peeked = unsafe {
+            libc::recv(
+                fd,
+                &mut byte as *mut u8 as *mut libc::c_void,
+                1,
+                libc::MSG_PEEK | libc::MSG_DONTWAIT,
+            )
+        };
+
+        peeked < 0
+            && !matches!(
+                std::io::Error::last_os_error().kind(),
+                ErrorKind::WouldBlock | ErrorKind::Interrupted
+            )
+    }
+}
+
+/// Marks the socket closed when the connection ends.
+struct ClientGuard {
+    socket: Arc<ClientSocket>,
+}
+
+impl Drop for ClientGuard {
+    fn drop(&mut self) {
+        *self.socket.fd.lock() = None;
+    }
+}
+
 /// HTTP server.
 pub struct Server {
     handlers: Arc<Router>,
@@ -251,6 +321,12 @@ impl Server {
             };
             debug!("{} new connection from {:?}", "http".purple(), peer_addr);
 
+            // Shared by the requests on the connection. Dropped before the stream is.
+            let (hints_tx, mut hints_rx) = unbounded_channel();
+            let client = ClientGuard {
+                socket: Arc::new(ClientSocket::new(stream.fd())),
+            };
+
             loop {
                 let request = match Request::read(peer_addr, &mut stream).await {
                     Ok(request) => request,
@@ -283,8 +359,37 @@ impl Server {
                         // Set the matching regex to extract parameters.
                         let request = request.with_params(handler.path_with_regex().params());
 
+                        // Informational responses are HTTP/1.1 only. Hints sent after
+                        // an earlier response was on its way are thrown away.
+                        while hints_rx.try_recv().is_ok() {}
+                        let request = if request.version() == &Version::Http1 {
+                            request.with_early_hints(hints_tx.clone())
+                        } else {
+                            request
+                        };
+                        let request = request
+                            .with_client(client.socket.clone())
+                            .with_tls(matches!(stream, Conn::Tls(_)));
+
                         // Pass the request to the controller to get a response.
-                        let response = match handler.handle_internal(request.clone()).await {
+                        // Early hints go out as soon as the controller sends them.
+                        let handle = handler.handle_internal(request.clone());
+                        tokio::pin!(handle);
+
+                        let response = loop {
+                            select! {
+                                response = &mut handle => break response,
+
+                                Some(hints) = hints_rx.recv() => {
+                                    if let Err(err) = Self::send_early_hints(&mut stream, hints).await {
+                                        debug!("{} error {:?}", peer_addr, err);
+                                    }
+                                }
+
+                            }
+                        };
+
+                        let response = match response {
                             Ok(response) => response,
                             Err(err) => {
                                 error!("{}", err);
@@ -357,13 +462,140 @@ impl Server {
         );
     }
 
-    async fn send_response(
-        mut stream: impl AsyncWrite + Unpin,
-        response: Response,
-    ) -> Result<(), Error> {
-        response.send(&mut stream).await?;
+    /// Send a `103 Early Hints` response. Headers that could break the response are left out.
+    async fn send_early_hints(stream: &mut Conn, hints: EarlyHints) -> Result<(), Error> {
+        let mut head = b"HTTP/1.1 103 Early Hints\r\n".to_vec();
+
+        for (name, value) in hints {
+            let valid = !name.is_empty()
+                && !name.contains([':', '\r', '\n'])
+                && !value.contains(['\r', '\n']);
+
+            if valid {
+                head.extend_from_slice(format!("{}: {}\r\n", name, value).as_bytes());
+            }
+        }
+
+        head.extend_from_slice(b"\r\n");
+        stream.write_all(&head).await?;
+        stream.flush().await?;
+
+        Ok(())
+    }
+
+    async fn send_response(stream: &mut Conn, response: Response) -> Result<(), Error> {
+        // Files go from the page cache straight to the socket, without copying them through Rwf.
+        // TLS has to encrypt the bytes, so they go the usual way.
+        #[cfg(target_os = "linux")]
+        if let (Conn::Plain(plain), Some((fd, offset, len))) =
+            (&mut *stream, response.get_body().file_span())
+        {
+            response.send_head(&mut *plain).await?;
+            plain.flush().await?;
+            sendfile(plain.get_ref().get_ref(), fd, offset, len).await?;
+
+            return Ok(());
+        }
+
+        response.send(&mut *stream).await?;
         stream.flush().await?;
 
         Ok(())
     }
 }
+
+/// Send `len` bytes of the file, starting at `offset`, to the socket with `sendfile(2)`.
+#[cfg(target_os = "linux")]
+async fn sendfile(
+    socket: &TcpStream,
+    fd: RawFd,
+    offset: u64,
+    len: u64,
+) -> Result<(), std::io::Error> {
+    let mut offset = offset as libc::off_t;
+    let end = offset + len as libc::off_t;
+
+    while offset < end {
+        socket.writable().await?;
+
+        let sent = socket.try_io(Interest::WRITABLE, || {
+            let remaining = (end - offset) as usize;
+            let sent = unsafe { libc::sendfile(socket.as_raw_fd(), fd, &mut offset, remaining) };
+
+            if sent < 0 {
+                Err(std::io::Error::last_os_error())
+            } else {
+                Ok(sent)
+            }
+        });
+
+        match sent {
+            Ok(0) => {
+                return Err(std::io::Error::new(
+                    ErrorKind::UnexpectedEof,
+                    "file is shorter than its metadata says",
+                ))
+            }
+            Ok(_) => (),
+            Err(err) if err.kind() == ErrorKind::WouldBlock => continue,
+            Err(err) => return Err(err),
+        }
+    }
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    async fn pair() -> (TcpStream, TcpStream) {
+        let listener = TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let client = TcpStream::connect(listener.local_addr().unwrap())
+            .await
+            .unwrap();
+        let (server, _) = listener.accept().await.unwrap();
+
+        (client, server)
+    }
+
+    #[tokio::test]
+    async fn test_client_socket() {
+        // Closing its side after the request: still waiting for the response.
+        let (mut client, server) = pair().await;
+        let socket = ClientSocket::new(server.as_raw_fd());
+        assert!(!socket.gone());
+        client.write_all(b"GET / HTTP/1.1\r\n\r\n").await.unwrap();
+        client.shutdown().await.unwrap();
+        tokio::time::sleep(Duration::from_millis(50)).await;
+        assert!(!socket.gone());
+
+        // Reset.
+        let (client, server) = pair().await;
+        let socket = ClientSocket::new(server.as_raw_fd());
+        let linger = libc::linger {
+            l_onoff: 1,
+            l_linger: 0,
+        };
+        unsafe {
+            libc::setsockopt(
+                client.as_raw_fd(),
+                libc::SOL_SOCKET,
+                libc::SO_LINGER,
+                &linger as *const libc::linger as *const libc::c_void,
+                std::mem::size_of::<libc::linger>() as libc::socklen_t,
+            );
+        }
+        drop(client);
+        tokio::time::sleep(Duration::from_millis(50)).await;
+        assert!(socket.gone());
+
+        // The connection is done.
+        let guard = ClientGuard {
+            socket: Arc::new(ClientSocket::new(server.as_raw_fd())),
+        };
+        let socket = guard.socket.clone();
+        drop(guard);
+        assert!(socket.gone());
+    }
+}
@@ -0,0 +1,149 @@
+//! Request bodies, read into memory or, past a size, into a temporary file.
+//!
+//! Small bodies are read into a buffer. Bodies larger than
+//! [`General::spill_request_size`](crate::config::General::spill_request_size) are written
+//! to a temporary file as they arrive and mapped back into memory, so a large upload lives in
+//! the page cache, which the kernel can write back and reclaim, instead of the heap.
+//! Either way the body is [`Bytes`], which controllers can share without copying it.
+use std::fs::{remove_file, File, OpenOptions};
+use std::io::{Error, ErrorKind};
+use std::os::unix::io::AsRawFd;
+use std::ptr::NonNull;
+
+use bytes::Bytes;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWriteExt};
+
+use crate::config::get_config;
+
+/// Read a request body of `len` bytes from the stream.
+pub(crate) async fn read(
+    stream: &mut (impl AsyncRead + Unpin),
+    len: usize,
+) -> Result<Bytes, Error> {
+    if len <= get_config().general.spill_request_size {
+        let mut body = vec![0u8; len];
+        stream.read_exact(&mut body).await?;
+
+        return Ok(Bytes::from(body));
+    }
+
+    let file = tempfile()?;
+    let mut writer = tokio::fs::File::from_std(file.try_clone()?);
+    let copied = tokio::io::copy(&mut stream.take(len as u64), &mut writer).await?;
+
+    if copied != len as u64 {
+        return Err(Error::new(
+            ErrorKind::UnexpectedEof,
+            "request body is incomplete",
+        ));
+    }
+
+    // Wait for tokio's background write to finish before mapping the file.
+    writer.flush().await?;
+    drop(writer);
+
+    Ok(Bytes::from_owner(Mapped::new(file, len)?))
+}
+
+/// Temporary file, already unlinked, so it's gone when the last descriptor is closed.
+fn tempfile() -> Result<File, Error> {
+    let path = std::env::temp_dir().join(format!("rwf-upload-{}", uuid::Uuid::new_v4()));
+    let file = OpenOptions::new()
+        .read(true)
+        .write(true)
+        .create_new(true)
+        .open(&path)?;
+    remove_file(&path)?;
+
+    Ok(file)
+}
+
+/// Read-only mapping of a file.
+struct Mapped {
+    ptr: NonNull<u8>,
+    len: usize,
+    _file: File,
+}
+
+// The mapping is read-only and unmapped only on drop.
+unsafe impl Send for Mapped {}
+unsafe impl Sync for Mapped {}
+
+impl Mapped {
+    fn new(file: File, len: usize) -> Result<Self, Error> {
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+
+        if ptr == libc::MAP_FAILED {
+            return Err(Error::last_os_error());
+        }
+
+        // Read front to back by most apps, e.g. multipart parsers.
+        unsafe { libc::madvise(ptr, len, libc::MADV_SEQUENTIAL) };
+
+        Ok(Self {
+            ptr: NonNull::new(ptr as *mut u8).expect("mmap returned null"),
+            len,
+            _file: file,
+        })
+    }
+}
+
+impl AsRef<[u8]> for Mapped {
+    fn as_ref(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+    }
+}
+
+impl Drop for Mapped {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr.as_ptr() as *mut libc::c_void, self.len) };
+    }
+}
+
+/// Serialize the body as bytes; it's read back into memory.
+pub(crate) mod serde_bytes {
+    use bytes::Bytes;
+    use serde::{Deserialize, Deserializer, Serializer};
+
+    pub fn serialize<S: Serializer>(body: &Bytes, serializer: S) -> Result<S::Ok, S::Error> {
+        serializer.serialize_bytes(body)
+    }
+
+    pub fn deserialize<'de, D: Deserializer<'de>>(deserializer: D) -> Result<Bytes, D::Error> {
+        Vec::<u8>::deserialize(deserializer).map(Bytes::from)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[tokio::test]
+    async fn test_spill_to_disk() {
+        let spill = get_config().general.spill_request_size;
+
+        let small = vec![b'a'; 16];
+        let body = read(&mut &small[..], small.len()).await.unwrap();
+        assert_eq!(&body[..], &small[..]);
+
+        let large = (0..spill + 4096).map(|i| i as u8).collect::<Vec<_>>();
+        let body = read(&mut &large[..], large.len()).await.unwrap();
+        assert_eq!(&body[..], &large[..]);
+        // Shared without copying.
+        assert_eq!(body.clone().as_ptr(), body.as_ptr());
+
+        let err = read(&mut &large[..spill + 1], large.len())
+            .await
+            .unwrap_err();
+        assert_eq!(err.kind(), ErrorKind::UnexpectedEof);
+    }
+}
@@ -89,20 +89,15 @@ impl WsgiRequest {
         Ok(wsgi)
     }
 
-    pub fn send(self, application: &Py<PyAny>) -> Result<WsgiResponse, Error> {
-        let body: Vec<Vec<u8>>;
-        let code: String;
-        let headers: Vec<(String, String)>;
-
-        (body, code, headers) = Python::with_gil(|py| {
-            let request = self.into_py(py);
-            let wrapper: Py<PyAny> = WRAPPER.getattr(py, "wrapper").unwrap().into();
-            let body: Py<PyAny> = wrapper.call1(py, (request, application)).unwrap();
-            let (body, code, headers): (Vec<Vec<u8>>, String, Vec<(String, String)>) =
-                body.extract(py).unwrap();
-
-            (body, code, headers)
-        });
+    pub fn send(self, application: &Py<PyAny>) -> PyResult<WsgiResponse> {
+        let (body, code, headers): (Vec<Vec<u8>>, String, Vec<(String, String)>) =
+            Python::with_gil(|py| {
+                let request = self.into_py(py);
+                let wrapper: Py<PyAny> = WRAPPER.getattr(py, "wrapper")?;
+                let body: Py<PyAny> = wrapper.call1(py, (request, application))?;
+
+                body.extract(py)
+            })?;
 
         Ok(WsgiResponse {
             body,
@@ -194,6 +189,30 @@ def application(env, start_response):
         assert_eq!(body, "Hello World");
     }
 
+    #[tokio::test]
+    async fn test_wsgi_exception() {
+        let application = Python::with_gil(|py| -> Py<PyAny> {
+            PyModule::from_code_bound(
+                py,
+                "
+def application(env, start_response):
+    raise ValueError('broken')
+",
+                "broken.py",
+                "broken",
+            )
+            .unwrap()
+            .getattr("application")
+            .unwrap()
+            .into()
+        });
+
+        let request = dummy_request().await.unwrap();
+        let request = WsgiRequest::from_request(&request).unwrap();
+        let err = request.send(&application).unwrap_err();
+        assert!(err.to_string().contains("broken"));
+    }
+
     #[tokio::test]
     async fn test_django() {
         let request = dummy_request().await.unwrap();